@@ -25,6 +25,16 @@ else
 shugart=y
 endif
 
+# CRC16 bytes per step (1, 4 or 8): trades table flash for speed.
+ifneq ($(crc16_slice),)
+FLAGS += -DCRC16_SLICE=$(crc16_slice)
+endif
+
+# TestBed: dump a raw flux capture to the console each round.
+ifeq ($(flux_dump),y)
+FLAGS += -DFLUX_DUMP=1
+endif
+
 FLAGS += $(FLAGS-y)
 
 CFLAGS += $(CFLAGS-y) $(FLAGS) -include decls.h
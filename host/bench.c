@@ -0,0 +1,1332 @@
+/*
+ * bench.c
+ *
+ * Host benchmark of the flux and codec kernels.
+ *
+ * Every kernel is timed over a buffer of random data. Figures are reported
+ * per MFM bitcell of the equivalent encoded stream (16 per data byte), and
+ * as MB/s of data bytes processed, so that all kernels are comparable.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* The AmigaDOS checksums are private to amiga.c, the bitstream scanner to
+ * ibm.c, and the CRC kernels to crc.c (built here with all of them). */
+#include "../src/amiga.c"
+#include "../src/crc.c"
+#include "../src/ibm.c"
+
+/* Data bytes per timed pass, and passes per kernel. */
+#define BENCH_BYTES 8192
+#define BENCH_REPS  256
+
+static struct drive *drv;
+
+static const char *decoder_suffix[] = { "", "_table", "_pll" };
+
+static uint32_t seed = 1;
+
+static uint32_t bench_rand(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void fill_rand(void *p, unsigned int bytes)
+{
+    uint8_t *q = p;
+    while (bytes--)
+        *q++ = bench_rand() >> 24;
+}
+
+/* The codec routines peek at the data before a buffer: leave headroom. */
+static void *bench_alloc(unsigned int bytes)
+{
+    uint8_t *p = malloc(bytes + 4);
+    memset(p, 0, 4);
+    return p + 4;
+}
+
+static void bench_free(void *p)
+{
+    free((uint8_t *)p - 4);
+}
+
+static void report(const char *name, uint64_t ns, uint64_t bytes)
+{
+    uint64_t ps_per_cell = (ns * 1000) / (bytes * 16);
+    uint64_t kb_per_s = (bytes * 1000000) / (ns ?: 1);
+    printk("%-28s %4u.%02u ns/bitcell %7u.%u MB/s\n", name,
+           (unsigned int)(ps_per_cell / 1000),
+           (unsigned int)(ps_per_cell % 1000) / 10,
+           (unsigned int)(kb_per_s / 1000),
+           (unsigned int)(kb_per_s % 1000) / 100);
+}
+
+/* Random data, MFM encoded into @bc (@bytes words). The final bitcell is
+ * forced to 1: a cyclic track of this stream then starts on a flux
+ * reversal, and decodes starting exactly at bc[0]. */
+static void mk_mfm(uint16_t *bc, unsigned int bytes)
+{
+    fill_rand(bc, bytes);
+    bin_to_mfm(bc, bytes);
+    bc[bytes-1] |= htobe16(1);
+}
+
+/* Convert a bitcell buffer into a cyclic track of flux intervals. Each
+ * interval is jittered by up to +/- @cell/8 ticks. */
+static unsigned int mk_flux(
+    uint16_t *flux, const uint16_t *bc, unsigned int nr_words,
+    unsigned int cell, bool_t jitter)
+{
+    unsigned int i, j, nr = 0, run = 0;
+    uint16_t w;
+
+    for (i = 0; i < nr_words; i++) {
+        w = be16toh(bc[i]);
+        for (j = 0; j < 16; j++) {
+            run++;
+            if ((int16_t)(w << j) < 0) {
+                flux[nr++] = run * cell;
+                run = 0;
+            }
+        }
+    }
+
+    /* Trailing zeroes wrap to the first interval of the next revolution. */
+    flux[0] += run * cell;
+
+    if (jitter)
+        for (i = 0; i < nr; i++)
+            flux[i] += (int)(bench_rand() % (cell/4 + 1)) - (int)(cell/8);
+
+    return nr;
+}
+
+static void bench_flux_to_bc(
+    const char *name, unsigned int cell, unsigned int decode)
+{
+    unsigned int words = BENCH_BYTES, nr, i;
+    uint16_t *bc = bench_alloc(words*2), *out = bench_alloc(words*2);
+    uint16_t *flux = bench_alloc(words*16*2);
+    struct read rd;
+    uint64_t t, ns = 0;
+    char s[40];
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words);
+    nr = mk_flux(flux, bc, words, cell, TRUE);
+
+    for (i = 0; i < BENCH_REPS; i++) {
+        host_rdata_track(flux, nr);
+        rd.p = out;
+        rd.nr_words = words;
+        rd.sync = SYNC_none;
+        rd.decode = decode;
+        floppy_read_prep(&rd);
+        t = host_ns();
+        floppy_read(&rd);
+        ns += host_ns() - t;
+    }
+
+    WARN_ON(memcmp(out, bc, words*2));
+
+    snprintf(s, sizeof(s), "rdata_flux_to_bc%s %s",
+             decoder_suffix[decode], name);
+    report(s, ns, (uint64_t)words * BENCH_REPS);
+
+    bench_free(bc);
+    bench_free(out);
+    bench_free(flux);
+}
+
+/* The table decoder must match the loop decoder bit for bit, on arbitrary
+ * intervals up to the long-flux limit, at every data rate. */
+static void check_flux_to_bc_table(void)
+{
+    static const unsigned int cells[] = { 
+        sysclk_us(4), sysclk_us(2), sysclk_us(1), sysclk_ns(500), 65 };
+    unsigned int words = BENCH_BYTES, i, j, nr = words*4;
+    uint16_t *flux = bench_alloc(nr*2);
+    uint16_t *out[2] = { bench_alloc(words*2), bench_alloc(words*2) };
+    struct read rd;
+
+    for (i = 0; i < ARRAY_SIZE(cells); i++) {
+        drv->ticks_per_cell = cells[i];
+        for (j = 0; j < nr; j++)
+            flux[j] = 1 + bench_rand() % (6 * cells[i]);
+        for (j = 0; j < 2; j++) {
+            host_rdata_track(flux, nr);
+            rd.p = out[j];
+            rd.nr_words = words;
+            rd.sync = SYNC_none;
+            rd.decode = j ? DECODE_table : DECODE_loop;
+            floppy_read_prep(&rd);
+            floppy_read(&rd);
+        }
+        WARN_ON(memcmp(out[0], out[1], words*2));
+    }
+
+    bench_free(flux);
+    bench_free(out[0]);
+    bench_free(out[1]);
+}
+
+/* Every decoder bins each flux interval it consumes. The first interval is
+ * measured from wherever the timer was at the start of the read. */
+static void check_flux_hist(unsigned int cell)
+{
+    unsigned int words = 1024, i, j, total, diff, nr = words*16;
+    uint16_t *flux = bench_alloc(nr*2), *out = bench_alloc(words*2);
+    struct flux_hist hist;
+    uint32_t expect[64];
+    struct read rd;
+
+    drv->ticks_per_cell = cell;
+    for (j = 0; j < nr; j++)
+        flux[j] = 1 + bench_rand() % (6 * cell);
+
+    for (i = DECODE_loop; i <= DECODE_pll; i++) {
+        host_rdata_track(flux, nr);
+        floppy_set_flux_hist(&hist);
+        rd.p = out;
+        rd.nr_words = words;
+        rd.sync = SYNC_none;
+        rd.decode = i;
+        floppy_read_prep(&rd);
+        floppy_read(&rd);
+        floppy_set_flux_hist(NULL);
+
+        for (j = total = 0; j < 64; j++)
+            total += hist.bin[j];
+        WARN_ON(total > nr);
+        memset(expect, 0, sizeof(expect));
+        for (j = 0; j < min(total, nr); j++)
+            expect[min_t(unsigned int, flux[j] >> hist.shift, 63)]++;
+        for (j = diff = 0; j < 64; j++)
+            diff += (hist.bin[j] > expect[j]) ? hist.bin[j] - expect[j]
+                : expect[j] - hist.bin[j];
+        WARN_ON(diff > 2);
+        WARN_ON((cell >> hist.shift) < 8);
+        WARN_ON((cell >> hist.shift) >= 16);
+    }
+
+    bench_free(flux);
+    bench_free(out);
+}
+
+/* A raw capture stores exactly the flux intervals, until its buffer has no
+ * room for another. Flux near whole cells takes a byte apiece. */
+static void check_flux_raw(void)
+{
+    unsigned int bytes = 10000, nr = bytes, cell = sysclk_us(2), i, j, pass;
+    uint16_t *flux = bench_alloc(nr*2), *bc = bench_alloc(nr/4);
+    uint8_t *p = bench_alloc(bytes);
+    uint32_t x, shift, k;
+    struct read rd;
+
+    drv->ticks_per_cell = cell;
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 0) {
+            /* Arbitrary intervals, many far from any whole cell. */
+            for (i = 0; i < nr; i++)
+                flux[i] = 1 + bench_rand() % ((i & 1) ? 0xffff : 0x3fff);
+        } else {
+            /* MFM with +/-100ns of jitter: a byte per flux. */
+            mk_mfm(bc, nr/8);
+            nr = mk_flux(flux, bc, nr/8, cell, FALSE);
+            for (i = 0; i < nr; i++)
+                flux[i] += (int)(bench_rand() % 15) - 7;
+        }
+
+        host_rdata_track(flux, nr);
+        rd.p = p;
+        rd.nr_words = bytes/2;
+        rd.sync = SYNC_none;
+        rd.decode = DECODE_raw;
+        floppy_read_prep(&rd);
+        floppy_read(&rd);
+
+        WARN_ON(rd.raw_bytes > bytes);
+        WARN_ON((pass == 0) && (rd.raw_bytes + 3 <= bytes));
+        WARN_ON((pass == 1) && (rd.raw_bytes != rd.raw_flux));
+        for (i = j = 0; (i < rd.raw_flux) && (j < rd.raw_bytes); i++) {
+            x = shift = 0;
+            do {
+                x |= (p[j] & 0x7f) << shift;
+                shift += 7;
+            } while (p[j++] & 0x80);
+            k = x & 7;
+            x >>= 3;
+            if (k)
+                x = k * cell + ((x >> 1) ^ -(x & 1));
+            if (x != flux[i % nr])
+                break;
+        }
+        WARN_ON((i != rd.raw_flux) || (j != rd.raw_bytes));
+    }
+
+    bench_free(flux);
+    bench_free(bc);
+    bench_free(p);
+}
+
+/* A track written @drift_pct off the nominal data rate, with jitter, is
+ * beyond the fixed-cell decoders but within the PLL's lock range. The PLL
+ * must decode it exactly and report the period it was written at. */
+static void check_flux_to_bc_pll(unsigned int cell, int drift_pct)
+{
+    unsigned int words = BENCH_BYTES, nr, i, j, bad[2];
+    uint16_t *bc = bench_alloc(words*2), *out = bench_alloc(words*2);
+    uint16_t *flux = bench_alloc(words*16*2);
+    int32_t period = ((cell << 4) * (100 + drift_pct)) / 100;
+    struct read rd;
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words);
+    nr = mk_flux(flux, bc, words, (cell * (100 + drift_pct)) / 100, TRUE);
+
+    for (i = 0; i < 2; i++) {
+        host_rdata_track(flux, nr);
+        rd.p = out;
+        rd.nr_words = words;
+        rd.sync = SYNC_none;
+        rd.decode = i ? DECODE_pll : DECODE_loop;
+        floppy_read_prep(&rd);
+        floppy_read(&rd);
+        for (j = bad[i] = 0; j < words; j++)
+            bad[i] += (out[j] != bc[j]);
+    }
+
+    printk("PLL %u%+d%%: loop %u bad words, pll %u bad words, "
+           "period %u/16 (expect %u/16), peak err %u/16\n",
+           cell, drift_pct, bad[0], bad[1], rd.pll_period, period,
+           rd.pll_peak_err);
+    WARN_ON(bad[1] != 0);
+    WARN_ON((rd.pll_period - period) * (rd.pll_period - period)
+            > (int32_t)(cell * cell));
+
+    bench_free(bc);
+    bench_free(out);
+    bench_free(flux);
+}
+
+static unsigned int async_done_count;
+
+static void async_done(struct read *rd)
+{
+    async_done_count++;
+}
+
+/* An interrupt-driven read must produce the same bitcells as a polled
+ * read, both with and without a sync hunt, and report completion once. */
+static void check_read_async(unsigned int cell)
+{
+    unsigned int words = BENCH_BYTES, nr, i, j;
+    uint16_t *bc = bench_alloc((words+8)*2);
+    uint16_t *out[2] = { bench_alloc(words*2), bench_alloc(words*2) };
+    uint16_t *flux = bench_alloc((words+8)*16*2);
+    struct read rd;
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words+8);
+    bc[words] = bc[words+1] = htobe16(0x4489);
+    nr = mk_flux(flux, bc, words+8, cell, TRUE);
+
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            host_rdata_track(flux, nr);
+            rd.p = out[j];
+            rd.nr_words = words;
+            rd.sync = i ? SYNC_mfm : SYNC_none;
+            rd.decode = DECODE_table;
+            floppy_read_prep(&rd);
+            if (j) {
+                async_done_count = 0;
+                floppy_read_async(&rd, async_done);
+                WARN_ON(floppy_read_async_done());
+                floppy_read_async_wait();
+                WARN_ON(async_done_count != 1);
+            } else {
+                floppy_read(&rd);
+            }
+        }
+        WARN_ON(memcmp(out[0], out[1], words*2));
+        if (i)
+            WARN_ON(memcmp(out[1], &bc[words], 4));
+    }
+
+    bench_free(bc);
+    bench_free(out[0]);
+    bench_free(out[1]);
+    bench_free(flux);
+}
+
+/* The DMA lapping the decoder is detected, whichever decoder is running,
+ * and a full-speed read is not mistaken for one. The track is a constant
+ * two-cell interval, and each stall a whole number of 16-bit timer periods:
+ * the flux the decoder finds after a lap then look perfectly ordinary. */
+static void check_rdata_overrun(unsigned int cell)
+{
+    static const unsigned int stalls[] = { 0, 4096, 8192 };
+    unsigned int words = BENCH_BYTES, nr = 1024, i, j, overruns;
+    uint16_t *out = bench_alloc(words*2), *flux = bench_alloc(nr*2);
+    struct read rd;
+
+    /* No read so far has been overrun. */
+    WARN_ON(dma_stats.rdata_overruns != 0);
+
+    drv->ticks_per_cell = cell;
+    for (i = 0; i < nr; i++)
+        flux[i] = 2*cell;
+
+    for (i = 0; i < ARRAY_SIZE(stalls); i++) {
+        ASSERT(((stalls[i] * 2*cell) & 0xffff) == 0);
+        for (j = DECODE_loop; j <= DECODE_pll; j++) {
+            overruns = dma_stats.rdata_overruns;
+            host_rdata_track(flux, nr);
+            rd.p = out;
+            rd.nr_words = words;
+            rd.sync = SYNC_none;
+            rd.decode = j;
+            floppy_read_prep(&rd);
+            host_rdata_stall(stalls[i]);
+            floppy_read(&rd);
+            WARN_ON((dma_stats.rdata_overruns - overruns) != !!stalls[i]);
+        }
+    }
+
+    printk("DMA %u: rdata hwm %u/1024\n", cell, dma_stats.rdata_hwm);
+    memset(&dma_stats, 0, sizeof(dma_stats));
+
+    bench_free(out);
+    bench_free(flux);
+}
+
+/* Hunt a cyclic bitcell track for any of @nr_pats sync patterns, and decode
+ * the four bytes starting at the one found. Returns the pattern's index. */
+static unsigned int read_sync_pattern(
+    const uint16_t *bc, unsigned int words, unsigned int cell,
+    const struct sync_pattern *pats, unsigned int nr_pats, uint8_t *out)
+{
+    uint16_t *flux = bench_alloc(words*16*2);
+    struct read rd;
+
+    drv->ticks_per_cell = cell;
+    host_rdata_track(flux, mk_flux(flux, bc, words, cell, TRUE));
+    rd.p = out;
+    rd.nr_words = 4;
+    rd.sync = SYNC_pattern;
+    rd.sync_pats = pats;
+    rd.nr_sync_pats = nr_pats;
+    rd.decode = DECODE_table;
+    floppy_read_prep(&rd);
+    floppy_read(&rd);
+    mfm_to_bin(out, 4);
+
+    bench_free(flux);
+    return rd.sync_hit;
+}
+
+/* Each predefined mark, and a user-defined one, is found by one read that
+ * hunts for several, and the read reports which one fired. Tracks are
+ * gap filler plus the marks under test, so nothing else can match. */
+static void check_sync_patterns(void)
+{
+    static const struct sync_pattern amiga_erased = {
+        0xffffffff, 0x44a944a9, 32 };
+    const struct sync_pattern mfm_pats[] = {
+        sync_mfm_a1, sync_mfm_c2, amiga_erased };
+    const struct sync_pattern fm_pats[] = { sync_fm_c7, sync_fm_d7 };
+    const uint16_t mfm_sync[] = { 0x4489, 0x5224, 0x44a9 };
+    const unsigned int words = 256;
+    uint16_t *bc = bench_alloc(words*2);
+    uint8_t out[8];
+    unsigned int i;
+
+    /* MFM: each mark alone, then C2 ahead of A1 on the same track. */
+    for (i = 0; i <= ARRAY_SIZE(mfm_sync); i++) {
+        memset(bc, 0x4e, words);
+        bin_to_mfm(bc, words);
+        if (i == ARRAY_SIZE(mfm_sync)) {
+            bc[40] = bc[41] = htobe16(0x5224);
+            bc[42] = htobe16(bintomfm(0xfc));
+        }
+        bc[100] = bc[101] = htobe16(mfm_sync[i % ARRAY_SIZE(mfm_sync)]);
+        bc[102] = htobe16(bintomfm(0xfe));
+        WARN_ON(read_sync_pattern(bc, words, sysclk_us(2),
+                                  mfm_pats, ARRAY_SIZE(mfm_pats), out)
+                != ((i == ARRAY_SIZE(mfm_sync)) ? 1 : i));
+        WARN_ON(out[2] != ((i == ARRAY_SIZE(mfm_sync)) ? 0xfc : 0xfe));
+    }
+
+    /* FM: an IDAM (clock C7), an IAM (clock D7), then the IAM ahead of
+     * the IDAM. Each mark is preceded by a 0x00 preamble. */
+    for (i = 0; i < 3; i++) {
+        memset(bc, 0xff, words);
+        memset((uint8_t *)bc + 30, 0x00, 6);
+        memset((uint8_t *)bc + 90, 0x00, 6);
+        bin_to_fm(bc, words);
+        if (i != 0)
+            bc[(i == 1) ? 96 : 36] = htobe16(fm_sync(0xfc, 0xd7));
+        if (i != 1)
+            bc[96] = htobe16(fm_sync(0xfe, FM_SYNC_CLK));
+        WARN_ON(read_sync_pattern(bc, words, sysclk_us(4),
+                                  fm_pats, ARRAY_SIZE(fm_pats), out)
+                != !!i);
+        WARN_ON(out[0] != 0x00);
+        WARN_ON(out[1] != (i ? 0xfc : 0xfe));
+    }
+
+    bench_free(bc);
+}
+
+/* Build an IBM MFM track of @nr 512-byte sectors into @bc, returning its
+ * length in words. Sector i has R = i+1 and is filled with that value.
+ * Sector @bad_id has a bad IDAM CRC; sector @bad_dat a bad DAM CRC. */
+static unsigned int mk_ibm_mfm(
+    uint16_t *bc, unsigned int nr, int bad_id, int bad_dat)
+{
+    uint8_t *p = (uint8_t *)bc;
+    unsigned int i, pos = 0, sync[2*nr], nr_sync = 0;
+    uint16_t crc;
+
+    memset(p, 0x4e, 80);
+    pos += 80;
+    for (i = 0; i < nr; i++) {
+        /* IDAM */
+        memset(p+pos, 0x00, mfm_gap_sync);
+        pos += mfm_gap_sync;
+        sync[nr_sync++] = pos;
+        memcpy(p+pos, mfm_idam_mark, 4);
+        p[pos+4] = 0; p[pos+5] = 0; p[pos+6] = i+1; p[pos+7] = 2;
+        crc = crc16_ccitt(p+pos, 8, 0xffff) ^ (i == bad_id);
+        p[pos+8] = crc >> 8; p[pos+9] = crc;
+        pos += 10;
+        memset(p+pos, 0x4e, mfm_gap2);
+        pos += mfm_gap2;
+        /* DAM */
+        memset(p+pos, 0x00, mfm_gap_sync);
+        pos += mfm_gap_sync;
+        sync[nr_sync++] = pos;
+        memset(p+pos, 0xa1, 3);
+        p[pos+3] = 0xfb;
+        memset(p+pos+4, i+1, 512);
+        crc = crc16_ccitt(p+pos, 516, 0xffff) ^ (i == bad_dat);
+        p[pos+516] = crc >> 8; p[pos+517] = crc;
+        pos += 518;
+        memset(p+pos, 0x4e, 84);
+        pos += 84;
+    }
+
+    bin_to_mfm(bc, pos);
+    for (i = 0; i < nr_sync; i++)
+        bc[sync[i]] = bc[sync[i]+1] = bc[sync[i]+2] = htobe16(0x4489);
+    bc[pos-1] |= htobe16(1);
+
+    return pos;
+}
+
+/* One captured revolution yields every IDAM, at its bitcell offset, and the
+ * offset of each good DAM. A bad IDAM is skipped, and a bad DAM is reported
+ * as missing. */
+static void check_ibm_scan(void)
+{
+    const unsigned int nr = 9, sec = 12+10+22+12+518+84;
+    unsigned int words = (80 + nr*sec + 1) & ~1, i, j, n;
+    uint16_t *bc = bench_alloc(words*2);
+    uint16_t *out = bench_alloc((words+2)*2);
+    uint16_t *flux = bench_alloc(words*16*2);
+    struct ibm_scan_info info[12];
+    struct read rd;
+
+    memset(bc, 0x4e, words*2);
+    mk_ibm_mfm(bc, nr, 3, 5);
+    bc[words-1] |= htobe16(1);
+
+    drv->ticks_per_cell = sysclk_us(2);
+    host_rdata_track(flux, mk_flux(flux, bc, words, sysclk_us(2), TRUE));
+    rd.p = out;
+    rd.nr_words = words;
+    rd.sync = SYNC_none;
+    rd.decode = DECODE_table;
+    floppy_read_prep(&rd);
+    floppy_read(&rd);
+    out[words] = out[words+1] = 0;
+    WARN_ON(memcmp(out, bc, words*2));
+
+    n = ibm_scan_bc(out, words*16, words*16, &sync_mfm_a1, 3,
+                    info, ARRAY_SIZE(info), NULL);
+    WARN_ON(n != nr-1);
+    for (i = j = 0; i < nr; i++) {
+        if (i == 3)
+            continue;
+        WARN_ON(info[j].idam.r != i+1);
+        WARN_ON(info[j].idam.n != 2);
+        WARN_ON(info[j].ticks_past_index != (80 + i*sec + 12) * 16);
+        WARN_ON(info[j].dam_offset != ((i == 5) ? 0 : 10+22+12));
+        j++;
+    }
+
+    bench_free(bc);
+    bench_free(out);
+    bench_free(flux);
+}
+
+/* A whole-track read returns each sector once, in track order, starting
+ * from wherever the head happens to be. */
+static void check_ibm_read_track(void)
+{
+    /* Sector 3's IDAM is bad, and sector 6's is already under the head. */
+    static const uint8_t order[] = { 7, 8, 0, 1, 2, 4, 5, 6 };
+    const unsigned int nr = 9, sec_bytes = 12+10+22+12+518+84;
+    unsigned int words = (80 + nr*sec_bytes + 1) & ~1, i, j, n;
+    unsigned int bytes = (nr+2)*512 + 16;
+    uint16_t *bc = bench_alloc(words*2);
+    uint16_t *flux = bench_alloc(words*16*2);
+    uint8_t *buf = bench_alloc(bytes);
+    struct ibm_sector sec[12];
+    uint16_t *rot;
+
+    memset(bc, 0x4e, words*2);
+    mk_ibm_mfm(bc, nr, 3, 5);
+    bc[words-1] |= htobe16(1);
+
+    /* Start the head part-way through sector 6's IDAM. */
+    drv->ticks_per_cell = sysclk_us(1);
+    n = mk_flux(flux, bc, words, sysclk_us(1), TRUE);
+    for (i = j = 0; j < (80 + 6*sec_bytes + 14) * 16; i++)
+        j += (flux[i] + sysclk_us(1)/2) / sysclk_us(1);
+    rot = bench_alloc(n*2);
+    memcpy(rot, flux+i, (n-i)*2);
+    memcpy(rot+(n-i), flux, i*2);
+    host_rdata_track(rot, n);
+
+    n = ibm_mfm_read_track(buf, bytes, sec, ARRAY_SIZE(sec));
+    WARN_ON(n != ARRAY_SIZE(order));
+    for (i = 0; i < min_t(unsigned int, n, ARRAY_SIZE(order)); i++) {
+        j = order[i];
+        WARN_ON(sec[i].idam.r != j+1);
+        WARN_ON(!sec[i].data);
+        WARN_ON(sec[i].crc_ok != (j != 5));
+        WARN_ON(sec[i].data && (((uint8_t *)sec[i].data)[0] != j+1
+                                || ((uint8_t *)sec[i].data)[511] != j+1));
+    }
+
+    bench_free(bc);
+    bench_free(flux);
+    bench_free(buf);
+    bench_free(rot);
+}
+
+static void bench_wait_sync(const char *name, unsigned int cell)
+{
+    unsigned int words = BENCH_BYTES, nr, i;
+    uint16_t *bc = bench_alloc((words+8)*2);
+    uint32_t out[2];
+    uint16_t *flux = bench_alloc((words+8)*16*2);
+    struct read rd;
+    uint64_t t, ns = 0;
+    char s[40];
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words+8);
+    bc[words] = bc[words+1] = htobe16(0x4489);
+    nr = mk_flux(flux, bc, words+8, cell, TRUE);
+
+    for (i = 0; i < BENCH_REPS; i++) {
+        host_rdata_track(flux, nr);
+        rd.p = out;
+        rd.nr_words = 4;
+        rd.sync = SYNC_mfm;
+        rd.decode = DECODE_loop;
+        floppy_read_prep(&rd);
+        t = host_ns();
+        floppy_read(&rd);
+        ns += host_ns() - t;
+        WARN_ON(memcmp(out, &bc[words], 8));
+    }
+
+    snprintf(s, sizeof(s), "rdata_wait_sync %s", name);
+    report(s, ns, (uint64_t)words * BENCH_REPS);
+
+    bench_free(bc);
+    bench_free(flux);
+}
+
+/* A generated write copies its bitcells from a pre-rendered stream, a few
+ * words at a time. */
+struct copy_gen {
+    struct write wr;
+    const uint16_t *bc;
+};
+
+static void copy_gen(struct write *wr, void *p, unsigned int nr)
+{
+    struct copy_gen *g = container_of(wr, struct copy_gen, wr);
+    memcpy(p, g->bc, nr*2);
+    g->bc += nr;
+}
+
+/* A write from a generator emits exactly the flux of the same write from a
+ * pre-rendered buffer, whatever the generator's buffer size. */
+static void check_write_gen(void)
+{
+    static const unsigned int gen_words[] = { 2, 6, 64 };
+    unsigned int words = 1000, nr, i, j;
+    uint16_t *bc = bench_alloc(words*2), *cap[2];
+    uint32_t buf[32];
+    struct copy_gen g;
+
+    cap[0] = bench_alloc(words*16*2);
+    cap[1] = bench_alloc(words*16*2);
+    drv->ticks_per_cell = sysclk_us(1);
+    mk_mfm(bc, words);
+
+    host_wdata_capture(cap[0], words*16);
+    g.wr.p = bc;
+    g.wr.nr_words = words;
+    g.wr.terminate_at_index = 0;
+    g.wr.gen = NULL;
+    floppy_write_prep(&g.wr);
+    floppy_write(&g.wr);
+    nr = host_wdata_captured();
+
+    for (i = 0; i < ARRAY_SIZE(gen_words); i++) {
+        host_wdata_capture(cap[1], words*16);
+        g.bc = bc;
+        g.wr.p = buf;
+        g.wr.gen = copy_gen;
+        g.wr.gen_words = gen_words[i];
+        floppy_write_prep(&g.wr);
+        floppy_write(&g.wr);
+        WARN_ON(host_wdata_captured() != nr);
+        WARN_ON(g.bc != bc + words);
+        for (j = 0; j < min_t(unsigned int, nr, words*16); j++)
+            if (cap[0][j] != cap[1][j])
+                break;
+        WARN_ON(j != min_t(unsigned int, nr, words*16));
+    }
+
+    bench_free(bc);
+    bench_free(cap[0]);
+    bench_free(cap[1]);
+}
+
+/* Precompensation shifts each reversal by its table entry, so each interval
+ * changes by the difference of the shifts at either end. 125ns steps are a
+ * whole number of SYSCLK ticks, so there is no rounding to account for. */
+#define pc_class(n) (((n) <= 2) ? 0 : ((n) == 3) ? 1 : 2)
+static void check_write_precomp(void)
+{
+    static const struct precomp_band band[] = {
+        { 0, { { 0, -125, -250 }, { 125, 0, -125 }, { 250, 125, 0 } } },
+        { 1, { { 0 } } } };
+    unsigned int words = 1000, cell = sysclk_us(2), nr, i, j, k, run;
+    uint16_t *bc = bench_alloc(words*2), *cap = bench_alloc(words*16*2);
+    uint16_t *n = bench_alloc(words*16*2);
+    int s, prev_s = 0;
+    struct write wr;
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words);
+
+    /* Ideal intervals, in bitcells. */
+    for (i = nr = run = 0; i < words; i++) {
+        for (j = 0; j < 16; j++) {
+            run++;
+            if ((int16_t)(be16toh(bc[i]) << j) < 0) {
+                n[nr++] = run;
+                run = 0;
+            }
+        }
+    }
+
+    floppy_set_precomp(band, ARRAY_SIZE(band));
+    host_wdata_capture(cap, words*16);
+    wr.p = bc;
+    wr.nr_words = words;
+    wr.terminate_at_index = 0;
+    wr.gen = NULL;
+    floppy_write_prep(&wr);
+    floppy_write(&wr);
+    floppy_set_precomp(NULL, 0);
+
+    WARN_ON(host_wdata_captured() < nr);
+    for (k = 0; k < nr; k++) {
+        s = (k == nr-1) ? 0 : 9 * (pc_class(n[k]) - pc_class(n[k+1]));
+        if (cap[k] + 1 != n[k] * cell + s - prev_s)
+            break;
+        prev_s = s;
+    }
+    WARN_ON(k != nr);
+
+    bench_free(bc);
+    bench_free(cap);
+    bench_free(n);
+}
+
+/* Jitter as large as it goes, on a reversal every cell: adjacent shifts
+ * differ by more than the interval between them. No interval may be emitted
+ * shorter than half a cell, and the write must keep its overall length. */
+static void check_write_jitter_clamp(void)
+{
+    struct jitter jitter = { JITTER_uniform, 2000, 99, 1000 };
+    unsigned int words = 256, cell = sysclk_us(1), nr = words*16, k;
+    uint16_t *bc = bench_alloc(words*2);
+    uint16_t *cap = bench_alloc(nr*2);
+    uint32_t total = 0;
+    struct write wr;
+
+    drv->ticks_per_cell = cell;
+    memset(bc, 0xff, words*2);
+
+    floppy_set_jitter(&jitter);
+    host_wdata_capture(cap, nr);
+    wr.p = bc;
+    wr.nr_words = words;
+    wr.terminate_at_index = 0;
+    wr.gen = NULL;
+    floppy_write_prep(&wr);
+    floppy_write(&wr);
+    floppy_set_jitter(NULL);
+    WARN_ON(host_wdata_captured() < nr);
+
+    for (k = 0; k < nr; k++) {
+        if (cap[k] + 1 < cell/2)
+            break;
+        total += cap[k] + 1;
+    }
+    WARN_ON(k != nr);
+    WARN_ON((total > nr*cell + cell) || (total + cell < nr*cell));
+
+    bench_free(bc);
+    bench_free(cap);
+}
+
+/* Jitter displaces each reversal, within its bound, by the same sequence for
+ * every write with the same settings. The displacement of each reversal is
+ * recovered by summing the captured intervals against the ideal ones. */
+static void check_write_jitter(unsigned int mode)
+{
+    struct jitter jitter = { mode, 500, 1234, 1000 };
+    unsigned int words = 1000, cell = sysclk_us(2), nr, i, j, k, run;
+    uint16_t *bc = bench_alloc(words*2), *cap[2];
+    uint16_t *n = bench_alloc(words*16*2);
+    int s, amp = sysclk_ns(jitter.ns), peak = 0;
+    struct write wr;
+
+    cap[0] = bench_alloc(words*16*2);
+    cap[1] = bench_alloc(words*16*2);
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words);
+
+    for (i = nr = run = 0; i < words; i++) {
+        for (j = 0; j < 16; j++) {
+            run++;
+            if ((int16_t)(be16toh(bc[i]) << j) < 0) {
+                n[nr++] = run;
+                run = 0;
+            }
+        }
+    }
+
+    floppy_set_jitter(&jitter);
+    for (i = 0; i < 2; i++) {
+        host_wdata_capture(cap[i], words*16);
+        wr.p = bc;
+        wr.nr_words = words;
+        wr.terminate_at_index = 0;
+        wr.gen = NULL;
+        floppy_write_prep(&wr);
+        floppy_write(&wr);
+        WARN_ON(host_wdata_captured() < nr);
+    }
+    floppy_set_jitter(NULL);
+
+    for (k = s = 0; k < nr; k++) {
+        s += cap[0][k] + 1 - n[k] * cell;
+        if ((s > amp + 1) || (s < -amp - 1))
+            break;
+        peak = max_t(int, peak, max_t(int, s, -s));
+    }
+    WARN_ON(k != nr);
+    WARN_ON((s > 1) || (s < -1));
+    WARN_ON(peak < amp/2);
+    WARN_ON(memcmp(cap[0], cap[1], nr*2));
+
+    bench_free(bc);
+    bench_free(cap[0]);
+    bench_free(cap[1]);
+    bench_free(n);
+}
+
+/* A skewed write stretches every bitcell, to the nearest 1/16 SYSCLK tick
+ * below, and the fractions of a tick are carried rather than lost. */
+static void check_write_skew(int ppm)
+{
+    unsigned int words = 1000, cell = sysclk_us(2), nr, i;
+    uint16_t *bc = bench_alloc(words*2), *flux = bench_alloc(words*16*2);
+    uint16_t *cap = bench_alloc(words*16*2);
+    uint32_t skewed = ((cell << 4) * (int64_t)(1000000 + ppm)) / 1000000;
+    uint64_t ideal = 0, actual = 0;
+    struct write wr;
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words);
+    nr = mk_flux(flux, bc, words, cell, FALSE);
+
+    floppy_set_write_skew(ppm);
+    host_wdata_capture(cap, words*16);
+    wr.p = bc;
+    wr.nr_words = words;
+    wr.terminate_at_index = 0;
+    wr.gen = NULL;
+    floppy_write_prep(&wr);
+    floppy_write(&wr);
+    floppy_set_write_skew(0);
+
+    WARN_ON(host_wdata_captured() < nr);
+    for (i = 1; i < nr; i++) {
+        ideal += (flux[i] / cell) * skewed;
+        actual += cap[i] + 1;
+        if ((actual != (ideal >> 4)) && (actual != (ideal >> 4) + 1))
+            break;
+    }
+    WARN_ON(i != nr);
+
+    bench_free(bc);
+    bench_free(flux);
+    bench_free(cap);
+}
+
+static void bench_bc_to_flux(const char *name, unsigned int cell)
+{
+    unsigned int words = BENCH_BYTES, nr, i;
+    uint16_t *bc = bench_alloc(words*2), *flux = bench_alloc(words*16*2);
+    uint16_t *cap = bench_alloc(words*16*2);
+    struct write wr;
+    uint64_t t, ns = 0;
+    char s[40];
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words);
+    nr = mk_flux(flux, bc, words, cell, FALSE);
+
+    for (i = 0; i < BENCH_REPS; i++) {
+        host_wdata_capture(cap, words*16);
+        wr.p = bc;
+        wr.nr_words = words;
+        wr.terminate_at_index = 0;
+        wr.gen = NULL;
+        t = host_ns();
+        floppy_write_prep(&wr);
+        floppy_write(&wr);
+        ns += host_ns() - t;
+    }
+
+    /* The first interval is measured from the start of the write, not from
+     * the final flux of the previous revolution. */
+    WARN_ON(host_wdata_captured() < nr);
+    for (i = 1; i < nr; i++)
+        if (cap[i] + 1 != flux[i])
+            break;
+    WARN_ON(i != nr);
+
+    snprintf(s, sizeof(s), "_wdata_bc_to_flux %s", name);
+    report(s, ns, (uint64_t)words * BENCH_REPS);
+
+    bench_free(bc);
+    bench_free(flux);
+    bench_free(cap);
+}
+
+/* Refill cost per flux, 32 flux at a time: this bounds how small a
+ * latency-sensitive refill may be. */
+static void bench_write_refill(const char *name, unsigned int cell)
+{
+    unsigned int words = BENCH_BYTES, nr, i;
+    uint16_t *bc = bench_alloc(words*2);
+    uint64_t t, ns = 0, flux = 0;
+    struct write wr;
+    char s[40];
+
+    drv->ticks_per_cell = cell;
+    mk_mfm(bc, words);
+
+    for (i = 0; i < BENCH_REPS; i++) {
+        wr.p = bc;
+        wr.nr_words = words;
+        wr.terminate_at_index = 0;
+        wr.gen = NULL;
+        t = host_ns();
+        floppy_write_bench(&wr, &nr);
+        ns += host_ns() - t;
+        flux += nr;
+    }
+
+    ns = (ns * 100) / flux;
+    snprintf(s, sizeof(s), "wdata refill %s", name);
+    printk("%-28s %4u.%02u ns/flux\n", s,
+           (unsigned int)(ns / 100), (unsigned int)(ns % 100));
+
+    bench_free(bc);
+}
+
+/* The table decode matches gathering the data bits one at a time, for
+ * every MFM word. */
+static void check_mfmtobin(void)
+{
+    unsigned int x, i;
+    uint8_t y;
+
+    for (x = 0; x < 0x10000; x++) {
+        for (i = y = 0; i < 8; i++)
+            y |= ((x >> (2*i)) & 1) << i;
+        WARN_ON(mfmtobin(x) != y);
+    }
+}
+
+/* A missing FM clock is counted, though the data decodes as before. */
+static void check_fm_nr_bad(void)
+{
+    uint8_t dat[16];
+    uint16_t bc[16];
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(dat); i++)
+        dat[i] = i * 37;
+    memcpy(bc, dat, sizeof(dat));
+    bin_to_fm(bc, ARRAY_SIZE(bc));
+    WARN_ON(fm_nr_bad(bc, ARRAY_SIZE(bc)) != 0);
+    bc[5] &= htobe16(0xf7ff);
+    bc[9] &= htobe16(0x7fff);
+    WARN_ON(fm_nr_bad(bc, ARRAY_SIZE(bc)) != 2);
+    fm_to_bin(bc, ARRAY_SIZE(bc));
+    WARN_ON(memcmp(bc, dat, sizeof(dat)));
+}
+
+static void bench_mfm(void)
+{
+    unsigned int bytes = BENCH_BYTES, i;
+    uint8_t *dat = bench_alloc(bytes), *p = bench_alloc(bytes*2);
+    uint64_t t, ns_enc = 0, ns_dec = 0;
+
+    fill_rand(dat, bytes);
+
+    for (i = 0; i < BENCH_REPS; i++) {
+        memcpy(p, dat, bytes);
+        t = host_ns();
+        bin_to_mfm(p, bytes);
+        ns_enc += host_ns() - t;
+        t = host_ns();
+        mfm_to_bin(p, bytes);
+        ns_dec += host_ns() - t;
+    }
+
+    WARN_ON(memcmp(p, dat, bytes));
+
+    report("bin_to_mfm", ns_enc, (uint64_t)bytes * BENCH_REPS);
+    report("mfm_to_bin", ns_dec, (uint64_t)bytes * BENCH_REPS);
+
+    bench_free(dat);
+    bench_free(p);
+}
+
+/* The fused sector decode against the three passes it replaces: MFM check,
+ * decode, then CRC. A single flipped clock bit is reported as bad MFM. */
+static void bench_mfm_crc(void)
+{
+    unsigned int bytes = BENCH_BYTES, i, bad;
+    uint8_t *dat = bench_alloc(bytes+1), *p = bench_alloc((bytes+1)*2);
+    uint16_t crc, crc2, *w = (uint16_t *)p + 1;
+    uint64_t t, ns_sep = 0, ns_fused = 0;
+
+    fill_rand(dat, bytes+1);
+
+    for (i = crc = 0; i < BENCH_REPS; i++) {
+        memcpy(p, dat, bytes+1);
+        bin_to_mfm(p, bytes+1);
+        t = host_ns();
+        mfm_check(w, bytes);
+        mfm_to_bin(w, bytes);
+        crc = crc16_ccitt(w, bytes, crc);
+        ns_sep += host_ns() - t;
+    }
+
+    for (i = crc2 = 0; i < BENCH_REPS; i++) {
+        memcpy(p, dat, bytes+1);
+        bin_to_mfm(p, bytes+1);
+        t = host_ns();
+        crc2 = mfm_to_bin_crc(w, w, bytes, crc2, &bad);
+        ns_fused += host_ns() - t;
+        WARN_ON(bad);
+    }
+
+    WARN_ON(crc != crc2);
+    WARN_ON(memcmp(w, dat+1, bytes));
+
+    report("mfm_check+to_bin+crc16", ns_sep, (uint64_t)bytes * BENCH_REPS);
+    report("mfm_to_bin_crc", ns_fused, (uint64_t)bytes * BENCH_REPS);
+
+    /* Decoding down to a lower address, as ibm_read_track() does. */
+    memcpy(p, dat, bytes+1);
+    bin_to_mfm(p, bytes+1);
+    crc2 = mfm_to_bin_crc(p, w, bytes, 0xffff, &bad);
+    WARN_ON(bad || memcmp(p, dat+1, bytes));
+    WARN_ON(crc2 != crc16_ccitt(dat+1, bytes, 0xffff));
+
+    /* A flipped clock bit is bad MFM. A flipped data bit fails the CRC. */
+    for (i = 0; i < 2; i++) {
+        memcpy(p, dat, bytes+1);
+        bin_to_mfm(p, bytes+1);
+        w[bytes/2] ^= htobe16(i ? 0x0001 : 0x8000);
+        crc = mfm_to_bin_crc(w, w, bytes, 0xffff, &bad);
+        WARN_ON(i ? (crc == crc2) : (bad != 1));
+    }
+
+    bench_free(dat);
+    bench_free(p);
+}
+
+static const struct {
+    const char *name;
+    uint16_t (*fn)(const uint8_t *, size_t, uint16_t);
+} crc16_kernels[] = {
+    { "crc16_slice1", crc16_slice1 },
+    { "crc16_slice4", crc16_slice4 },
+    { "crc16_slice8", crc16_slice8 }
+};
+
+/* Bit at a time, straight from the polynomial. */
+static uint16_t crc16_bitwise(const uint8_t *b, size_t len, uint16_t crc)
+{
+    unsigned int i;
+
+    while (len--) {
+        crc ^= *b++ << 8;
+        for (i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+/* Every slicing matches the bitwise CRC exactly, at every length up to and
+ * beyond a whole slice, at every alignment, and from any initial value. */
+static void check_crc(void)
+{
+    unsigned int bytes = 64, off, len, i;
+    uint8_t *p = bench_alloc(bytes + 8);
+    uint16_t init, crc;
+
+    fill_rand(p, bytes + 8);
+
+    for (off = 0; off < 8; off++) {
+        for (len = 0; len <= bytes; len++) {
+            init = bench_rand();
+            crc = crc16_bitwise(p + off, len, init);
+            for (i = 0; i < ARRAY_SIZE(crc16_kernels); i++)
+                WARN_ON((*crc16_kernels[i].fn)(p + off, len, init) != crc);
+        }
+    }
+
+    bench_free(p);
+}
+
+/* Combining and fill CRCs match the byte-wise CRC, and the cached mark
+ * states match the CRC of the marks they stand for. */
+static void check_crc_combine(void)
+{
+    static const uint8_t marks[] = { 0xfe, 0xfb, 0xf8, 0xfc };
+    static const uint8_t a1[] = { 0xa1, 0xa1, 0xa1 };
+    unsigned int bytes = 4096, i, split, len;
+    uint8_t *p = bench_alloc(bytes);
+    uint16_t init, crc;
+
+    fill_rand(p, bytes);
+
+    for (i = 0; i < 256; i++) {
+        len = bench_rand() % bytes;
+        split = len ? bench_rand() % len : 0;
+        init = bench_rand();
+        crc = crc16_combine(crc16_ccitt(p, split, init),
+                            crc16_ccitt(p + split, len - split, 0),
+                            len - split);
+        WARN_ON(crc != crc16_ccitt(p, len, init));
+    }
+
+    for (len = 0; len <= bytes; len = len ? len * 2 : 1) {
+        init = bench_rand();
+        memset(p, len, len);
+        WARN_ON(crc16_fill(len, len, init) != crc16_ccitt(p, len, init));
+        memset(p, 0x4e, len+1);
+        WARN_ON(crc16_fill(0x4e, len+1, init) != crc16_ccitt(p, len+1, init));
+    }
+
+    for (i = 0; i < ARRAY_SIZE(marks); i++) {
+        crc = crc16_ccitt(a1, 3, 0xffff);
+        WARN_ON(mark_crc(3, marks[i]) != crc16_ccitt(&marks[i], 1, crc));
+        WARN_ON(mark_crc(1, marks[i]) != crc16_ccitt(&marks[i], 1, 0xffff));
+    }
+
+    bench_free(p);
+}
+
+static void bench_crc_fill(void)
+{
+    unsigned int bytes = BENCH_BYTES, i;
+    uint8_t *p = bench_alloc(bytes);
+    uint16_t crc, fill;
+    uint64_t t, ns;
+
+    memset(p, 0xe2, bytes);
+
+    for (i = ns = 0, crc = 0xffff; i < BENCH_REPS; i++) {
+        t = host_ns();
+        crc = crc16_ccitt(p, bytes, crc);
+        ns += host_ns() - t;
+    }
+    report("crc16_ccitt(fill)", ns, (uint64_t)bytes * BENCH_REPS);
+
+    for (i = ns = 0, fill = 0xffff; i < BENCH_REPS; i++) {
+        t = host_ns();
+        fill = crc16_fill(0xe2, bytes, fill);
+        ns += host_ns() - t;
+    }
+    report("crc16_fill", ns, (uint64_t)bytes * BENCH_REPS);
+
+    WARN_ON(fill != crc);
+
+    bench_free(p);
+}
+
+static void bench_crc(void)
+{
+    unsigned int bytes = BENCH_BYTES, i, j;
+    uint8_t *p = bench_alloc(bytes);
+    uint16_t crc = 0xffff;
+    uint64_t t, ns;
+
+    fill_rand(p, bytes);
+
+    for (j = 0; j < ARRAY_SIZE(crc16_kernels); j++) {
+        for (i = ns = 0; i < BENCH_REPS; i++) {
+            t = host_ns();
+            crc = (*crc16_kernels[j].fn)(p, bytes, crc);
+            ns += host_ns() - t;
+        }
+        report(crc16_kernels[j].name, ns, (uint64_t)bytes * BENCH_REPS);
+    }
+
+    /* CRC over (data + CRC) is zero. */
+    crc = crc16_ccitt(p, bytes-2, 0xffff);
+    p[bytes-2] = crc >> 8;
+    p[bytes-1] = crc;
+    WARN_ON(crc16_ccitt(p, bytes, 0xffff));
+
+    bench_free(p);
+}
+
+static void bench_amiga(void)
+{
+    unsigned int bytes = BENCH_BYTES, i;
+    uint32_t *p = bench_alloc(bytes), csum = 0;
+    uint64_t t, ns_mfm = 0, ns_dat = 0;
+
+    fill_rand(p, bytes);
+
+    for (i = 0; i < BENCH_REPS; i++) {
+        t = host_ns();
+        csum ^= amigados_mfm_checksum(p, bytes/4);
+        ns_mfm += host_ns() - t;
+        t = host_ns();
+        csum ^= amigados_dat_checksum(p, bytes);
+        ns_dat += host_ns() - t;
+    }
+
+    /* Each checksum was folded in an even number of times. */
+    WARN_ON(csum != 0);
+
+    /* The MFM checksum runs over encoded longs: 2 bytes per data byte. */
+    report("amigados_mfm_checksum", ns_mfm, (uint64_t)bytes/2 * BENCH_REPS);
+    report("amigados_dat_checksum", ns_dat, (uint64_t)bytes * BENCH_REPS);
+
+    bench_free(p);
+}
+
+int main(int argc, char **argv)
+{
+    floppy_init();
+    floppy_select(0);
+    drv = cur_drive;
+
+    printk("** FlashFloppy TestBed: host benchmark\n");
+
+    bench_flux_to_bc("DD", sysclk_us(2), DECODE_loop);
+    bench_flux_to_bc("HD", sysclk_us(1), DECODE_loop);
+    bench_flux_to_bc("ED", sysclk_ns(500), DECODE_loop);
+    bench_flux_to_bc("DD", sysclk_us(2), DECODE_table);
+    bench_flux_to_bc("HD", sysclk_us(1), DECODE_table);
+    bench_flux_to_bc("ED", sysclk_ns(500), DECODE_table);
+    bench_flux_to_bc("DD", sysclk_us(2), DECODE_pll);
+    bench_flux_to_bc("HD", sysclk_us(1), DECODE_pll);
+    bench_flux_to_bc("ED", sysclk_ns(500), DECODE_pll);
+    check_flux_to_bc_table();
+    check_flux_hist(sysclk_us(2));
+    check_flux_hist(sysclk_ns(500));
+    check_flux_raw();
+    check_flux_to_bc_pll(sysclk_us(2), 11);
+    check_flux_to_bc_pll(sysclk_us(1), -11);
+    check_read_async(sysclk_us(2));
+    check_read_async(sysclk_ns(500));
+    check_rdata_overrun(sysclk_us(1));
+    check_sync_patterns();
+    check_ibm_scan();
+    check_ibm_read_track();
+    bench_wait_sync("DD", sysclk_us(2));
+    bench_wait_sync("HD", sysclk_us(1));
+    bench_wait_sync("ED", sysclk_ns(500));
+    check_write_gen();
+    check_write_precomp();
+    check_write_jitter(JITTER_uniform);
+    check_write_jitter(JITTER_gaussian);
+    check_write_jitter(JITTER_wow);
+    check_write_jitter_clamp();
+    check_write_skew(-37000);
+    check_write_skew(61000);
+    bench_bc_to_flux("DD", sysclk_us(2));
+    bench_bc_to_flux("HD", sysclk_us(1));
+    bench_bc_to_flux("ED", sysclk_ns(500));
+    bench_write_refill("250kbps", sysclk_us(2));
+    bench_write_refill("500kbps", sysclk_us(1));
+    bench_write_refill("1000kbps", sysclk_ns(500));
+    check_mfmtobin();
+    check_fm_nr_bad();
+    bench_mfm();
+    bench_mfm_crc();
+    check_crc();
+    check_crc_combine();
+    bench_crc();
+    bench_crc_fill();
+    bench_amiga();
+
+    if (host_warn_count()) {
+        printk("** %u warnings\n", host_warn_count());
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,35 @@
+/*
+ * decls.h
+ *
+ * Host build: pull in all other header files in an orderly fashion. Portable
+ * headers come from inc/. Target-specific headers are replaced by the host
+ * stand-ins in this directory, which are found first on the include path.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "stm32f10x_regs.h"
+#include "stm32f10x.h"
+#include "intrinsics.h"
+
+#include "time.h"
+#include "util.h"
+#include "da.h"
+#include "timer.h"
+#include "floppy.h"
+#include "host.h"
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
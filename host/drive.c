@@ -0,0 +1,439 @@
+/*
+ * drive.c
+ *
+ * Host build: a virtual FlashFloppy (Gotek) drive, attached to the bus of
+ * the peripheral model (sim.c), and serving the disk images in a host
+ * directory (image.c).
+ *
+ * The disk turns from time zero, at the revolution period of the track
+ * beneath the head. Each track is rendered from its image when first
+ * visited, and keeps whatever is written to it: a write replaces the flux
+ * beneath the head between WGATE on and WGATE off. Sector images (image.c)
+ * instead take in the sectors written, and the track is rendered afresh.
+ * Images stay loaded once selected, so writes persist across reselection,
+ * but image files are never modified.
+ *
+ * Inputs to the controller are qualified by SELECT. READY follows MOTOR ON
+ * after a spin-up delay, and INDEX pulses only while READY. DSKCHG is
+ * asserted from power on until the first step pulse.
+ *
+ * Direct access (see src/da.c): cylinders 254 (FM) and 255 (MFM) hold a
+ * status sector. A command sector written to cylinder 255 may select an
+ * image by name, which is inserted when the head next steps out of
+ * cylinder 255: DSKCHG is asserted until a step pulse after the new image
+ * is mounted.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define NR_CYLS 256
+#define DA_FM_CYL  254
+#define DA_MFM_CYL 255
+
+/* Index pulse width. */
+#define INDEX_TICKS sysclk_ms(2)
+
+/* Motor on to READY: as motor-delay in scripts/FF.CFG. */
+#define SPINUP_TICKS sysclk_ms(200)
+
+/* Eject to new image mounted. */
+#define MOUNT_TICKS sysclk_ms(50)
+
+#define NEVER (~0ull)
+
+#define CMD_NOP          0
+#define CMD_SELECT_NAME 10
+
+/* A disk: an image (NULL if blank), and the flux of each track. */
+static struct disk {
+    char name[64];
+    struct image *im;
+    struct drive_track tracks[DA_FM_CYL][2];
+    struct disk *next;
+} blank, *disks;
+
+/* Direct-access tracks, rendered from the status sector. */
+static struct drive_track da_tracks[NR_CYLS - DA_FM_CYL];
+
+static struct {
+    const char *dir;
+    /* Bus outputs, as last seen. */
+    unsigned int out;
+    unsigned int cyl;
+    bool_t dskchg, wrprot;
+    /* Inserted disk (NULL if none), and the one selected to replace it. */
+    struct disk *disk, *next_disk;
+    uint64_t mount_at;
+    /* MOTOR ON to READY. */
+    uint64_t ready_at;
+    /* Write in progress: start time, and reversals (absolute times). */
+    bool_t writing;
+    uint64_t write_start;
+    uint64_t *wr;
+    unsigned int wr_nr, wr_max;
+    unsigned int gen;
+    struct da_status_sector da;
+} drv = {
+    .dir = "images",
+    .dskchg = TRUE,
+    .disk = &blank,
+    .ready_at = NEVER,
+    .da = {
+        .sig = "HxCFEDA",
+        .fw_ver = "host",
+        .SD_CD = 1,
+        .nr_sec = 1
+    }
+};
+
+#define asserted(line) (drv.out & (line))
+
+static bool_t ready(uint64_t now)
+{
+    return asserted(DRIVE_sel) && (drv.disk != NULL)
+        && (now >= drv.ready_at);
+}
+
+static void track_free(struct drive_track *trk)
+{
+    free(trk->flux);
+    free(trk->index);
+    memset(trk, 0, sizeof(*trk));
+}
+
+static struct drive_track *cur_track(void)
+{
+    unsigned int side = !!asserted(DRIVE_side);
+    struct drive_track *trk;
+
+    if (drv.cyl >= DA_FM_CYL) {
+        trk = &da_tracks[drv.cyl - DA_FM_CYL];
+        if (!trk->period)
+            image_render_da(drv.cyl, &drv.da, trk);
+    } else {
+        trk = &drv.disk->tracks[drv.cyl][side];
+        if (!trk->period)
+            image_render(drv.disk->im, drv.cyl, side, trk);
+    }
+
+    return trk;
+}
+
+static struct disk *disk_open(const char *name)
+{
+    struct disk *d;
+    struct image *im;
+
+    for (d = disks; d != NULL; d = d->next)
+        if (!strcmp(d->name, name))
+            return d;
+
+    if ((im = image_open(drv.dir, name)) == NULL)
+        return NULL;
+    d = malloc(sizeof(*d));
+    BUG_ON(d == NULL);
+    memset(d, 0, sizeof(*d));
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    d->im = im;
+    d->next = disks;
+    disks = d;
+    return d;
+}
+
+/* Replace the flux in the angular window of the write just finished. */
+static void write_splice(uint64_t end)
+{
+    struct drive_track *trk = cur_track();
+    uint32_t period = trk->period;
+    uint64_t len = end - drv.write_start;
+    uint32_t a0 = drv.write_start % period, a;
+    unsigned int i, j, nr, first = 0;
+    uint32_t *flux;
+
+    /* A write longer than a revolution overwrites itself: keep its last
+     * revolution. */
+    if (len >= period) {
+        drv.write_start = end - period;
+        a0 = drv.write_start % period;
+        len = period;
+        while ((first < drv.wr_nr) && (drv.wr[first] < drv.write_start))
+            first++;
+    }
+
+    flux = malloc((trk->nr_flux + drv.wr_nr - first + 1) * sizeof(*flux));
+    BUG_ON(flux == NULL);
+
+    /* In angular order from the start of the write: the new flux, then
+     * the old flux beyond the end of the write. */
+    nr = 0;
+    for (i = first; i < drv.wr_nr; i++)
+        flux[nr++] = (drv.wr[i] - drv.write_start + a0) % period;
+    for (i = 0; (i < trk->nr_flux) && (trk->flux[i] < a0); i++)
+        continue;
+    for (j = 0; j < trk->nr_flux; j++) {
+        a = trk->flux[(i + j) % trk->nr_flux];
+        if (((a + period - a0) % period) >= len)
+            flux[nr++] = a;
+    }
+
+    /* Rotate to start from the track start. */
+    for (i = 0; (i < nr) && (flux[i] >= a0); i++)
+        continue;
+    free(trk->flux);
+    trk->flux = malloc((nr + 1) * sizeof(*flux));
+    BUG_ON(trk->flux == NULL);
+    memcpy(trk->flux, flux + i, (nr - i) * sizeof(*flux));
+    memcpy(trk->flux + nr - i, flux, i * sizeof(*flux));
+    trk->nr_flux = nr;
+    free(flux);
+}
+
+static void da_command(const struct da_cmd_sector *cmd)
+{
+    const char *name = (const char *)cmd->param;
+    struct disk *d;
+
+    if (strncmp(cmd->sig, "HxCFEDA", sizeof(cmd->sig)))
+        return;
+
+    drv.da.cmd_cnt++;
+    drv.da.last_cmd_status = 0;
+    switch (cmd->cmd) {
+    case CMD_NOP:
+        break;
+    case CMD_SELECT_NAME:
+        if ((d = disk_open(name)) != NULL) {
+            drv.next_disk = d;
+        } else {
+            printk("** DA: No image '%s' in %s\n", name, drv.dir);
+            drv.da.last_cmd_status = 1;
+        }
+        break;
+    default:
+        drv.da.last_cmd_status = 1;
+        break;
+    }
+}
+
+/* Decode a sector written to the MFM direct-access track, and act on it as
+ * a command. */
+static void da_write(void)
+{
+    static const uint8_t a1[] = { 0xa1, 0xa1, 0xa1 };
+    uint32_t cell = sysclk_us(2), cells;
+    uint8_t sec[1 + 512 + 2], b;
+    unsigned int i, j, nr = 0, bits = 0;
+    uint64_t w = 0, prev = drv.write_start;
+    bool_t sync = FALSE;
+
+    if (drv.cyl != DA_MFM_CYL)
+        return;
+
+    drv.da.write_cnt++;
+    for (i = 0; (i < drv.wr_nr) && (nr < sizeof(sec)); i++) {
+        cells = (drv.wr[i] - prev + cell/2) / cell;
+        prev = drv.wr[i];
+        while (cells-- && (nr < sizeof(sec))) {
+            w = (w << 1) | !cells;
+            if (!sync) {
+                /* Three A1 sync marks. */
+                sync = ((w & 0xffffffffffffull) == 0x448944894489ull);
+            } else if (++bits == 16) {
+                /* Data bits are the odd bitcells. */
+                for (j = b = 0; j < 8; j++)
+                    b |= ((w >> (2*j)) & 1) << j;
+                sec[nr++] = b;
+                bits = 0;
+            }
+        }
+    }
+
+    if ((nr == sizeof(sec)) && (sec[0] == 0xfb)
+        && (crc16_ccitt(sec, sizeof(sec), crc16_ccitt(a1, 3, 0xffff)) == 0))
+        da_command((const struct da_cmd_sector *)&sec[1]);
+
+    /* Re-render the status sector. */
+    for (i = 0; i < ARRAY_SIZE(da_tracks); i++)
+        track_free(&da_tracks[i]);
+}
+
+void drive_init(const char *image_dir)
+{
+    drv.dir = image_dir;
+}
+
+void drive_outputs(uint64_t now, unsigned int out)
+{
+    unsigned int changed = drv.out ^ out, prev = drv.out;
+
+    if (!changed)
+        return;
+    drv.out = out;
+    drv.gen++;
+
+    if (changed & DRIVE_motor)
+        drv.ready_at = (out & DRIVE_motor) ? now + SPINUP_TICKS : NEVER;
+
+    /* Step on the leading edge of the pulse. */
+    if ((changed & out & DRIVE_step) && (out & DRIVE_sel)) {
+        if (out & DRIVE_dir) {
+            if (drv.cyl < NR_CYLS-1)
+                drv.cyl++;
+        } else if (drv.cyl > 0) {
+            if ((drv.cyl == DA_MFM_CYL) && (drv.next_disk != NULL)) {
+                /* Eject. */
+                drv.disk = NULL;
+                drv.dskchg = TRUE;
+                drv.mount_at = now + MOUNT_TICKS;
+            }
+            drv.cyl--;
+        }
+        if ((drv.disk == NULL) && (drv.next_disk != NULL)
+            && (now >= drv.mount_at)) {
+            /* Insert. */
+            drv.disk = drv.next_disk;
+            drv.next_disk = NULL;
+            if (out & DRIVE_motor)
+                drv.ready_at = now + SPINUP_TICKS;
+        }
+        if (drv.disk != NULL)
+            drv.dskchg = FALSE;
+    }
+
+    if ((changed & out & DRIVE_wgate) && ready(now) && !drv.wrprot) {
+        drv.writing = TRUE;
+        drv.write_start = now;
+        drv.wr_nr = 0;
+    } else if ((changed & prev & DRIVE_wgate) && drv.writing) {
+        drv.writing = FALSE;
+        if (drv.cyl >= DA_FM_CYL)
+            da_write();
+        else
+            write_splice(now);
+        if ((drv.cyl < DA_FM_CYL)
+            && image_write(drv.disk->im, drv.cyl, !!asserted(DRIVE_side),
+                           cur_track()))
+            track_free(cur_track());
+    }
+}
+
+static bool_t index_asserted(uint64_t now)
+{
+    struct drive_track *trk = cur_track();
+    uint32_t a = now % trk->period;
+    unsigned int i;
+
+    for (i = 0; i < trk->nr_index; i++)
+        if (((a + trk->period - trk->index[i]) % trk->period) < INDEX_TICKS)
+            return TRUE;
+    return FALSE;
+}
+
+unsigned int drive_inputs(uint64_t now)
+{
+    unsigned int in = 0;
+
+    if (!asserted(DRIVE_sel))
+        return 0;
+    if (ready(now)) {
+        in |= DRIVE_ready;
+        if (index_asserted(now))
+            in |= DRIVE_index;
+    }
+    if (drv.cyl == 0)
+        in |= DRIVE_trk0;
+    if (drv.dskchg)
+        in |= DRIVE_dskchg;
+    if (drv.wrprot)
+        in |= DRIVE_wrprot;
+
+    return in;
+}
+
+uint64_t drive_next_edge(uint64_t t)
+{
+    struct drive_track *trk;
+    uint32_t a, e, d, best = ~0u;
+    unsigned int i;
+
+    if (!asserted(DRIVE_sel) || (drv.disk == NULL)
+        || (drv.ready_at == NEVER))
+        return NEVER;
+    if (t < drv.ready_at)
+        return drv.ready_at;
+
+    /* Nearest leading or trailing edge of an index pulse. */
+    trk = cur_track();
+    a = t % trk->period;
+    for (i = 0; i < 2*trk->nr_index; i++) {
+        e = (trk->index[i/2] + ((i & 1) ? INDEX_TICKS : 0)) % trk->period;
+        d = (e > a) ? e - a : e + trk->period - a;
+        best = min(best, d);
+    }
+    return (best == ~0u) ? NEVER : t + best;
+}
+
+uint64_t drive_next_flux(uint64_t t)
+{
+    struct drive_track *trk;
+    unsigned int lo, hi, mid;
+    uint64_t base;
+    uint32_t a;
+
+    if (!asserted(DRIVE_sel) || drv.writing || (drv.disk == NULL)
+        || (drv.ready_at == NEVER))
+        return NEVER;
+    trk = cur_track();
+    if (!trk->nr_flux)
+        return NEVER;
+    t = max_t(uint64_t, t, drv.ready_at);
+
+    /* First reversal strictly after @t. */
+    a = t % trk->period;
+    base = t - a;
+    lo = 0;
+    hi = trk->nr_flux;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (trk->flux[mid] <= a)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == trk->nr_flux)
+        return base + trk->period + trk->flux[0];
+    return base + trk->flux[lo];
+}
+
+void drive_write_flux(uint64_t t)
+{
+    uint64_t *wr;
+
+    if (!drv.writing)
+        return;
+    if (drv.wr_nr == drv.wr_max) {
+        drv.wr_max = drv.wr_max ? drv.wr_max * 2 : 65536;
+        wr = malloc(drv.wr_max * sizeof(*wr));
+        BUG_ON(wr == NULL);
+        memcpy(wr, drv.wr, drv.wr_nr * sizeof(*wr));
+        free(drv.wr);
+        drv.wr = wr;
+    }
+    drv.wr[drv.wr_nr++] = t;
+}
+
+unsigned int drive_gen(void)
+{
+    return drv.gen;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,106 @@
+/*
+ * host.h
+ *
+ * Host build: control of the peripheral model, and host-library services.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Host monotonic clock, in nanoseconds. */
+uint64_t host_ns(void);
+
+/* Host heap. */
+void *malloc(size_t size);
+void free(void *ptr);
+
+/* Host process exit, flushing console output. */
+void exit(int status) __attribute__((noreturn));
+
+/* Host files. host_load() returns the whole file, NUL terminated, in a
+ * malloc()ed buffer; or NULL. host_save() returns non-zero on success. */
+void *host_load(const char *path, unsigned int *p_bytes);
+int host_save(const char *path, const void *p, unsigned int bytes);
+
+/* Number of WARN_ON() hits so far. */
+unsigned int host_warn_count(void);
+
+/* RDATA flux source: a cyclic track of flux intervals, in SYSCLK ticks.
+ * Reading resumes from the start of the track. */
+void host_rdata_track(const uint16_t *flux, unsigned int nr);
+
+/* The CPU next looks at the RDATA ring only after @nr more flux than usual
+ * have been DMAed. */
+void host_rdata_stall(unsigned int nr);
+
+/* WDATA flux sink: timer ARR values, as DMAed, are captured into @buf (up
+ * to @max entries). host_wdata_captured() counts every captured value,
+ * including any that did not fit. */
+void host_wdata_capture(uint16_t *buf, unsigned int max);
+unsigned int host_wdata_captured(void);
+
+/* Call @fn every @us microseconds of host CPU time, from a signal handler, but
+ * not while the CPU is inside printk(). */
+void host_ticker(unsigned int us, void (*fn)(void));
+
+/* Console output, as printed. Defined by a peripheral model which wants to
+ * watch it. */
+void host_console(const char *s) __attribute__((weak));
+
+/* One revolution of a track: flux reversals and index pulses, as SYSCLK
+ * ticks past the track start, ascending. */
+struct drive_track {
+    uint32_t *flux;
+    unsigned int nr_flux;
+    uint32_t *index;
+    unsigned int nr_index;
+    uint32_t period;
+};
+
+/* Disk images (image.c). image_open() finds @name in @dir, with or without
+ * its extension, or returns NULL. A NULL image renders as a blank disk. */
+struct image;
+struct image *image_open(const char *dir, const char *name);
+void image_render(const struct image *im, unsigned int cyl,
+                  unsigned int side, struct drive_track *trk);
+/* Take the flux of a track just written into the image, if its format
+ * keeps sectors rather than flux. Returns TRUE if the track must then be
+ * rendered afresh. */
+bool_t image_write(struct image *im, unsigned int cyl,
+                   unsigned int side, const struct drive_track *trk);
+void image_render_da(unsigned int cyl, const void *status,
+                     struct drive_track *trk);
+
+/* Virtual drive (drive.c), on the simulated bus (sim.c). Bus lines are
+ * given as masks of those asserted. Times are in SYSCLK ticks since reset. */
+#define DRIVE_sel    (1u<<0) /* outputs */
+#define DRIVE_motor  (1u<<1)
+#define DRIVE_dir    (1u<<2) /* asserted: step in */
+#define DRIVE_step   (1u<<3)
+#define DRIVE_side   (1u<<4) /* asserted: head 1 */
+#define DRIVE_wgate  (1u<<5)
+#define DRIVE_index  (1u<<0) /* inputs */
+#define DRIVE_trk0   (1u<<1)
+#define DRIVE_ready  (1u<<2)
+#define DRIVE_dskchg (1u<<3)
+#define DRIVE_wrprot (1u<<4)
+void drive_init(const char *image_dir);
+void drive_outputs(uint64_t now, unsigned int out);
+unsigned int drive_inputs(uint64_t now);
+/* Next change of the inputs, and next RDATA reversal, strictly after @t;
+ * or ~0 if none. Valid until drive_gen() changes. */
+uint64_t drive_next_edge(uint64_t t);
+uint64_t drive_next_flux(uint64_t t);
+unsigned int drive_gen(void);
+/* A WDATA reversal. */
+void drive_write_flux(uint64_t t);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,264 @@
+/*
+ * hw.c
+ *
+ * Host build: model of the peripherals behind the floppy-data path.
+ *
+ * RDATA: DMA1 ch2 captures TIM1 CCR1 on each flux reversal of a cyclic
+ * track of flux intervals. WDATA: DMA1 ch3 loads TIM3 ARR from its ring, and
+ * each value is captured for inspection. The model advances one burst per
+ * access to the DMA controller, and only while both the channel and its
+ * timer are enabled. This makes the CPU look infinitely fast relative to the
+ * disk, which is what we want for timing the flux and codec kernels.
+ *
+ * The index pulses each time the RDATA track wraps.
+ *
+ * RDATA half/full-transfer events are flagged in the DMA ISR and, if the
+ * channel's IRQ is enabled in the NVIC, its handler is called there and
+ * then. The CPU idling in cpu_relax() also lets the disk make progress.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Flux samples transferred per access to the DMA controller. This matches
+ * the minimum refill chunk of a latency-sensitive WDATA refill. */
+#define DMA_BURST 32
+
+/* RDATA samples per access. A poll of the ring makes several accesses, and
+ * the disk runs on by all of them after a read's final poll: the next read
+ * starts that much further around the track. Finer bursts keep this well
+ * within an IBM GAP2 (three accesses' worth is about a third of it),
+ * as on real hardware, so back-to-back IDAM and DAM reads stay in step. */
+#define RDATA_BURST 16
+
+volatile struct host_regs host_regs;
+
+/* DMA1 channel 2 (RDATA) IRQ vector, and whether we are running it. */
+#define DMA_RDATA_IRQ 12
+void IRQ_12(void);
+static bool_t in_irq;
+
+static struct dma_model {
+    /* CNDTR reload value, latched when the channel is seen enabled. */
+    uint16_t reload;
+} dma_rdata_model, dma_wdata_model;
+
+static struct {
+    const uint16_t *flux;
+    unsigned int nr, pos, stall;
+} rdata;
+
+static struct {
+    uint16_t *buf;
+    unsigned int max, nr;
+} wdata;
+
+void host_rdata_track(const uint16_t *flux, unsigned int nr)
+{
+    rdata.flux = flux;
+    rdata.nr = nr;
+    rdata.pos = 0;
+}
+
+void host_rdata_stall(unsigned int nr)
+{
+    rdata.stall = nr;
+}
+
+void host_wdata_capture(uint16_t *buf, unsigned int max)
+{
+    wdata.buf = buf;
+    wdata.max = max;
+    wdata.nr = 0;
+}
+
+unsigned int host_wdata_captured(void)
+{
+    return wdata.nr;
+}
+
+static bool_t dma_running(
+    volatile struct dma_chn *ch, volatile struct tim *tim,
+    struct dma_model *m)
+{
+    if (!(ch->ccr & DMA_CCR_EN)) {
+        m->reload = 0;
+        return FALSE;
+    }
+    if (!m->reload)
+        m->reload = ch->cndtr;
+    return !!(tim->cr1 & TIM_CR1_CEN);
+}
+
+static void rdata_dma(
+    volatile struct dma *dma, volatile struct dma_chn *ch,
+    volatile struct tim *tim, struct dma_model *m)
+{
+    uint16_t *ring = (uint16_t *)(unsigned long)ch->cmar;
+    uint16_t cnt = tim->cnt, cndtr = ch->cndtr;
+    unsigned int n, nr = RDATA_BURST + rdata.stall;
+    /* Cached, as each store to the ring may alias them. */
+    const uint16_t *flux = rdata.flux;
+    unsigned int pos = rdata.pos, nr_flux = rdata.nr, reload, half;
+    uint16_t *r;
+
+    if (!dma_running(ch, tim, m) || !nr_flux)
+        return;
+    rdata.stall = 0;
+    reload = m->reload;
+    half = reload / 2;
+
+    /* In runs up to the next half/full-transfer point, or track wrap. */
+    while (nr != 0) {
+        n = min(nr, cndtr - ((cndtr > half) ? half : 0));
+        n = min(n, nr_flux - pos);
+        nr -= n;
+        cndtr -= n;
+        r = &ring[reload - cndtr - n];
+        for (; n != 0; n--) {
+            cnt += flux[pos++];
+            *r++ = cnt;
+        }
+        if (pos == nr_flux) {
+            /* The index pulses as the track comes round. */
+            pos = 0;
+            index.count++;
+            index.timestamp = time_now();
+        }
+        if (cndtr == half) {
+            if (ch->ccr & DMA_CCR_HTIE)
+                dma->isr |= DMA_ISR_HTIF(2) | DMA_ISR_GIF(2);
+        } else if (cndtr == 0) {
+            if (ch->ccr & DMA_CCR_TCIE)
+                dma->isr |= DMA_ISR_TCIF(2) | DMA_ISR_GIF(2);
+            cndtr = reload;
+        }
+    }
+
+    rdata.pos = pos;
+    ch->cndtr = cndtr;
+    tim->ccr1 = tim->cnt = cnt;
+}
+
+static void wdata_dma(
+    volatile struct dma_chn *ch, volatile struct tim *tim,
+    struct dma_model *m)
+{
+    const uint16_t *ring = (const uint16_t *)(unsigned long)ch->cmar;
+    uint16_t cndtr = ch->cndtr, arr = 0;
+    unsigned int i;
+
+    if (!dma_running(ch, tim, m))
+        return;
+
+    for (i = 0; i < DMA_BURST; i++) {
+        arr = ring[m->reload - cndtr];
+        if (wdata.nr < wdata.max)
+            wdata.buf[wdata.nr] = arr;
+        wdata.nr++;
+        if (!--cndtr)
+            cndtr = m->reload;
+    }
+
+    ch->cndtr = cndtr;
+    tim->arr = arr;
+}
+
+volatile struct dma *host_dma1(void)
+{
+    volatile struct dma *dma = &host_regs.dma;
+    uint32_t clr = dma->ifcr;
+    unsigned int n;
+
+    /* Apply flag clears written since our last access. CGIF clears all of
+     * its channel's flags. */
+    for (n = 1; n <= 7; n++)
+        if (clr & DMA_IFCR_CGIF(n))
+            clr |= 0xfu << ((n-1)*4);
+    dma->isr &= ~clr;
+    dma->ifcr = 0;
+
+    rdata_dma(dma, &dma->ch2, tim1, &dma_rdata_model);
+    wdata_dma(&dma->ch3, tim3, &dma_wdata_model);
+
+    /* Handlers run to completion, and do not nest. They are due while an
+     * event flag is set: GIF outlives flags cleared one by one. */
+    if (!in_irq && (dma->isr & (DMA_ISR_HTIF(2) | DMA_ISR_TCIF(2)))
+        && IRQx_is_enabled(DMA_RDATA_IRQ)) {
+        in_irq = TRUE;
+        IRQ_12();
+        in_irq = FALSE;
+    }
+
+    return dma;
+}
+
+volatile void *host_periph(volatile void *regs)
+{
+    return regs;
+}
+
+void host_relax(void)
+{
+    (void)dma1;
+}
+
+int host_in_exception(void)
+{
+    return in_irq;
+}
+
+/* Handlers run only from host_dma1(): there is nothing to mask. */
+void host_irq_global(int enable)
+{
+}
+
+uint8_t host_irq_save(uint8_t newpri)
+{
+    return 0;
+}
+
+void host_irq_restore(uint8_t oldpri)
+{
+}
+
+void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode)
+{
+}
+
+void delay_ticks(unsigned int ticks)
+{
+}
+
+void delay_ns(unsigned int ns)
+{
+}
+
+void delay_us(unsigned int us)
+{
+}
+
+void delay_ms(unsigned int ms)
+{
+}
+
+/* No stack is modelled: report about what the target has beneath main(). */
+unsigned int thread_stack_free(void)
+{
+    return 48*1024;
+}
+
+time_t time_now(void)
+{
+    return host_ns() * STK_MHZ / 1000;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
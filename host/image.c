@@ -0,0 +1,1046 @@
+/*
+ * image.c
+ *
+ * Host build: disk image files, as served by FlashFloppy, rendered as
+ * flux for the virtual drive (drive.c).
+ *
+ * Supported: raw sector images (IMG/IMA, geometry from IMG.CFG or the file
+ * size), Acorn SSD, CPC DSK/EDSK, Amiga ADF, HFE (v1, and v3 opcodes
+ * including hard-sector index marks), and QD. Sector images are laid out as
+ * standard IBM System/34 (MFM) or System/3740 (FM) tracks, and Amiga tracks
+ * as AmigaDOS writes them. Sectors written to IMG, SSD, DSK and ADF tracks
+ * are decoded back into the image in memory, as FlashFloppy does; other
+ * formats keep the written flux (drive.c).
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Standard revolution (300rpm), and bitcell at each data rate. */
+#define REV_TICKS sysclk_ms(200)
+#define CELL_FM sysclk_us(4)
+#define CELL_DD sysclk_us(2)
+#define CELL_HD sysclk_us(1)
+#define CELL_ED sysclk_ns(500)
+
+/* Smallest GAP3 we will close up to, to fit a standard revolution. */
+#define GAP3_MIN 8
+
+/* Most sectors on an IBM track. */
+#define IBM_MAX_SECS 64
+
+struct image {
+    uint8_t *p;
+    unsigned int bytes;
+    enum { IMG_ibm, IMG_dsk, IMG_adf, IMG_hfe, IMG_qd } type;
+    /* IMG_ibm: geometry and layout. */
+    unsigned int cyls, heads, nsec, n, base, gap3, cell;
+    bool_t fm;
+};
+
+/*
+ * Flux emitter: bitcells in, reversals out.
+ */
+
+struct emit {
+    struct drive_track *trk;
+    unsigned int max;
+    uint32_t t, cell;
+    /* Previous MFM data bit. */
+    unsigned int prev;
+};
+
+static void emit_init(struct emit *e, struct drive_track *trk, uint32_t cell)
+{
+    e->trk = trk;
+    e->max = 0;
+    e->t = 0;
+    e->cell = cell;
+    e->prev = 0;
+    trk->flux = NULL;
+    trk->nr_flux = 0;
+    trk->index = NULL;
+    trk->nr_index = 0;
+}
+
+static void emit_grow(uint32_t **p, unsigned int nr, unsigned int *max)
+{
+    uint32_t *q;
+
+    if (nr < *max)
+        return;
+    *max = *max ? *max * 2 : 4096;
+    q = malloc(*max * sizeof(*q));
+    BUG_ON(q == NULL);
+    memcpy(q, *p, nr * sizeof(*q));
+    free(*p);
+    *p = q;
+}
+
+static void emit_bit(struct emit *e, unsigned int bit)
+{
+    struct drive_track *trk = e->trk;
+
+    if (bit) {
+        emit_grow(&trk->flux, trk->nr_flux, &e->max);
+        trk->flux[trk->nr_flux++] = e->t;
+    }
+    e->t += e->cell;
+}
+
+static void emit_index(struct emit *e)
+{
+    struct drive_track *trk = e->trk;
+    unsigned int max = trk->nr_index;
+
+    emit_grow(&trk->index, trk->nr_index, &max);
+    trk->index[trk->nr_index++] = e->t;
+}
+
+/* Finish the track: a revolution of at least @period. */
+static void emit_done(struct emit *e, uint32_t period)
+{
+    struct drive_track *trk = e->trk;
+
+    trk->period = max_t(uint32_t, e->t, period);
+    if (trk->nr_index == 0) {
+        e->t = 0;
+        emit_index(e);
+    }
+}
+
+/* Raw bitcells, most significant first. */
+static void emit_raw(struct emit *e, uint32_t x, unsigned int nr)
+{
+    while (nr--)
+        emit_bit(e, (x >> nr) & 1);
+    e->prev = x & 1;
+}
+
+static void emit_mfm(struct emit *e, uint8_t b)
+{
+    unsigned int i, d;
+
+    for (i = 8; i--; ) {
+        d = (b >> i) & 1;
+        emit_bit(e, !(e->prev | d));
+        emit_bit(e, d);
+        e->prev = d;
+    }
+}
+
+static void emit_fm(struct emit *e, uint8_t clk, uint8_t b)
+{
+    unsigned int i;
+
+    for (i = 8; i--; ) {
+        emit_bit(e, (clk >> i) & 1);
+        emit_bit(e, (b >> i) & 1);
+    }
+}
+
+/*
+ * Flux decoder: reversals in, bitcells out (one per byte).
+ */
+
+/* Bitcells are timed from each reversal to the next, so that a write's own
+ * drift in data rate is followed. */
+static uint8_t *bc_decode(const struct drive_track *trk, uint32_t cell,
+                          unsigned int *p_nr)
+{
+    unsigned int i, pos, cells, nr = trk->period / cell + 64;
+    uint32_t prev = 0;
+    uint8_t *bc;
+
+    bc = malloc(nr);
+    BUG_ON(bc == NULL);
+    memset(bc, 0, nr);
+    for (i = pos = 0; i < trk->nr_flux; i++) {
+        cells = (trk->flux[i] - prev + cell/2) / cell;
+        prev = trk->flux[i];
+        if ((pos += cells) >= nr)
+            break;
+        bc[pos] = 1;
+    }
+
+    *p_nr = nr;
+    return bc;
+}
+
+/* @nr (up to 32) bitcells at @pos, most significant first. */
+static uint32_t bc_raw(const uint8_t *bc, unsigned int pos, unsigned int nr)
+{
+    uint32_t x = 0;
+
+    while (nr--)
+        x = (x << 1) | bc[pos++];
+    return x;
+}
+
+/*
+ * IBM System/34 (MFM) and System/3740 (FM) tracks.
+ */
+
+struct ibm_sec {
+    struct idam idam;
+    const uint8_t *dat; /* NULL: filled with 0xe5 */
+};
+
+static const struct ibm_layout {
+    uint8_t gap4a, sync, gap1, gap2, gap_byte;
+    /* Track bytes before the first sector, and sector bytes besides its
+     * data and GAP3. */
+    uint8_t pre, per_sec;
+    uint8_t gap3[8];
+} ibm_mfm = {
+    80, 12, 50, 22, 0x4e, 80+12+4+50, 12+8+2+22+12+4+2,
+    { 27, 54, 84, 116, 116, 116, 116, 116 }
+}, ibm_fm = {
+    40, 6, 26, 11, 0xff, 40+6+1+26, 6+5+2+11+6+1+2,
+    { 27, 42, 58, 138, 138, 138, 138, 138 }
+};
+
+static unsigned int ibm_track_bytes(
+    const struct ibm_layout *l, unsigned int nsec, unsigned int n)
+{
+    return l->pre + nsec * (l->per_sec + (128 << n));
+}
+
+static void ibm_fill(struct emit *e, bool_t fm, uint8_t b, unsigned int nr)
+{
+    while (nr--) {
+        if (fm)
+            emit_fm(e, 0xff, b);
+        else
+            emit_mfm(e, b);
+    }
+}
+
+/* An address mark, then @nr bytes of @p, then the CRC over both. */
+static void ibm_field(struct emit *e, bool_t fm, uint8_t mark,
+                      const uint8_t *p, unsigned int nr)
+{
+    static const uint8_t a1[] = { 0xa1, 0xa1, 0xa1 };
+    uint16_t crc;
+    unsigned int i;
+
+    if (fm) {
+        crc = crc16_ccitt(&mark, 1, 0xffff);
+        emit_fm(e, 0xc7, mark);
+    } else {
+        crc = crc16_ccitt(a1, 3, 0xffff);
+        crc = crc16_ccitt(&mark, 1, crc);
+        for (i = 0; i < 3; i++)
+            emit_raw(e, 0x4489, 16);
+        emit_mfm(e, mark);
+    }
+
+    if (p != NULL) {
+        crc = crc16_ccitt(p, nr, crc);
+        for (i = 0; i < nr; i++)
+            ibm_fill(e, fm, p[i], 1);
+    } else {
+        for (i = 0; i < nr; i++)
+            crc = crc16_ccitt("\xe5", 1, crc);
+        ibm_fill(e, fm, 0xe5, nr);
+    }
+
+    ibm_fill(e, fm, crc >> 8, 1);
+    ibm_fill(e, fm, crc, 1);
+}
+
+/* The revolution is stretched if the sectors do not fit in a standard one. */
+static void ibm_track(struct drive_track *trk, bool_t fm, uint32_t cell,
+                      const struct ibm_sec *sec, unsigned int nsec,
+                      unsigned int gap3)
+{
+    const struct ibm_layout *l = fm ? &ibm_fm : &ibm_mfm;
+    struct emit e;
+    unsigned int i;
+
+    emit_init(&e, trk, cell);
+
+    ibm_fill(&e, fm, l->gap_byte, l->gap4a);
+    ibm_fill(&e, fm, 0x00, l->sync);
+    if (fm) {
+        emit_fm(&e, 0xd7, 0xfc);
+    } else {
+        for (i = 0; i < 3; i++)
+            emit_raw(&e, 0x5224, 16);
+        emit_mfm(&e, 0xfc);
+    }
+    ibm_fill(&e, fm, l->gap_byte, l->gap1);
+
+    for (i = 0; i < nsec; i++) {
+        ibm_fill(&e, fm, 0x00, l->sync);
+        ibm_field(&e, fm, 0xfe, (const uint8_t *)&sec[i].idam, 4);
+        ibm_fill(&e, fm, l->gap_byte, l->gap2);
+        ibm_fill(&e, fm, 0x00, l->sync);
+        ibm_field(&e, fm, 0xfb, sec[i].dat, 128 << (sec[i].idam.n & 7));
+        ibm_fill(&e, fm, l->gap_byte, gap3);
+    }
+
+    /* GAP4B. */
+    while (e.t + 16 * cell <= REV_TICKS)
+        ibm_fill(&e, fm, l->gap_byte, 1);
+
+    emit_done(&e, REV_TICKS);
+}
+
+/* Data rate and GAP3 for a raw sector image: the slowest standard rate at
+ * which a track fits a standard revolution. */
+static void ibm_fit(struct image *im)
+{
+    static const uint32_t cells[] = { CELL_DD, CELL_HD, CELL_ED };
+    const struct ibm_layout *l = im->fm ? &ibm_fm : &ibm_mfm;
+    unsigned int i, bytes, cap;
+
+    bytes = ibm_track_bytes(l, im->nsec, im->n);
+    for (i = 0; i < ARRAY_SIZE(cells); i++) {
+        im->cell = im->fm ? CELL_FM : cells[i];
+        cap = REV_TICKS / (16 * im->cell);
+        if (bytes + im->nsec * GAP3_MIN <= cap)
+            break;
+        if (im->fm)
+            return;
+    }
+    if (i == ARRAY_SIZE(cells))
+        return;
+    im->gap3 = min_t(unsigned int, im->gap3, (cap - bytes) / im->nsec);
+}
+
+static void ibm_render(const struct image *im, unsigned int cyl,
+                       unsigned int side, struct drive_track *trk)
+{
+    struct ibm_sec sec[IBM_MAX_SECS];
+    unsigned int i, sz = 128 << im->n;
+    const uint8_t *p;
+
+    if ((cyl >= im->cyls) || (side >= im->heads)) {
+        ibm_track(trk, im->fm, im->cell, NULL, 0, 0);
+        return;
+    }
+
+    p = im->p + (cyl * im->heads + side) * im->nsec * sz;
+    for (i = 0; i < im->nsec; i++) {
+        sec[i].idam.c = cyl;
+        sec[i].idam.h = side;
+        sec[i].idam.r = im->base + i;
+        sec[i].idam.n = im->n;
+        sec[i].dat = (p + sz <= im->p + im->bytes) ? p : NULL;
+        p += sz;
+    }
+
+    ibm_track(trk, im->fm, im->cell, sec, im->nsec, im->gap3);
+}
+
+/* The data byte at bitcell @pos: data bits are the odd bitcells. */
+static uint8_t ibm_byte(const uint8_t *bc, unsigned int pos)
+{
+    unsigned int i;
+    uint8_t b = 0;
+
+    for (i = 0; i < 8; i++)
+        b = (b << 1) | bc[pos + 2*i + 1];
+    return b;
+}
+
+/* Bitcell offset of the next mark byte at or beyond @pos, or ~0u. MFM:
+ * three A1 syncs precede it. FM: it is clocked by C7. */
+static unsigned int ibm_next_mark(const uint8_t *bc, unsigned int pos,
+                                  unsigned int end, bool_t fm)
+{
+    for (pos = max(pos, 1u); pos + 64 <= end; pos++) {
+        if (fm) {
+            if (ibm_byte(bc, pos - 1) == 0xc7)
+                return pos;
+        } else if ((bc_raw(bc, pos, 16) == 0x4489)
+                   && (bc_raw(bc, pos+16, 16) == 0x4489)
+                   && (bc_raw(bc, pos+32, 16) == 0x4489)) {
+            return pos + 48;
+        }
+    }
+    return ~0u;
+}
+
+/* @nr bytes from the mark at bitcell @pos, with a good CRC. */
+static bool_t ibm_get_field(const uint8_t *bc, unsigned int pos,
+                            unsigned int end, bool_t fm,
+                            uint8_t *p, unsigned int nr)
+{
+    static const uint8_t a1[] = { 0xa1, 0xa1, 0xa1 };
+    unsigned int i;
+
+    if (pos + nr * 16 > end)
+        return FALSE;
+    for (i = 0; i < nr; i++)
+        p[i] = ibm_byte(bc, pos + i * 16);
+    return !crc16_ccitt(p, nr, fm ? 0xffff : crc16_ccitt(a1, 3, 0xffff));
+}
+
+/* The next sector, at or beyond bitcell *@p_pos, with good IDAM and DAM:
+ * its IDAM fields in @idam, and its data at @dat (room for @max bytes). */
+static bool_t ibm_next_sector(const uint8_t *bc, unsigned int nr_bc,
+                              bool_t fm, unsigned int *p_pos,
+                              struct idam *idam, uint8_t *dat,
+                              unsigned int max)
+{
+    unsigned int pos = *p_pos, dam, sz;
+    uint8_t id[7];
+
+    while ((pos = ibm_next_mark(bc, pos, nr_bc, fm)) != ~0u) {
+        if (!ibm_get_field(bc, pos, nr_bc, fm, id, sizeof(id))
+            || (id[0] != 0xfe)) {
+            pos += 16;
+            continue;
+        }
+        pos += sizeof(id) * 16;
+        sz = 128 << (id[4] & 7);
+        dam = ibm_next_mark(bc, pos, min(pos + 64*16, nr_bc), fm);
+        if ((dam == ~0u) || (1 + sz + 2 > max)
+            || !ibm_get_field(bc, dam, nr_bc, fm, dat, 1 + sz + 2)
+            || ((dat[0] != 0xfb) && (dat[0] != 0xf8)))
+            continue;
+        memcpy(idam, &id[1], sizeof(*idam));
+        memmove(dat, dat + 1, sz);
+        *p_pos = dam + (1 + sz + 2) * 16;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Sectors written to a track are taken into the image, by sector number,
+ * as FlashFloppy does: the IDAM's cylinder and head are not checked. */
+static bool_t ibm_write(struct image *im, unsigned int cyl,
+                        unsigned int side, const struct drive_track *trk)
+{
+    unsigned int sz = 128 << im->n, max = 1 + sz + 2, nr_bc, pos = 0, r, off;
+    struct idam idam;
+    uint8_t *bc, *p;
+
+    if ((cyl >= im->cyls) || (side >= im->heads))
+        return FALSE;
+
+    bc = bc_decode(trk, im->cell, &nr_bc);
+    p = malloc(max);
+    BUG_ON(p == NULL);
+
+    while (ibm_next_sector(bc, nr_bc, im->fm, &pos, &idam, p, max)) {
+        r = idam.r - im->base;
+        off = ((cyl * im->heads + side) * im->nsec + r) * sz;
+        if ((idam.n == im->n) && (r < im->nsec) && (off + sz <= im->bytes))
+            memcpy(im->p + off, p, sz);
+    }
+
+    free(p);
+    free(bc);
+    return TRUE;
+}
+
+/* Geometry from a tagged section of IMG.CFG: "[tag]" then "key = value"
+ * lines, with keys cyls, heads, secs, bps and id. */
+static bool_t img_cfg(struct image *im, const char *dir, const char *tag)
+{
+    char path[256], key[16], *cfg, *p;
+    unsigned int bytes, val, bps = 0;
+    bool_t in_tag = FALSE, found = FALSE;
+
+    snprintf(path, sizeof(path), "%s/IMG.CFG", dir);
+    if ((cfg = host_load(path, &bytes)) == NULL)
+        return FALSE;
+
+    for (p = cfg; *p != '\0'; p = strchr(p, '\n') ? strchr(p, '\n') + 1
+             : p + strlen(p)) {
+        while ((*p == ' ') || (*p == '\t'))
+            p++;
+        if (*p == '[') {
+            in_tag = !strncmp(p+1, tag, strlen(tag))
+                && (p[1+strlen(tag)] == ']');
+            found |= in_tag;
+            continue;
+        }
+        if (!in_tag || (*p == '#'))
+            continue;
+        for (val = 0; (val < sizeof(key)-1) && (*p > ' ') && (*p != '=');
+             val++)
+            key[val] = *p++;
+        key[val] = '\0';
+        while ((*p == ' ') || (*p == '='))
+            p++;
+        val = strtol(p, NULL, 10);
+        if (!strcmp(key, "cyls"))
+            im->cyls = val;
+        else if (!strcmp(key, "heads"))
+            im->heads = val;
+        else if (!strcmp(key, "secs"))
+            im->nsec = val;
+        else if (!strcmp(key, "bps"))
+            bps = val;
+        else if (!strcmp(key, "id"))
+            im->base = val;
+    }
+
+    free(cfg);
+    for (im->n = 0; (im->n < 7) && ((128u << im->n) < bps); im->n++)
+        continue;
+    return found;
+}
+
+static bool_t img_open(struct image *im, const char *dir, const char *name)
+{
+    /* Untagged images, by size: kB, cylinders, heads, sectors. */
+    static const struct {
+        uint16_t kb;
+        uint8_t cyls, heads, nsec;
+    } sizes[] = {
+        { 160, 40, 1, 8 }, { 180, 40, 1, 9 }, { 320, 40, 2, 8 },
+        { 360, 40, 2, 9 }, { 720, 80, 2, 9 }, { 1200, 80, 2, 15 },
+        { 1440, 80, 2, 18 }, { 1680, 80, 2, 21 }, { 2880, 80, 2, 36 }
+    };
+    const char *ext = strrchr(name, '.'), *p;
+    char tag[16];
+    unsigned int i;
+
+    im->type = IMG_ibm;
+    im->base = 1;
+    im->n = 2;
+
+    /* A tagged image is <name>.<tag>.img */
+    for (p = ext; (p != name) && (p[-1] != '.'); p--)
+        continue;
+    if ((p != name) && (ext - p < sizeof(tag))) {
+        memcpy(tag, p, ext - p);
+        tag[ext - p] = '\0';
+        if (!img_cfg(im, dir, tag))
+            return FALSE;
+    } else {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++)
+            if (im->bytes == sizes[i].kb * 1024)
+                break;
+        if (i == ARRAY_SIZE(sizes))
+            return FALSE;
+        im->cyls = sizes[i].cyls;
+        im->heads = sizes[i].heads;
+        im->nsec = sizes[i].nsec;
+    }
+
+    if (!im->cyls || !im->heads || !im->nsec
+        || (im->nsec > IBM_MAX_SECS)
+        || (im->heads > 2))
+        return FALSE;
+    im->gap3 = ibm_mfm.gap3[im->n];
+    ibm_fit(im);
+    return TRUE;
+}
+
+/* Acorn DFS: single sided, FM, ten 256-byte sectors numbered from 0. */
+static bool_t ssd_open(struct image *im)
+{
+    im->type = IMG_ibm;
+    im->fm = TRUE;
+    im->heads = 1;
+    im->nsec = 10;
+    im->n = 1;
+    im->base = 0;
+    im->cyls = (im->bytes + 2559) / 2560;
+    im->gap3 = ibm_fm.gap3[im->n];
+    ibm_fit(im);
+    return TRUE;
+}
+
+/*
+ * CPC DSK and EDSK.
+ */
+
+struct __packed dsk_disk {
+    char sig[34], creator[14];
+    uint8_t cyls, heads;
+    uint16_t track_sz; /* DSK only */
+    uint8_t track_sz_hi[204]; /* EDSK only: track size / 256 */
+};
+
+struct __packed dsk_sector {
+    uint8_t c, h, r, n, stat1, stat2;
+    uint16_t actual_sz; /* EDSK only */
+};
+
+struct __packed dsk_track {
+    char sig[12];
+    uint8_t pad[4];
+    uint8_t cyl, head, rate, mode, n, nsec, gap3, filler;
+    struct dsk_sector sec[29];
+};
+
+static bool_t dsk_open(struct image *im)
+{
+    const struct dsk_disk *d = (const struct dsk_disk *)im->p;
+
+    im->type = IMG_dsk;
+    return (im->bytes >= 256)
+        && (!strncmp(d->sig, "EXTENDED CPC DSK", 16)
+            || !strncmp(d->sig, "MV - CPC", 8));
+}
+
+/* The Track-Info block of a track, or NULL if the track is unformatted. */
+static struct dsk_track *dsk_track(const struct image *im, unsigned int cyl,
+                                   unsigned int side)
+{
+    const struct dsk_disk *d = (const struct dsk_disk *)im->p;
+    bool_t edsk = (d->sig[0] == 'E');
+    unsigned int i, off = 256, nr = cyl * d->heads + side;
+
+    if ((cyl >= d->cyls) || (side >= d->heads))
+        return NULL;
+    for (i = 0; i < nr; i++)
+        off += edsk ? d->track_sz_hi[i] * 256 : d->track_sz;
+    if ((edsk && !d->track_sz_hi[nr]) || (off + 256 > im->bytes))
+        return NULL;
+    return (struct dsk_track *)(im->p + off);
+}
+
+/* The data of each sector of track @t, or NULL beyond the image's end. */
+static unsigned int dsk_sectors(const struct image *im,
+                                const struct dsk_track *t, uint8_t **dat)
+{
+    bool_t edsk = (im->p[0] == 'E');
+    unsigned int i, nr = min_t(unsigned int, t->nsec, ARRAY_SIZE(t->sec));
+    uint8_t *p = (uint8_t *)t + 256;
+
+    for (i = 0; i < nr; i++) {
+        dat[i] = ((p + (128 << (t->sec[i].n & 7)))
+                  <= (im->p + im->bytes)) ? p : NULL;
+        p += edsk ? t->sec[i].actual_sz : 128 << t->n;
+    }
+    return nr;
+}
+
+static void dsk_render(const struct image *im, unsigned int cyl,
+                       unsigned int side, struct drive_track *trk)
+{
+    const struct dsk_track *t = dsk_track(im, cyl, side);
+    struct ibm_sec sec[ARRAY_SIZE(t->sec)];
+    uint8_t *dat[ARRAY_SIZE(t->sec)];
+    unsigned int i, nr;
+
+    if (t == NULL) {
+        ibm_track(trk, FALSE, CELL_DD, NULL, 0, 0);
+        return;
+    }
+
+    nr = dsk_sectors(im, t, dat);
+    for (i = 0; i < nr; i++) {
+        sec[i].idam.c = t->sec[i].c;
+        sec[i].idam.h = t->sec[i].h;
+        sec[i].idam.r = t->sec[i].r;
+        sec[i].idam.n = t->sec[i].n;
+        sec[i].dat = dat[i];
+    }
+
+    ibm_track(trk, FALSE, CELL_DD, sec, nr, t->gap3);
+}
+
+/* Sectors written to a track are taken into the image, as FlashFloppy
+ * does, if they match a sector of the track's layout: a write cannot
+ * reformat the track. */
+static bool_t dsk_write(struct image *im, unsigned int cyl,
+                        unsigned int side, const struct drive_track *trk)
+{
+    const struct dsk_track *t = dsk_track(im, cyl, side);
+    unsigned int i, nr, nr_bc, pos = 0, max = 1 + (128 << 7) + 2;
+    uint8_t *dat[ARRAY_SIZE(t->sec)], *bc, *p;
+    struct idam idam;
+
+    if (t == NULL)
+        return FALSE;
+
+    nr = dsk_sectors(im, t, dat);
+    bc = bc_decode(trk, CELL_DD, &nr_bc);
+    p = malloc(max);
+    BUG_ON(p == NULL);
+
+    while (ibm_next_sector(bc, nr_bc, FALSE, &pos, &idam, p, max)) {
+        for (i = 0; i < nr; i++)
+            if ((t->sec[i].c == idam.c) && (t->sec[i].h == idam.h)
+                && (t->sec[i].r == idam.r) && (t->sec[i].n == idam.n)
+                && (dat[i] != NULL))
+                memcpy(dat[i], p, 128 << (idam.n & 7));
+    }
+
+    free(p);
+    free(bc);
+    return TRUE;
+}
+
+/*
+ * Amiga ADF: DD (11 sectors) or HD (22 sectors, at 150rpm).
+ */
+
+#define AMIGA_GAP_LONGS 32
+#define AMIGA_SEC_LONGS (16 + 2*512/4)
+
+static void amiga_long(struct emit *e, uint32_t l, bool_t raw)
+{
+    uint32_t r = l;
+
+    if (!raw) {
+        r = l & 0x55555555u;
+        r |= (~((l>>2)|l) & 0x55555555u) << 1;
+        if (e->prev)
+            r &= ~(1u << 31);
+    }
+    emit_raw(e, r, 32);
+}
+
+static uint32_t amiga_checksum(const uint8_t *p, unsigned int bytes)
+{
+    uint32_t csum = 0;
+    unsigned int i;
+
+    for (i = 0; i < bytes; i += 4)
+        csum ^= ((uint32_t)p[i] << 24) | (p[i+1] << 16)
+            | (p[i+2] << 8) | p[i+3];
+    return csum;
+}
+
+static void adf_render(const struct image *im, unsigned int cyl,
+                       unsigned int side, struct drive_track *trk)
+{
+    unsigned int nsec = (im->bytes > 80*2*11*512) ? 22 : 11;
+    unsigned int track = cyl*2 + side, sec, i;
+    uint32_t info, csum, l;
+    const uint8_t *p;
+    struct emit e;
+
+    emit_init(&e, trk, CELL_DD);
+
+    if ((cyl >= 80) || ((track + 1) * nsec * 512 > im->bytes))
+        goto out;
+
+    for (i = 0; i < AMIGA_GAP_LONGS; i++)
+        amiga_long(&e, 0, FALSE);
+
+    for (sec = 0; sec < nsec; sec++) {
+        p = im->p + (track * nsec + sec) * 512;
+        info = (0xffu << 24) | (track << 16) | (sec << 8) | (nsec - sec);
+        amiga_long(&e, 0, FALSE);
+        amiga_long(&e, 0x44894489, TRUE);
+        amiga_long(&e, info >> 1, FALSE);
+        amiga_long(&e, info, FALSE);
+        for (i = 0; i < 8; i++) /* label */
+            amiga_long(&e, 0, FALSE);
+        csum = ((info >> 1) ^ info) & 0x55555555u;
+        amiga_long(&e, 0, FALSE);
+        amiga_long(&e, csum, FALSE);
+        csum = amiga_checksum(p, 512);
+        csum = (csum ^ (csum >> 1)) & 0x55555555u;
+        amiga_long(&e, 0, FALSE);
+        amiga_long(&e, csum, FALSE);
+        for (i = 0; i < 2*512; i += 4) {
+            l = ((uint32_t)p[i%512] << 24) | (p[i%512+1] << 16)
+                | (p[i%512+2] << 8) | p[i%512+3];
+            amiga_long(&e, (i < 512) ? l >> 1 : l, FALSE);
+        }
+    }
+
+out:
+    while (e.t + 32 * e.cell <= REV_TICKS * (nsec / 11))
+        amiga_long(&e, 0, FALSE);
+    emit_done(&e, REV_TICKS * (nsec / 11));
+}
+
+/* The long at bitcell @pos, split as odd bits at @pos and even bits 32
+ * bitcells on. */
+static uint32_t amiga_get_long(const uint8_t *bc, unsigned int pos,
+                               unsigned int split)
+{
+    return ((bc_raw(bc, pos, 32) & 0x55555555u) << 1)
+        | (bc_raw(bc, pos + split, 32) & 0x55555555u);
+}
+
+/* Sectors written to a track are taken into the image, as FlashFloppy
+ * does, if their data checksum is good. */
+static bool_t adf_write(struct image *im, unsigned int cyl,
+                        unsigned int side, const struct drive_track *trk)
+{
+    unsigned int nsec = (im->bytes > 80*2*11*512) ? 22 : 11;
+    unsigned int track = cyl*2 + side, nr_bc, pos, sec, i;
+    uint32_t info, csum, l;
+    uint8_t *bc, *p;
+
+    if ((cyl >= 80) || ((track + 1) * nsec * 512 > im->bytes))
+        return FALSE;
+
+    bc = bc_decode(trk, CELL_DD, &nr_bc);
+
+    /* Sync, info, label, header and data checksums, then the data. */
+    for (pos = 0; pos + AMIGA_SEC_LONGS * 32 <= nr_bc; pos++) {
+        if (bc_raw(bc, pos, 32) != 0x44894489)
+            continue;
+        info = amiga_get_long(bc, pos + 32, 32);
+        sec = (info >> 8) & 0xff;
+        if (((info >> 16) & 0xff) != track || (sec >= nsec))
+            continue;
+        for (i = csum = 0; i < 2*512/4; i++)
+            csum ^= bc_raw(bc, pos + 15*32 + i*32, 32);
+        if ((csum & 0x55555555u) != amiga_get_long(bc, pos + 13*32, 32))
+            continue;
+        p = im->p + (track * nsec + sec) * 512;
+        for (i = 0; i < 512/4; i++) {
+            l = amiga_get_long(bc, pos + 15*32 + i*32, 512/4*32);
+            p[i*4+0] = l >> 24;
+            p[i*4+1] = l >> 16;
+            p[i*4+2] = l >> 8;
+            p[i*4+3] = l;
+        }
+        pos += AMIGA_SEC_LONGS * 32 - 1;
+    }
+
+    free(bc);
+    return TRUE;
+}
+
+/*
+ * HFE: v1, and v3 with opcodes.
+ */
+
+struct __packed hfe_header {
+    char sig[8];
+    uint8_t formatrevision;
+    uint8_t nr_tracks, nr_sides;
+    uint8_t track_encoding;
+    uint16_t bitrate; /* kB/s, approx */
+    uint16_t rpm; /* unused, can be zero */
+    uint8_t interface_mode;
+    uint8_t rsvd; /* set to 1? */
+    uint16_t track_list_offset;
+};
+
+struct __packed hfe_track {
+    uint16_t offset;
+    uint16_t len;
+};
+
+/* v3 opcodes, as stored (bit reversed). */
+#define HFE_OP_nop   0x0f
+#define HFE_OP_index 0x8f
+#define HFE_OP_rate  0x4f
+#define HFE_OP_skip  0xcf
+#define HFE_OP_rand  0x2f
+
+static bool_t hfe_open(struct image *im)
+{
+    const struct hfe_header *h = (const struct hfe_header *)im->p;
+
+    im->type = IMG_hfe;
+    return (im->bytes >= 1024)
+        && (!strncmp(h->sig, "HXCPICFE", 8) || !strncmp(h->sig, "HXCHFEV3", 8))
+        && (h->bitrate != 0)
+        && ((h->track_list_offset + 1) * 512 <= im->bytes);
+}
+
+static void hfe_render(const struct image *im, unsigned int cyl,
+                       unsigned int side, struct drive_track *trk)
+{
+    const struct hfe_header *h = (const struct hfe_header *)im->p;
+    const struct hfe_track *tlut;
+    bool_t v3 = (h->sig[3] == 'H');
+    unsigned int i, off, len = 0, skip = 0;
+    struct emit e;
+    uint8_t b;
+
+    emit_init(&e, trk, SYSCLK / (h->bitrate * 2000u));
+
+    if ((cyl >= h->nr_tracks) || (side >= h->nr_sides))
+        goto out;
+    tlut = (const struct hfe_track *)(im->p + h->track_list_offset * 512);
+    off = tlut[cyl].offset * 512;
+    len = tlut[cyl].len / 2;
+    if (off + ((len + 255) / 256) * 512 > im->bytes)
+        goto out;
+
+    /* Each 512-byte block holds 256 bytes of side 0, then of side 1.
+     * Bitcells are stored least significant first. */
+    for (i = 0; i < len; i++) {
+        b = im->p[off + (i/256)*512 + side*256 + i%256];
+        if (v3 && ((b & 0xf) == 0xf)) {
+            switch (b) {
+            case HFE_OP_index:
+                emit_index(&e);
+                continue;
+            case HFE_OP_rate: /* keep the nominal rate */
+                i++;
+                continue;
+            case HFE_OP_skip:
+                if (++i < len)
+                    skip = im->p[off + (i/256)*512 + side*256 + i%256] & 7;
+                continue;
+            case HFE_OP_rand: /* weak bits: no flux */
+                b = 0;
+                break;
+            default: /* HFE_OP_nop */
+                continue;
+            }
+        }
+        for (b >>= skip; skip < 8; skip++, b >>= 1)
+            emit_bit(&e, b & 1);
+        skip = 0;
+    }
+
+out:
+    emit_done(&e, len ? 0 : REV_TICKS);
+}
+
+/*
+ * QD (Quick Disk): one linear track, served as a single revolution.
+ */
+
+struct __packed qd_track {
+    uint32_t off, len, win_start, win_end;
+};
+
+static bool_t qd_open(struct image *im)
+{
+    const struct qd_track *t = (const struct qd_track *)(im->p + 512);
+
+    im->type = IMG_qd;
+    return (im->bytes >= 1024) && !strncmp((char *)im->p + 3, "QD", 2)
+        && (t->off + t->len <= im->bytes);
+}
+
+static void qd_render(const struct image *im, unsigned int cyl,
+                      unsigned int side, struct drive_track *trk)
+{
+    const struct qd_track *t = (const struct qd_track *)(im->p + 512);
+    unsigned int i, j;
+    struct emit e;
+
+    emit_init(&e, trk, sysclk_ns(4916));
+    if ((cyl == 0) && (side == 0))
+        for (i = 0; i < t->len; i++)
+            for (j = 0; j < 8; j++)
+                emit_bit(&e, (im->p[t->off + i] >> j) & 1);
+    emit_done(&e, REV_TICKS);
+}
+
+/*
+ * Image files.
+ */
+
+struct image *image_open(const char *dir, const char *name)
+{
+    static const char *exts[] = {
+        "img", "ima", "ssd", "dsk", "adf", "hfe", "qd" };
+    struct image *im;
+    const char *ext;
+    char path[256];
+    unsigned int i;
+    bool_t ok;
+
+    if ((im = malloc(sizeof(*im))) == NULL)
+        return NULL;
+    memset(im, 0, sizeof(*im));
+
+    /* @name, with or without its extension. */
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    for (i = 0; (im->p = host_load(path, &im->bytes)) == NULL; i++) {
+        if (i == ARRAY_SIZE(exts))
+            goto fail;
+        snprintf(path, sizeof(path), "%s/%s.%s", dir, name, exts[i]);
+    }
+
+    if ((ext = strrchr(path, '.')) == NULL)
+        goto fail;
+    ext++;
+    if (!strcmp(ext, "img") || !strcmp(ext, "ima"))
+        ok = img_open(im, dir, strrchr(path, '/') + 1);
+    else if (!strcmp(ext, "ssd"))
+        ok = ssd_open(im);
+    else if (!strcmp(ext, "dsk"))
+        ok = dsk_open(im);
+    else if (!strcmp(ext, "adf"))
+        ok = (im->type = IMG_adf, TRUE);
+    else if (!strcmp(ext, "hfe"))
+        ok = hfe_open(im);
+    else if (!strcmp(ext, "qd"))
+        ok = qd_open(im);
+    else
+        ok = FALSE;
+    if (ok)
+        return im;
+
+fail:
+    free(im->p);
+    free(im);
+    return NULL;
+}
+
+void image_render(const struct image *im, unsigned int cyl,
+                  unsigned int side, struct drive_track *trk)
+{
+    struct emit e;
+
+    if (im == NULL) {
+        /* Blank disk. */
+        emit_init(&e, trk, CELL_DD);
+        emit_done(&e, REV_TICKS);
+        return;
+    }
+
+    switch (im->type) {
+    case IMG_ibm:
+        ibm_render(im, cyl, side, trk);
+        break;
+    case IMG_dsk:
+        dsk_render(im, cyl, side, trk);
+        break;
+    case IMG_adf:
+        adf_render(im, cyl, side, trk);
+        break;
+    case IMG_hfe:
+        hfe_render(im, cyl, side, trk);
+        break;
+    case IMG_qd:
+        qd_render(im, cyl, side, trk);
+        break;
+    }
+}
+
+bool_t image_write(struct image *im, unsigned int cyl,
+                   unsigned int side, const struct drive_track *trk)
+{
+    if (im == NULL)
+        return FALSE;
+
+    switch (im->type) {
+    case IMG_ibm:
+        return ibm_write(im, cyl, side, trk);
+    case IMG_dsk:
+        return dsk_write(im, cyl, side, trk);
+    case IMG_adf:
+        return adf_write(im, cyl, side, trk);
+    default:
+        return FALSE;
+    }
+}
+
+/* Direct-access track: one 512-byte sector, ID (@cyl, 0, 0, 2), holding
+ * @status. FM on cylinder 254, else MFM. */
+void image_render_da(unsigned int cyl, const void *status, struct drive_track *trk)
+{
+    struct ibm_sec sec = { { cyl, 0, 0, 2 }, status };
+    bool_t fm = (cyl == 254);
+
+    ibm_track(trk, fm, fm ? CELL_FM : CELL_DD, &sec, 1,
+              fm ? ibm_fm.gap3[2] : ibm_mfm.gap3[2]);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,71 @@
+/*
+ * intrinsics.h
+ *
+ * Host build: portable stand-ins for the ARMv7-M compiler intrinsics.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define __aligned(x) __attribute__((aligned(x)))
+#define __packed __attribute((packed))
+#define always_inline __inline__ __attribute__((always_inline))
+#define noinline __attribute__((noinline))
+
+#define alloca(x) __builtin_alloca(x)
+
+#define likely(x)     __builtin_expect(!!(x),1)
+#define unlikely(x)   __builtin_expect(!!(x),0)
+
+#define illegal() __builtin_trap()
+
+#define barrier() asm volatile ("" ::: "memory")
+#define cpu_sync() __sync_synchronize()
+/* Idling lets the peripheral model make progress. */
+void host_relax(void);
+#define cpu_relax() host_relax()
+
+/* IRQ masking is left to the peripheral model. The benchmark model has a
+ * single context, and nothing to mask. The simulator delivers IRQs
+ * asynchronously, and honours PRIMASK and BASEPRI as the CPU would. */
+int host_in_exception(void);
+void host_irq_global(int enable);
+uint8_t host_irq_save(uint8_t newpri);
+void host_irq_restore(uint8_t oldpri);
+#define in_exception() host_in_exception()
+#define global_disable_exceptions() host_irq_global(FALSE)
+#define global_enable_exceptions() host_irq_global(TRUE)
+#define IRQ_global_disable() host_irq_global(FALSE)
+#define IRQ_global_enable() host_irq_global(TRUE)
+#define IRQ_save(newpri) host_irq_save(newpri)
+#define IRQ_restore(oldpri) host_irq_restore(oldpri)
+
+static inline uint16_t _rev16(uint16_t x)
+{
+    return __builtin_bswap16(x);
+}
+
+static inline uint32_t _rev32(uint32_t x)
+{
+    return __builtin_bswap32(x);
+}
+
+static inline uint32_t _rbit32(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    return _rev32(x);
+}
+
+#define cmpxchg(ptr,o,n) __sync_val_compare_and_swap((ptr),(o),(n))
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
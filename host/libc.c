@@ -0,0 +1,197 @@
+/*
+ * libc.c
+ *
+ * Host build: services backed by the host C library. This file is compiled
+ * without decls.h, as the testbed's own declarations clash with libc's.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+uint64_t host_ns(void);
+unsigned int host_warn_count(void);
+int vprintk(const char *format, va_list ap);
+int printk(const char *format, ...);
+void __bug(const char *p, const char *file, unsigned int line);
+void __warn(const char *p, const char *file, unsigned int line);
+void *host_load(const char *path, unsigned int *p_bytes);
+int host_save(const char *path, const void *p, unsigned int bytes);
+void host_ticker(unsigned int us, void (*fn)(void));
+void host_console(const char *s) __attribute__((weak));
+void console_init(void);
+void console_crash_on_input(void);
+void console_sync(void);
+void console_barrier(void);
+void console_write(const void *p, unsigned int bytes);
+
+static unsigned int nr_warn;
+
+/* Set while in printk(), which the ticker must not interrupt. */
+static volatile sig_atomic_t in_printk;
+static void (*ticker_fn)(void);
+
+uint64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+unsigned int host_warn_count(void)
+{
+    return nr_warn;
+}
+
+int vprintk(const char *format, va_list ap)
+{
+    char buf[1024];
+    va_list aq;
+    int n;
+
+    in_printk = 1;
+    if (host_console == NULL) {
+        n = vprintf(format, ap);
+    } else {
+        /* Long messages go out unseen by the console watcher. */
+        va_copy(aq, ap);
+        n = vsnprintf(buf, sizeof(buf), format, aq);
+        va_end(aq);
+        if ((n < 0) || (n >= sizeof(buf))) {
+            n = vprintf(format, ap);
+        } else {
+            fwrite(buf, 1, n, stdout);
+            host_console(buf);
+        }
+    }
+    in_printk = 0;
+
+    return n;
+}
+
+int printk(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vprintk(format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+void __bug(const char *p, const char *file, unsigned int line)
+{
+    printk("BUG at %s:%u: \"%s\"\n", file, line, p);
+    fflush(stdout);
+    abort();
+}
+
+void __warn(const char *p, const char *file, unsigned int line)
+{
+    printk("WARN at %s:%u: \"%s\"\n", file, line, p);
+    nr_warn++;
+}
+
+void *host_load(const char *path, unsigned int *p_bytes)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *p = NULL;
+    long bytes;
+
+    if (f == NULL)
+        return NULL;
+    if ((fseek(f, 0, SEEK_END) != 0) || ((bytes = ftell(f)) < 0))
+        goto out;
+    rewind(f);
+    /* Trailing NUL, so that text files are strings. */
+    if ((p = malloc(bytes + 1)) == NULL)
+        goto out;
+    if (fread(p, 1, bytes, f) != bytes) {
+        free(p);
+        p = NULL;
+        goto out;
+    }
+    p[bytes] = '\0';
+    *p_bytes = bytes;
+out:
+    fclose(f);
+    return p;
+}
+
+int host_save(const char *path, const void *p, unsigned int bytes)
+{
+    FILE *f = fopen(path, "wb");
+    int ok;
+
+    if (f == NULL)
+        return 0;
+    ok = (fwrite(p, 1, bytes, f) == bytes);
+    return (fclose(f) == 0) && ok;
+}
+
+static void ticker(int sig)
+{
+    if (!in_printk)
+        (*ticker_fn)();
+}
+
+void host_ticker(unsigned int us, void (*fn)(void))
+{
+    struct itimerval it = {
+        .it_interval = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 }
+    };
+    struct sigaction sa;
+
+    ticker_fn = fn;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = ticker;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGVTALRM, &sa, NULL);
+    it.it_value = it.it_interval;
+    /* Process CPU time: the host descheduling us is no sign of a spin. */
+    setitimer(ITIMER_VIRTUAL, &it, NULL);
+}
+
+/* The console is the host's stdout. */
+
+void console_init(void)
+{
+}
+
+void console_crash_on_input(void)
+{
+}
+
+void console_sync(void)
+{
+    fflush(stdout);
+}
+
+void console_barrier(void)
+{
+}
+
+void console_write(const void *p, unsigned int bytes)
+{
+    fwrite(p, 1, bytes, stdout);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
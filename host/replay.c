@@ -0,0 +1,693 @@
+/*
+ * replay.c
+ *
+ * Host regression harness: tracks of flux are replayed through the
+ * unmodified read path and track decoders, and what they decode is checked
+ * against golden data.
+ *
+ * Each track is a cyclic stream of flux intervals, fed to the RDATA DMA
+ * model, which also pulses the index once per pass over it. An IBM track
+ * has one revolution captured and scanned for IDAMs, then is read whole by
+ * ibm_{mfm,fm}_read_track(). An Amiga track is checked for its track gap,
+ * then read by amiga_track_read(). The outcome is summarised a line per
+ * sector, and the summary of the whole corpus must match the golden file
+ * (or, with -r, is recorded as it).
+ *
+ * The built-in corpus is synthetic, and seeded: clean, jittered, off-speed
+ * and damaged tracks at each density. The data of every sector decoded
+ * from it with good CRC must also match what was generated. Testbed flux
+ * captures (console logs: see flux_dump() in src/main.c) are added to the
+ * corpus by naming them on the command line.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* The bitstream scanner is private to ibm.c, and the track generator to
+ * amiga.c. */
+#include "../src/amiga.c"
+#include "../src/ibm.c"
+
+#define MAX_SEC 64
+
+/* 200ms revolution, in SYSCLK ticks. */
+#define REV_TICKS sysclk_ms(200)
+
+static struct drive *drv;
+
+static uint32_t seed;
+
+static uint32_t replay_rand(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+/* The codec routines peek at the data before a buffer: leave headroom. */
+static void *replay_alloc(unsigned int bytes)
+{
+    uint8_t *p = malloc(bytes + 4);
+    memset(p, 0, bytes + 4);
+    return p + 4;
+}
+
+static void replay_free(void *p)
+{
+    free((uint8_t *)p - 4);
+}
+
+struct track {
+    char name[48];
+    enum { FMT_mfm, FMT_fm, FMT_amiga } fmt;
+    /* Nominal SYSCLK ticks per bitcell. */
+    unsigned int cell;
+    uint16_t *flux;
+    unsigned int nr_flux;
+    /* Synthetic tracks: digest of each sector's data, by sector number. */
+    bool_t synthetic;
+    uint16_t digest[MAX_SEC];
+};
+
+static struct track *tracks;
+static unsigned int nr_tracks, max_tracks;
+
+static struct track *track_new(const char *name)
+{
+    struct track *t;
+
+    if (nr_tracks == max_tracks) {
+        max_tracks = max_tracks ? max_tracks * 2 : 32;
+        t = malloc(max_tracks * sizeof(*t));
+        if (nr_tracks)
+            memcpy(t, tracks, nr_tracks * sizeof(*t));
+        free(tracks);
+        tracks = t;
+    }
+
+    t = &tracks[nr_tracks++];
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    return t;
+}
+
+static uint16_t digest(const void *p, unsigned int bytes)
+{
+    return crc16_ccitt(p, bytes, 0xffff);
+}
+
+/*
+ * SYNTHETIC TRACKS
+ */
+
+/* Bitcells to flux. Bitcells are @cell * (1 + @ppm/10^6) ticks long, and
+ * each reversal is displaced by up to +/- @jitter ticks. The final
+ * bitcell must be 1, so that the cyclic track starts on a reversal. */
+static void mk_flux(struct track *t, const uint16_t *bc, unsigned int words,
+                    int ppm, unsigned int jitter)
+{
+    uint64_t cell16 = ((uint64_t)t->cell << 4) * (1000000 + ppm) / 1000000;
+    uint64_t t16 = 0;
+    int64_t pos, prev = 0;
+    unsigned int i, j, nr = 0;
+
+    t->flux = malloc(words * 16 * 2);
+    for (i = 0; i < words; i++) {
+        for (j = 0; j < 16; j++) {
+            t16 += cell16;
+            if (!((be16toh(bc[i]) << j) & 0x8000))
+                continue;
+            pos = (t16 >> 4) + (int)(replay_rand() % (2*jitter + 1))
+                - (int)jitter;
+            t->flux[nr++] = pos - prev;
+            prev = pos;
+        }
+    }
+    /* The first interval runs on from the last of the revolution. */
+    t->flux[0] += (t16 >> 4) - prev;
+    t->nr_flux = nr;
+}
+
+/* A synthetic IBM track. */
+struct ibm_spec {
+    const char *name;
+    bool_t fm;
+    unsigned int cell, nr, n, gap3;
+    /* Write speed error (ppm), and peak reversal displacement (% cell). */
+    int ppm;
+    unsigned int jitter_pct;
+    /* Damage: sector with a bad IDAM CRC, with a bad data CRC, without a
+     * DAM, and with a deleted-data DAM (-1 for none). */
+    int bad_id, bad_dat, no_dam, deleted;
+    /* Burst of random short flux in the post-index gap? */
+    bool_t noise;
+};
+
+static void mk_ibm(const struct ibm_spec *s)
+{
+    struct track *t = track_new(s->name);
+    unsigned int gap_sync = s->fm ? fm_gap_sync : mfm_gap_sync;
+    unsigned int gap2 = s->fm ? fm_gap2 : mfm_gap2;
+    unsigned int mark_off = s->fm ? 0 : 3, sz = 128 << s->n;
+    unsigned int bytes = REV_TICKS / (16 * s->cell), pos, i, j, nr_sync = 0;
+    uint8_t gap = s->fm ? 0xff : 0x4e, *p;
+    unsigned int sync[2*s->nr], mark[2*s->nr];
+    uint16_t crc, *bc;
+
+    t->fmt = s->fm ? FMT_fm : FMT_mfm;
+    t->cell = s->cell;
+    t->synthetic = TRUE;
+
+    bytes = max(bytes, 80 + s->nr * (2*gap_sync + 2*4 + 6 + gap2 + sz
+                                     + s->gap3));
+    bytes = (bytes + 1) & ~1;
+    bc = replay_alloc(bytes * 2);
+    p = (uint8_t *)bc;
+    memset(p, gap, bytes);
+
+    pos = s->fm ? 40 : 80;
+    for (i = 0; i < s->nr; i++) {
+        /* IDAM */
+        memset(p+pos, 0x00, gap_sync);
+        pos += gap_sync;
+        sync[nr_sync] = pos;
+        mark[nr_sync++] = 0xfe;
+        memset(p+pos, 0xa1, mark_off);
+        p[pos+mark_off] = 0xfe;
+        p[pos+mark_off+1] = 0;
+        p[pos+mark_off+2] = 0;
+        p[pos+mark_off+3] = i+1;
+        p[pos+mark_off+4] = s->n;
+        crc = crc16_ccitt(p+pos, mark_off+5, 0xffff) ^ (i == s->bad_id);
+        p[pos+mark_off+5] = crc >> 8;
+        p[pos+mark_off+6] = crc;
+        pos += mark_off + 7 + gap2;
+        /* DAM */
+        if (i == s->no_dam) {
+            pos += gap_sync + mark_off + 1 + sz + 2 + s->gap3;
+            continue;
+        }
+        memset(p+pos, 0x00, gap_sync);
+        pos += gap_sync;
+        sync[nr_sync] = pos;
+        mark[nr_sync++] = (i == s->deleted) ? 0xf8 : 0xfb;
+        memset(p+pos, 0xa1, mark_off);
+        p[pos+mark_off] = mark[nr_sync-1];
+        for (j = 0; j < sz; j++)
+            p[pos+mark_off+1+j] = replay_rand();
+        t->digest[i+1] = digest(p+pos+mark_off+1, sz);
+        crc = crc16_ccitt(p+pos, mark_off+1+sz, 0xffff) ^ (i == s->bad_dat);
+        p[pos+mark_off+1+sz] = crc >> 8;
+        p[pos+mark_off+2+sz] = crc;
+        pos += mark_off + 3 + sz + s->gap3;
+    }
+
+    if (s->fm) {
+        bin_to_fm(bc, bytes);
+        for (i = 0; i < nr_sync; i++)
+            bc[sync[i]] = htobe16(fm_sync(mark[i], FM_SYNC_CLK));
+    } else {
+        bin_to_mfm(bc, bytes);
+        for (i = 0; i < nr_sync; i++)
+            for (j = 0; j < 3; j++)
+                bc[sync[i]+j] = htobe16(0x4489);
+    }
+    bc[bytes-1] |= htobe16(1);
+
+    mk_flux(t, bc, bytes, s->ppm, (s->cell * s->jitter_pct) / 100);
+    replay_free(bc);
+
+    if (s->noise)
+        for (i = 16; i < 48; i++)
+            t->flux[i] = s->cell/4 + replay_rand() % (2*s->cell);
+}
+
+/* A synthetic AmigaDOS track, as amiga_track_write() would write it. */
+static void mk_amiga(const char *name, unsigned int nsec, int ppm,
+                     unsigned int jitter_pct)
+{
+    struct track *t = track_new(name);
+    unsigned int words = (110000 / 32) * 2 * (nsec / 11), i;
+    uint8_t *dat = malloc(nsec * 512);
+    struct amiga_track_gen g;
+    uint16_t *bc;
+
+    t->fmt = FMT_amiga;
+    t->cell = (nsec == 11) ? sysclk_us(2) : sysclk_us(1);
+    t->synthetic = TRUE;
+
+    for (i = 0; i < nsec * 512; i++)
+        dat[i] = replay_rand();
+    for (i = 0; i < nsec; i++)
+        t->digest[i] = digest(dat + i*512, 512);
+
+    bc = replay_alloc(words * 2);
+    g.b = (const uint32_t *)dat;
+    g.track = 5;
+    g.nsec = nsec;
+    g.pos = 0;
+    g.pr = 0;
+    amiga_track_gen(&g.wr, bc, words);
+    bc[words-1] |= htobe16(1);
+
+    mk_flux(t, bc, words, ppm, (t->cell * jitter_pct) / 100);
+    replay_free(bc);
+    free(dat);
+}
+
+static const struct ibm_spec ibm_corpus[] = {
+    /* name             fm  cell           nr  n  gap3 ppm  jit
+     *                                     bad_id bad_dat no_dam deleted */
+    { "mfm_dd",         0, sysclk_us(2),   9, 2, 84,   0,  0,
+      -1, -1, -1, -1 },
+    { "mfm_hd",         0, sysclk_us(1),  18, 2, 84,   0,  0,
+      -1, -1, -1, -1 },
+    { "mfm_ed",         0, sysclk_ns(500), 36, 2, 84,  0,  0,
+      -1, -1, -1, -1 },
+    { "mfm_hd_8k",      0, sysclk_us(1),   1, 6, 40,   0,  0,
+      -1, -1, -1, -1 },
+    { "fm_sd",          1, sysclk_us(4),  10, 1, 27,   0,  0,
+      -1, -1, -1, -1 },
+    { "mfm_dd_jitter",  0, sysclk_us(2),   9, 2, 84,   0, 20,
+      -1, -1, -1, -1 },
+    { "mfm_ed_jitter",  0, sysclk_ns(500), 36, 2, 84,  0, 20,
+      -1, -1, -1, -1 },
+    { "fm_sd_jitter",   1, sysclk_us(4),  10, 1, 27,   0, 20,
+      -1, -1, -1, -1 },
+    { "mfm_dd_slow",    0, sysclk_us(2),   9, 2, 84, 40000, 5,
+      -1, -1, -1, -1 },
+    { "mfm_hd_fast",    0, sysclk_us(1),  18, 2, 84, -40000, 5,
+      -1, -1, -1, -1 },
+    { "mfm_dd_bad_id",  0, sysclk_us(2),   9, 2, 84,   0,  0,
+      3, -1, -1, -1 },
+    { "mfm_dd_bad_dat", 0, sysclk_us(2),   9, 2, 84,   0,  0,
+      -1, 5, -1, -1 },
+    { "mfm_dd_no_dam",  0, sysclk_us(2),   9, 2, 84,   0,  0,
+      -1, -1, 2, -1 },
+    { "mfm_hd_deleted", 0, sysclk_us(1),  18, 2, 84,   0,  0,
+      -1, -1, -1, 7 },
+    { "fm_sd_bad_dat",  1, sysclk_us(4),  10, 1, 27,   0,  0,
+      -1, 0, -1, -1 },
+    { "mfm_dd_noise",   0, sysclk_us(2),   9, 2, 84,   0,  0,
+      -1, -1, -1, -1, TRUE },
+    { "mfm_dd_first_bad", 0, sysclk_us(2), 9, 2, 84,   0, 10,
+      0, 0, -1, -1 },
+};
+
+static void mk_corpus(void)
+{
+    unsigned int i;
+
+    seed = 0x2545f491;
+    for (i = 0; i < ARRAY_SIZE(ibm_corpus); i++)
+        mk_ibm(&ibm_corpus[i]);
+    mk_amiga("amiga_dd", 11, 0, 0);
+    mk_amiga("amiga_hd", 22, 0, 0);
+    mk_amiga("amiga_dd_jitter", 11, 0, 20);
+    mk_amiga("amiga_dd_slow", 11, 30000, 5);
+}
+
+/*
+ * CAPTURED TRACKS
+ */
+
+#define FRAME_HDR 28
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Add each flux capture framed within a testbed console log. The frame is
+ * struct flux_frame, in src/main.c: a 28-byte header, varint flux, then a
+ * CRC16-CCITT over the lot. */
+static bool_t load_captures(const char *path, bool_t amiga)
+{
+    unsigned int bytes, pos, nr_flux, nr_bytes, cell, i, j, nr = 0;
+    uint8_t *log = host_load(path, &bytes), *p;
+    struct track *t;
+    uint32_t x, shift, k, elapsed, period;
+    char name[48];
+
+    if (log == NULL) {
+        printk("%s: cannot read\n", path);
+        return FALSE;
+    }
+
+    for (pos = 0; pos + FRAME_HDR <= bytes; pos++) {
+        p = log + pos;
+        if (memcmp(p, "FFCP", 4))
+            continue;
+        cell = p[6] | (p[7] << 8);
+        nr_flux = le32(p + 20);
+        nr_bytes = le32(p + 24);
+        elapsed = le32(p + 12);
+        period = le32(p + 16);
+        if ((bytes - pos < FRAME_HDR + 2)
+            || (nr_bytes > bytes - pos - FRAME_HDR - 2)
+            || crc16_ccitt(p, FRAME_HDR + nr_bytes + 2, 0xffff))
+            continue;
+        snprintf(name, sizeof(name), "%s#%u", strrchr(path, '/')
+                 ? strrchr(path, '/') + 1 : path, nr++);
+        t = track_new(name);
+        t->fmt = amiga ? FMT_amiga
+            : (cell >= sysclk_us(4)) ? FMT_fm : FMT_mfm;
+        t->cell = cell;
+        t->flux = malloc(nr_flux * 2);
+        for (i = j = 0; i < nr_flux; i++) {
+            x = shift = 0;
+            do {
+                x |= (p[FRAME_HDR+j] & 0x7f) << shift;
+                shift += 7;
+            } while (p[FRAME_HDR + j++] & 0x80);
+            /* Whole cells and a zigzagged residual, or (0 cells) raw. */
+            k = x & 7;
+            x >>= 3;
+            t->flux[i] = k ? k * cell + ((x >> 1) ^ -(x & 1)) : x;
+            /* A track is one revolution: drop any flux beyond it. */
+            elapsed += t->flux[i];
+            if (period && (elapsed >= period)) {
+                i++;
+                break;
+            }
+        }
+        t->nr_flux = i;
+        pos += FRAME_HDR + nr_bytes + 2 - 1;
+    }
+
+    free(log);
+    if (nr == 0)
+        printk("%s: no flux captures\n", path);
+    return nr != 0;
+}
+
+/*
+ * REPLAY
+ */
+
+/* Summary of the corpus, as decoded. */
+static char *sum;
+static unsigned int sum_len, sum_max;
+
+static void out(const char *format, ...)
+{
+    va_list ap;
+    char *p;
+    int n;
+
+    for (;;) {
+        va_start(ap, format);
+        n = vsnprintf(sum + sum_len, sum_max - sum_len, format, ap);
+        va_end(ap);
+        if (sum_len + n < sum_max)
+            break;
+        sum_max = sum_max ? sum_max * 2 : 65536;
+        p = malloc(sum_max);
+        memcpy(p, sum, sum_len);
+        free(sum);
+        sum = p;
+    }
+    sum_len += n;
+}
+
+/* Sector data which decoded with good CRC, yet differs from what was
+ * generated. */
+static unsigned int nr_bad_data;
+
+static void check_data(const struct track *t, unsigned int sec, uint16_t d)
+{
+    if (!t->synthetic || (sec >= MAX_SEC) || (t->digest[sec] == d))
+        return;
+    printk("%s: sector %u: bad data\n", t->name, sec);
+    nr_bad_data++;
+}
+
+static unsigned int track_cells(const struct track *t)
+{
+    uint64_t ticks = 0;
+    unsigned int i;
+
+    for (i = 0; i < t->nr_flux; i++)
+        ticks += t->flux[i];
+    return ticks / t->cell;
+}
+
+/* Scan one revolution of a track for IDAMs. Returns how many. */
+static unsigned int replay_ibm_scan(const struct track *t)
+{
+    const struct sync_pattern *sync = (t->fmt == FMT_fm)
+        ? &sync_fm_c7 : &sync_mfm_a1;
+    unsigned int mark_off = (t->fmt == FMT_fm) ? 1 : 3;
+    /* A revolution decodes to more or fewer bitcells than nominal if the
+     * track was written off speed: capture a little extra. */
+    unsigned int words = (track_cells(t) / 16 * 105 / 100) & ~1;
+    uint16_t *bc = replay_alloc((words + 2) * 2);
+    struct ibm_scan_info info[MAX_SEC];
+    struct read rd;
+    unsigned int i, n;
+
+    host_rdata_track(t->flux, t->nr_flux);
+    rd.p = bc;
+    rd.nr_words = words;
+    rd.sync = SYNC_none;
+    rd.decode = DECODE_table;
+    floppy_read_prep(&rd);
+    floppy_read(&rd);
+    n = ibm_scan_bc(bc, words*16, words*16, sync, mark_off,
+                    info, ARRAY_SIZE(info), NULL);
+    n = min_t(unsigned int, n, ARRAY_SIZE(info));
+    /* Marks beyond the first IDAM's reappearance are the next revolution. */
+    for (i = 1; i < n; i++)
+        if (!memcmp(&info[i].idam, &info[0].idam, sizeof(info[0].idam)))
+            n = i;
+    for (i = 0; i < n; i++)
+        out("scan %u.%u.%u.%u dam=%u\n", info[i].idam.c, info[i].idam.h,
+            info[i].idam.r, info[i].idam.n, !!info[i].dam_offset);
+    replay_free(bc);
+
+    return n;
+}
+
+static void replay_ibm(const struct track *t)
+{
+    struct ibm_sector sec[MAX_SEC];
+    unsigned int bytes, i, n, sz;
+    uint8_t *buf;
+
+    /* The whole-track read must find at least one IDAM, or it would hunt
+     * for ever. */
+    if (replay_ibm_scan(t) == 0)
+        return;
+
+    bytes = (MAX_SEC + 2) * 8192;
+    buf = replay_alloc(bytes);
+    host_rdata_track(t->flux, t->nr_flux);
+    n = (t->fmt == FMT_fm)
+        ? ibm_fm_read_track(buf, bytes, sec, ARRAY_SIZE(sec))
+        : ibm_mfm_read_track(buf, bytes, sec, ARRAY_SIZE(sec));
+    for (i = 0; i < n; i++) {
+        out("sec %u.%u.%u.%u ok=%u", sec[i].idam.c, sec[i].idam.h,
+            sec[i].idam.r, sec[i].idam.n, sec[i].crc_ok);
+        if (sec[i].data == NULL) {
+            out(" -\n");
+            continue;
+        }
+        sz = 128 << (sec[i].idam.n & 7);
+        out(" %04x\n", digest(sec[i].data, sz));
+        if (sec[i].crc_ok)
+            check_data(t, sec[i].idam.r, digest(sec[i].data, sz));
+    }
+    replay_free(buf);
+}
+
+/* Is there an AmigaDOS sector header with togo == 1 in one revolution?
+ * Without one, amiga_track_read() would hunt for ever. */
+static bool_t amiga_has_last(const struct track *t)
+{
+    unsigned int words = (track_cells(t) / 16 * 105 / 100) & ~1;
+    uint16_t *bc = replay_alloc((words + 2) * 2);
+    uint32_t pos = 0, info;
+    bool_t found = FALSE;
+    struct read rd;
+
+    host_rdata_track(t->flux, t->nr_flux);
+    rd.p = bc;
+    rd.nr_words = words;
+    rd.sync = SYNC_none;
+    rd.decode = DECODE_pll;
+    floppy_read_prep(&rd);
+    floppy_read(&rd);
+
+    while (!found && (words*16 >= 32*4)
+           && ((pos = bc_find_sync(bc, pos, words*16 - 32*4,
+                                   &sync_mfm_a1)) != ~0u)) {
+        info = ((((bc_word(bc, pos+32) << 16) | bc_word(bc, pos+48))
+                 & 0x55555555) << 1)
+            | (((bc_word(bc, pos+64) << 16) | bc_word(bc, pos+80))
+               & 0x55555555);
+        found = ((info >> 24) == 0xff) && ((uint8_t)info == 1);
+        pos += 32;
+    }
+
+    replay_free(bc);
+    return found;
+}
+
+static void replay_amiga(const struct track *t)
+{
+    unsigned int nsec = (t->cell < sysclk_us(2)) ? 22 : 11, warn, i;
+    /* Room for any sector number a bad header may claim. */
+    uint8_t *buf = replay_alloc(256 * 512);
+    uint16_t d;
+
+    if (!amiga_has_last(t)) {
+        replay_free(buf);
+        return;
+    }
+
+    warn = host_warn_count();
+    host_rdata_track(t->flux, t->nr_flux);
+    amiga_track_read(buf, 5, nsec);
+    warn = host_warn_count() - warn;
+    for (i = 0; i < nsec; i++) {
+        d = digest(buf + i*512, 512);
+        out("sec %u %04x\n", i, d);
+        if (warn == 0)
+            check_data(t, i, d);
+    }
+    replay_free(buf);
+}
+
+static void replay(const struct track *t)
+{
+    unsigned int warn = host_warn_count();
+
+    drv->ticks_per_cell = t->cell;
+    out("== %s\n", t->name);
+    if (t->fmt == FMT_amiga)
+        replay_amiga(t);
+    else
+        replay_ibm(t);
+    out("warn %u\n", host_warn_count() - warn);
+}
+
+/* Report the first track whose summary differs from the golden file. */
+static bool_t check_golden(const char *golden)
+{
+    const char *p = sum, *q = golden, *t = sum;
+    unsigned int line = 1;
+
+    while ((*p != '\0') && (*p == *q)) {
+        if (*p == '\n')
+            line++;
+        if (!strncmp(p, "\n== ", 4))
+            t = p + 1;
+        p++;
+        q++;
+    }
+    if (*p == *q)
+        return TRUE;
+
+    printk("Mismatch at line %u of golden file, in track:\n", line);
+    for (; (*t != '\0') && (t <= p || *t != '\n'); t++)
+        printk("%c", *t);
+    printk("\n");
+    return FALSE;
+}
+
+static void usage(void)
+{
+    printk("usage: replay [-r] [-a] [-n reps] [-g golden] [capture.log...]\n"
+           "  -r  Record the golden file, rather than check against it\n"
+           "  -a  Captures are of Amiga tracks\n"
+           "  -n  Replay the corpus @reps times, for timing\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *golden_path = NULL;
+    bool_t record = FALSE, amiga = FALSE, ok = TRUE;
+    unsigned int i, reps = 1, r, bytes;
+    char *golden, *p, path[256];
+    uint64_t t;
+
+    floppy_init();
+    floppy_select(0);
+    drv = cur_drive;
+
+    mk_corpus();
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r")) {
+            record = TRUE;
+        } else if (!strcmp(argv[i], "-a")) {
+            amiga = TRUE;
+        } else if (!strcmp(argv[i], "-n") && (i+1 < argc)) {
+            reps = strtol(argv[++i], NULL, 10) ?: 1;
+        } else if (!strcmp(argv[i], "-g") && (i+1 < argc)) {
+            golden_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage();
+            return 1;
+        } else if (!load_captures(argv[i], amiga)) {
+            return 1;
+        }
+    }
+
+    /* By default the golden file sits beside the executable. */
+    if (golden_path == NULL) {
+        snprintf(path, sizeof(path), "%s", argv[0]);
+        p = strrchr(path, '/');
+        snprintf(p ? p+1 : path, sizeof(path) - (p ? p+1-path : 0),
+                 "replay.gold");
+        golden_path = path;
+    }
+
+    printk("** FlashFloppy TestBed: host flux replay\n");
+
+    t = host_ns();
+    for (r = 0; r < reps; r++) {
+        sum_len = 0;
+        for (i = 0; i < nr_tracks; i++)
+            replay(&tracks[i]);
+    }
+    t = host_ns() - t;
+    printk("%u tracks in %u ms (%u tracks/s)\n", nr_tracks * reps,
+           (unsigned int)(t / 1000000),
+           (unsigned int)((nr_tracks * reps * 1000000000ull) / (t ?: 1)));
+
+    if (nr_bad_data) {
+        printk("** %u sectors decoded with good CRC but bad data\n",
+               nr_bad_data);
+        ok = FALSE;
+    }
+
+    if (record) {
+        if (!host_save(golden_path, sum, sum_len)) {
+            printk("%s: cannot write\n", golden_path);
+            return 1;
+        }
+        printk("Recorded %s\n", golden_path);
+    } else if ((golden = host_load(golden_path, &bytes)) == NULL) {
+        printk("%s: cannot read\n", golden_path);
+        ok = FALSE;
+    } else {
+        if (!check_golden(golden))
+            ok = FALSE;
+        free(golden);
+    }
+
+    printk("** %s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,928 @@
+/*
+ * sim.c
+ *
+ * Host build: cycle-approximate model of the STM32 peripherals behind the
+ * testbed (STK, NVIC, GPIO, EXTI, DMA1 and TIM1-4), wired as a Gotek to a
+ * virtual drive (drive.c). main.c runs on it unmodified.
+ *
+ * Time is virtual, in SYSCLK ticks since reset. The CPU runs for free
+ * between peripheral accesses, and each access costs ACCESS_TICKS. Register
+ * writes are found, and acted on, at the CPU's next access: a write is any
+ * difference from the values last published to the CPU. Timer updates and
+ * captures, DMA transfers and drive line changes are events, processed in
+ * time order. IRQs are taken at the event that raises them, and nest by
+ * priority, honouring PRIMASK and BASEPRI as the CPU would.
+ *
+ * A CPU polling the peripherals, and seeing nothing new, is idle: it skips
+ * ahead to the next event. A CPU spinning on memory, waiting for an IRQ
+ * handler to update it, makes no accesses at all: a host timer notices, and
+ * runs the model on to the next IRQ.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* CPU time of a peripheral access. */
+#define ACCESS_TICKS 12
+
+/* Accesses seeing nothing new, after which the CPU is deemed idle, and how
+ * far it may then skip ahead with no event in sight. */
+#define IDLE_ACCESSES 4
+#define IDLE_SKIP sysclk_ms(1)
+
+/* Host timer period (us) for catching a CPU spinning on memory, and how far
+ * the model runs ahead in search of an IRQ for it. */
+#define TICK_US 1000
+#define TICK_SKIP sysclk_ms(10)
+
+#define NEVER (~0ull)
+#define NR_IRQS 64
+
+/* The model works on its registers directly. */
+#undef stk
+#undef nvic
+#undef gpioa
+#undef gpiob
+#undef gpioc
+#undef afio
+#undef exti
+#undef tim1
+#undef tim2
+#undef tim3
+#undef tim4
+
+volatile struct host_regs host_regs;
+
+/* Register values as last published to, or committed from, the CPU. */
+static struct host_regs pub;
+
+/* A model update to a register, which the CPU will not take for a write. */
+#define SET(r, p, field, val) ((r)->field = (p)->field = (val))
+
+static struct {
+    uint64_t now;
+    /* Nesting of model entries, and a count of them, for the host timer. */
+    volatile unsigned int depth, entries;
+    unsigned int tick_entries;
+    /* Register block last handed to the CPU, with writes yet to commit. */
+    volatile void *last;
+    /* Events processed; IRQs taken; idle accesses in a row. */
+    unsigned int events, events_seen, irqs, idle;
+    unsigned int drive_gen;
+    /* Run limits: rounds of main.c, and virtual time. */
+    unsigned int rounds;
+    uint64_t limit;
+    uint64_t host_start;
+} sim = {
+    .rounds = 1,
+    .limit = sysclk_ms(600000ull)
+};
+
+static struct {
+    bool_t primask;
+    uint8_t basepri;
+    /* Priorities of the IRQ handlers running, innermost last. */
+    uint8_t active[16];
+    unsigned int nr_active;
+} cpu;
+
+static void commit(void);
+static void advance(uint64_t to);
+static void deliver(void);
+
+
+/*
+ * NVIC
+ */
+
+#define IRQ(n) void IRQ_##n(void) __attribute__((weak));
+IRQ(6) IRQ(7) IRQ(8) IRQ(9) IRQ(10) /* EXTI0-4 */
+IRQ(11) IRQ(12) IRQ(13) IRQ(14) IRQ(15) IRQ(16) IRQ(17) /* DMA1 ch1-7 */
+IRQ(23) /* EXTI9_5 */
+IRQ(25) IRQ(27) IRQ(28) IRQ(29) IRQ(30) /* TIM1_UP, TIM1_CC, TIM2-4 */
+IRQ(37) /* USART1 */
+IRQ(40) /* EXTI15_10 */
+#undef IRQ
+
+static void (*const vector[NR_IRQS])(void) = {
+    [6] = IRQ_6, [7] = IRQ_7, [8] = IRQ_8, [9] = IRQ_9, [10] = IRQ_10,
+    [11] = IRQ_11, [12] = IRQ_12, [13] = IRQ_13, [14] = IRQ_14,
+    [15] = IRQ_15, [16] = IRQ_16, [17] = IRQ_17,
+    [23] = IRQ_23,
+    [25] = IRQ_25, [27] = IRQ_27, [28] = IRQ_28, [29] = IRQ_29, [30] = IRQ_30,
+    [37] = IRQ_37,
+    [40] = IRQ_40
+};
+
+static void irq_pend(unsigned int irq)
+{
+    volatile struct nvic *r = &host_regs.nvic;
+    SET(r, &pub.nvic, ispr[irq>>5], r->ispr[irq>>5] | (1u << (irq&31)));
+}
+
+/* The IRQ which the CPU would take now, if any. */
+static int irq_next(void)
+{
+    volatile struct nvic *r = &host_regs.nvic;
+    unsigned int i, irq, pri, best_pri = 16;
+    int best = -1;
+    uint32_t x;
+
+    if (cpu.primask)
+        return -1;
+
+    for (i = 0; i < NR_IRQS/32; i++) {
+        for (x = r->ispr[i] & r->iser[i]; x != 0; x &= x - 1) {
+            irq = i*32 + __builtin_ctz(x);
+            pri = r->ipr[irq] >> 4;
+            if (pri < best_pri) {
+                best = irq;
+                best_pri = pri;
+            }
+        }
+    }
+
+    if ((best < 0)
+        || (cpu.basepri && ((best_pri << 4) >= cpu.basepri))
+        || (cpu.nr_active && (best_pri >= cpu.active[cpu.nr_active-1])))
+        return -1;
+    return best;
+}
+
+static void deliver(void)
+{
+    volatile struct nvic *r = &host_regs.nvic;
+    volatile void *last;
+    int irq;
+
+    while ((irq = irq_next()) >= 0) {
+        SET(r, &pub.nvic, ispr[irq>>5], r->ispr[irq>>5] & ~(1u << (irq&31)));
+        if (vector[irq] == NULL) {
+            printk("No handler for IRQ %d\n", irq);
+            WARN_ON(TRUE);
+            continue;
+        }
+        cpu.active[cpu.nr_active++] = r->ipr[irq] >> 4;
+        sim.irqs++;
+        last = sim.last;
+        (*vector[irq])();
+        commit();
+        sim.last = last;
+        cpu.nr_active--;
+    }
+}
+
+static bool_t nvic_commit(void)
+{
+    volatile struct nvic *r = &host_regs.nvic;
+    struct nvic *p = &pub.nvic;
+    bool_t wrote = FALSE;
+    unsigned int i;
+
+    for (i = 0; i < NR_IRQS/32; i++) {
+        if ((r->iser[i] != p->iser[i]) || (r->ispr[i] != p->ispr[i]))
+            wrote = TRUE;
+        p->iser[i] = r->iser[i];
+        p->ispr[i] = r->ispr[i];
+    }
+
+    return wrote;
+}
+
+
+/*
+ * DMA1
+ */
+
+/* CNDTR reload value, latched as each channel is enabled. */
+static uint16_t dma_reload[7];
+
+#define dma_chn(regs, n) (&(regs)->ch1 + (n) - 1)
+
+static void dma_request(unsigned int n)
+{
+    volatile struct dma *r = &host_regs.dma;
+    volatile struct dma_chn *ch = dma_chn(r, n);
+    struct dma_chn *pch = dma_chn(&pub.dma, n);
+    uint16_t *mem, *per, reload = dma_reload[n-1];
+    uint32_t cndtr = ch->cndtr, flags = 0, ie = 0;
+    unsigned long off;
+
+    if (!(ch->ccr & DMA_CCR_EN) || !cndtr)
+        return;
+
+    mem = (uint16_t *)(unsigned long)ch->cmar;
+    if (ch->ccr & DMA_CCR_MINC)
+        mem += reload - cndtr;
+    per = (uint16_t *)(unsigned long)ch->cpar;
+    if (ch->ccr & DMA_CCR_DIR_M2P) {
+        *per = *mem;
+        /* A peripheral register: keep the CPU from seeing a write. */
+        off = (unsigned long)per - (unsigned long)&host_regs;
+        if (off < sizeof(pub))
+            *(uint16_t *)((char *)&pub + off) = *mem;
+    } else {
+        *mem = *per;
+    }
+
+    if (--cndtr == reload/2) {
+        flags = DMA_ISR_HTIF(n);
+        ie = ch->ccr & DMA_CCR_HTIE;
+    } else if (cndtr == 0) {
+        flags = DMA_ISR_TCIF(n);
+        ie = ch->ccr & DMA_CCR_TCIE;
+        if (ch->ccr & DMA_CCR_CIRC)
+            cndtr = reload;
+    }
+    SET(ch, pch, cndtr, cndtr);
+
+    if (flags) {
+        SET(r, &pub.dma, isr, r->isr | flags | DMA_ISR_GIF(n));
+        if (ie)
+            irq_pend(10 + n);
+    }
+}
+
+static bool_t dma_commit(void)
+{
+    volatile struct dma *r = &host_regs.dma;
+    volatile struct dma_chn *ch;
+    struct dma *p = &pub.dma;
+    struct dma_chn *pch;
+    bool_t wrote = FALSE;
+    uint32_t clr;
+    unsigned int n;
+
+    if ((clr = r->ifcr) != 0) {
+        for (n = 1; n <= 7; n++)
+            if (clr & DMA_IFCR_CGIF(n))
+                clr |= 0xfu << ((n-1)*4);
+        SET(r, p, isr, p->isr & ~clr);
+        SET(r, p, ifcr, 0);
+        wrote = TRUE;
+    }
+    r->isr = p->isr; /* read only */
+
+    for (n = 1; n <= 7; n++) {
+        ch = dma_chn(r, n);
+        pch = dma_chn(p, n);
+        if ((ch->ccr == pch->ccr) && (ch->cndtr == pch->cndtr)
+            && (ch->cpar == pch->cpar) && (ch->cmar == pch->cmar))
+            continue;
+        wrote = TRUE;
+        /* CNDTR is written only while the channel is disabled. */
+        if (pch->ccr & DMA_CCR_EN)
+            ch->cndtr = pch->cndtr;
+        if (ch->ccr & ~pch->ccr & DMA_CCR_EN)
+            dma_reload[n-1] = ch->cndtr;
+        *pch = *ch;
+    }
+
+    return wrote;
+}
+
+
+/*
+ * TIM1-4
+ */
+
+/* TIM1 Ch.1 captures RDATA. TIM3 Ch.2 drives a WDATA pulse per update. */
+#define TIM_RDATA 0
+#define TIM_WDATA 2
+
+static struct tim_model {
+    volatile struct tim *r;
+    struct tim *p;
+    /* Update IRQ, and DMA channel for update requests (if any). */
+    uint8_t irq, dma;
+    /* Active prescaler. CNT was zero at @base. Next update at @next. */
+    uint16_t psc;
+    uint64_t base, next;
+} tims[4] = {
+    { &host_regs.tim1, &pub.tim1, 25, 5, 0, 0, NEVER },
+    { &host_regs.tim2, &pub.tim2, 28, 2, 0, 0, NEVER },
+    { &host_regs.tim3, &pub.tim3, 29, 3, 0, 0, NEVER },
+    { &host_regs.tim4, &pub.tim4, 30, 7, 0, 0, NEVER }
+};
+
+static uint16_t tim_cnt(struct tim_model *t)
+{
+    volatile struct tim *r = t->r;
+
+    if (!(r->cr1 & TIM_CR1_CEN) || !r->arr)
+        return r->cnt;
+    return ((sim.now - t->base) / (t->psc + 1)) % (r->arr + 1);
+}
+
+static void tim_schedule(struct tim_model *t)
+{
+    volatile struct tim *r = t->r;
+    uint64_t tick = t->psc + 1;
+
+    t->next = NEVER;
+    if (!(r->cr1 & TIM_CR1_CEN) || !r->arr)
+        return;
+    /* ARR is not preloaded. If it is now below CNT, CNT wraps first. */
+    t->next = t->base + (r->arr + 1) * tick;
+    if (t->next <= sim.now)
+        t->next = t->base + 0x10000 * tick;
+}
+
+static void tim_update(struct tim_model *t, bool_t ug)
+{
+    volatile struct tim *r = t->r;
+
+    t->base = sim.now;
+    t->psc = r->psc;
+    SET(r, t->p, cnt, 0);
+
+    if (!ug || !(r->cr1 & TIM_CR1_URS)) {
+        SET(r, t->p, sr, r->sr | TIM_SR_UIF);
+        if (r->dier & TIM_DIER_UIE)
+            irq_pend(t->irq);
+        if (r->dier & TIM_DIER_UDE)
+            dma_request(t->dma);
+    }
+
+    if (!ug) {
+        if (r->cr1 & TIM_CR1_OPM)
+            SET(r, t->p, cr1, r->cr1 & ~TIM_CR1_CEN);
+        if ((t == &tims[TIM_WDATA]) && (r->ccer & TIM_CCER_CC2E))
+            drive_write_flux(sim.now);
+    }
+
+    tim_schedule(t);
+}
+
+static struct {
+    uint64_t next;
+    bool_t valid;
+} rdata, edge;
+
+/* An RDATA reversal: captured into CCR1 and DMAed to the ring. */
+static void rdata_capture(void)
+{
+    struct tim_model *t = &tims[TIM_RDATA];
+    volatile struct tim *r = t->r;
+
+    SET(r, t->p, ccr1, tim_cnt(t));
+    SET(r, t->p, sr, r->sr | TIM_SR_CC1IF);
+    if (r->dier & TIM_DIER_CC1DE)
+        dma_request(2);
+    if (r->dier & TIM_DIER_CC1IE)
+        irq_pend(27);
+}
+
+static bool_t tim_commit(struct tim_model *t)
+{
+    volatile struct tim *r = t->r;
+    struct tim *p = t->p;
+    bool_t started;
+
+    if (!memcmp((void *)r, p, sizeof(*p)))
+        return FALSE;
+
+    /* SR is cleared by writing zeroes. */
+    r->sr &= p->sr;
+
+    if (r->cnt != p->cnt)
+        t->base = sim.now - (uint64_t)r->cnt * (t->psc + 1);
+
+    started = r->cr1 & ~p->cr1 & TIM_CR1_CEN;
+    if (p->cr1 & ~r->cr1 & TIM_CR1_CEN) {
+        /* Stopped: CNT holds. */
+        p->cr1 = r->cr1 | TIM_CR1_CEN;
+        r->cnt = tim_cnt(t);
+    } else if (started) {
+        t->base = sim.now - (uint64_t)r->cnt * (t->psc + 1);
+    }
+
+    memcpy(p, (void *)r, sizeof(*p));
+
+    if (r->egr & TIM_EGR_UG)
+        tim_update(t, TRUE);
+    SET(r, p, egr, 0);
+
+    tim_schedule(t);
+    if (t == &tims[TIM_RDATA])
+        rdata.valid = FALSE;
+
+    return TRUE;
+}
+
+
+/*
+ * GPIO, EXTI, and the drive bus.
+ */
+
+static volatile struct gpio *const gpio_r[] = {
+    &host_regs.gpioa, &host_regs.gpiob, &host_regs.gpioc };
+static struct gpio *const gpio_p[] = { &pub.gpioa, &pub.gpiob, &pub.gpioc };
+
+/* Gotek wiring: see src/gotek/floppy.c. All lines are active low. There is
+ * no unit 1 on the bus. */
+static const struct bus_pin {
+    uint8_t port, pin;
+    unsigned int line;
+} bus_out[] = {
+    { 1, 6, DRIVE_sel },
+    { 1, 1, DRIVE_motor },
+    { 1, 7, DRIVE_dir },
+    { 1, 8, DRIVE_step },
+    { 1, 3, DRIVE_side },
+    { 1, 5, DRIVE_wgate }
+}, bus_in[] = {
+    { 0, 0, DRIVE_index },
+    { 0, 1, DRIVE_dskchg },
+    { 1, 0, DRIVE_wrprot },
+    { 1, 4, DRIVE_ready },
+    { 1, 9, DRIVE_trk0 }
+};
+
+/* RDATA (PA8) is an EXTI line: it flags reversals since it was cleared. */
+#define PIN_RDATA 8
+static uint64_t rdata_exti_since;
+
+static unsigned int exti_irq(unsigned int line)
+{
+    return (line < 5) ? 6 + line : (line < 10) ? 23 : 40;
+}
+
+static void exti_edges(unsigned int port, uint32_t changed, uint32_t level)
+{
+    volatile struct exti *r = &host_regs.exti;
+    volatile struct afio *afio = &host_regs.afio;
+    uint32_t exticr[] = { afio->exticr1, afio->exticr2,
+                          afio->exticr3, afio->exticr4 };
+    unsigned int line;
+    uint32_t m;
+
+    for (; changed != 0; changed &= changed - 1) {
+        line = __builtin_ctz(changed);
+        m = 1u << line;
+        if ((((exticr[line/4] >> ((line%4)*4)) & 0xf) != port)
+            || !(r->imr & m)
+            || !(((level & m) ? r->rtsr : r->ftsr) & m))
+            continue;
+        SET(r, &pub.exti, pr, r->pr | m);
+        irq_pend(exti_irq(line));
+    }
+}
+
+/* Drive inputs to the GPIO input registers. Unconnected pins read as
+ * driven, or pulled, by ODR. */
+static void bus_inputs(void)
+{
+    unsigned int i, in = drive_inputs(sim.now);
+    uint32_t idr[3], changed;
+
+    for (i = 0; i < 3; i++)
+        idr[i] = gpio_r[i]->odr & 0xffff;
+    idr[0] |= 1u << PIN_RDATA;
+    for (i = 0; i < ARRAY_SIZE(bus_in); i++) {
+        if (in & bus_in[i].line)
+            idr[bus_in[i].port] &= ~(1u << bus_in[i].pin);
+        else
+            idr[bus_in[i].port] |= 1u << bus_in[i].pin;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if ((changed = idr[i] ^ gpio_r[i]->idr) == 0)
+            continue;
+        SET(gpio_r[i], gpio_p[i], idr, idr[i]);
+        exti_edges(i, changed, idr[i]);
+    }
+}
+
+/* A pin drives the bus only when configured as an output. */
+static bool_t pin_is_output(volatile struct gpio *g, unsigned int pin)
+{
+    uint32_t cr = (pin < 8) ? g->crl : g->crh;
+    return (cr >> ((pin & 7) * 4)) & 3;
+}
+
+static void bus_outputs(void)
+{
+    const struct bus_pin *b;
+    unsigned int i, out = 0;
+
+    for (i = 0; i < ARRAY_SIZE(bus_out); i++) {
+        b = &bus_out[i];
+        if (pin_is_output(gpio_r[b->port], b->pin)
+            && !(gpio_r[b->port]->odr & (1u << b->pin)))
+            out |= b->line;
+    }
+
+    drive_outputs(sim.now, out);
+    bus_inputs();
+}
+
+static bool_t gpio_commit(unsigned int i)
+{
+    volatile struct gpio *r = gpio_r[i];
+    struct gpio *p = gpio_p[i];
+    uint32_t odr = r->odr;
+
+    if ((odr == p->odr) && !r->bsrr && !r->brr
+        && (r->crl == p->crl) && (r->crh == p->crh))
+        return FALSE;
+
+    if (r->bsrr)
+        odr = (odr & ~(r->bsrr >> 16)) | (r->bsrr & 0xffff);
+    odr &= ~r->brr;
+    SET(r, p, bsrr, 0);
+    SET(r, p, brr, 0);
+    SET(r, p, odr, odr);
+    p->crl = r->crl;
+    p->crh = r->crh;
+    r->idr = p->idr; /* read only */
+
+    bus_outputs();
+    return TRUE;
+}
+
+static bool_t exti_commit(void)
+{
+    volatile struct exti *r = &host_regs.exti;
+    struct exti *p = &pub.exti;
+    uint32_t clr;
+
+    if (!memcmp((void *)r, p, sizeof(*p)))
+        return FALSE;
+
+    /* PR is cleared by writing ones. */
+    if ((clr = r->pr) != p->pr) {
+        r->pr = p->pr & ~clr;
+        if (clr & (1u << PIN_RDATA))
+            rdata_exti_since = sim.now;
+    }
+    memcpy(p, (void *)r, sizeof(*p));
+
+    return TRUE;
+}
+
+static void exti_publish(void)
+{
+    volatile struct exti *r = &host_regs.exti;
+    uint32_t m = 1u << PIN_RDATA;
+
+    if (!(r->pr & m) && (r->imr & r->ftsr & m)
+        && (drive_next_flux(rdata_exti_since) <= sim.now))
+        SET(r, &pub.exti, pr, r->pr | m);
+}
+
+
+/*
+ * Model core.
+ */
+
+/* Act on CPU writes to the register block last handed out. */
+static void commit(void)
+{
+    volatile void *last = sim.last;
+    bool_t wrote = FALSE;
+    unsigned int i;
+
+    if (last == NULL)
+        return;
+    if (last == &host_regs.nvic)
+        wrote = nvic_commit();
+    else if (last == &host_regs.dma)
+        wrote = dma_commit();
+    else if (last == &host_regs.exti)
+        wrote = exti_commit();
+    for (i = 0; i < ARRAY_SIZE(gpio_r); i++)
+        if (last == gpio_r[i])
+            wrote = gpio_commit(i);
+    for (i = 0; i < ARRAY_SIZE(tims); i++)
+        if (last == tims[i].r)
+            wrote = tim_commit(&tims[i]);
+    if (wrote)
+        sim.idle = 0;
+}
+
+/* Bring time-dependent register values up to date. */
+static void publish(volatile void *regs)
+{
+    volatile struct stk *stk_r = &host_regs.stk;
+    unsigned int i;
+
+    if (regs == stk_r) {
+        SET(stk_r, &pub.stk, val,
+            (STK_MASK - sysclk_stk(0) - (sim.now / (SYSCLK_MHZ / STK_MHZ)))
+            & STK_MASK);
+    } else if (regs == &host_regs.exti) {
+        exti_publish();
+    } else {
+        for (i = 0; i < ARRAY_SIZE(tims); i++)
+            if (regs == tims[i].r)
+                SET(tims[i].r, tims[i].p, cnt, tim_cnt(&tims[i]));
+    }
+}
+
+static uint64_t next_event(void)
+{
+    struct tim_model *t1 = &tims[TIM_RDATA];
+    uint64_t t;
+    unsigned int i;
+
+    if (sim.drive_gen != drive_gen()) {
+        sim.drive_gen = drive_gen();
+        rdata.valid = edge.valid = FALSE;
+    }
+    if (!rdata.valid) {
+        rdata.next = ((t1->r->cr1 & TIM_CR1_CEN)
+                      && (t1->r->ccer & TIM_CCER_CC1E))
+            ? drive_next_flux(sim.now) : NEVER;
+        rdata.valid = TRUE;
+    }
+    if (!edge.valid) {
+        edge.next = drive_next_edge(sim.now);
+        edge.valid = TRUE;
+    }
+
+    t = min(rdata.next, edge.next);
+    for (i = 0; i < ARRAY_SIZE(tims); i++)
+        t = min(t, tims[i].next);
+    return t;
+}
+
+static void __attribute__((noreturn)) finish(const char *why);
+
+/* Run the model to time @to, processing events and taking IRQs on the
+ * way. IRQ handlers may themselves move time on. */
+static void advance(uint64_t to)
+{
+    uint64_t t;
+    unsigned int i;
+
+    while ((t = next_event()) <= to) {
+        sim.now = max(sim.now, t);
+        for (i = 0; i < ARRAY_SIZE(tims); i++)
+            if (tims[i].next == t)
+                tim_update(&tims[i], FALSE);
+        if (rdata.next == t) {
+            rdata_capture();
+            rdata.valid = FALSE;
+        }
+        if (edge.next == t) {
+            bus_inputs();
+            edge.valid = FALSE;
+        }
+        sim.events++;
+        deliver();
+    }
+
+    sim.now = max(sim.now, to);
+    if (sim.now > sim.limit)
+        finish("time limit");
+}
+
+static void enter(void)
+{
+    sim.depth++;
+    sim.entries++;
+    barrier();
+    commit();
+}
+
+static void leave(void)
+{
+    barrier();
+    sim.depth--;
+}
+
+volatile void *host_periph(volatile void *regs)
+{
+    uint64_t to;
+    bool_t quiet;
+
+    enter();
+
+    /* Nothing new since the previous access? */
+    quiet = (sim.idle != 0) || (sim.events == sim.events_seen);
+    sim.idle = quiet ? sim.idle + 1 : 0;
+    to = sim.now + ACCESS_TICKS;
+    if (sim.idle > IDLE_ACCESSES) {
+        sim.idle = 0;
+        to = max(to, min(next_event(), sim.now + IDLE_SKIP));
+    }
+
+    deliver();
+    advance(to);
+    sim.events_seen = sim.events;
+
+    publish(regs);
+    sim.last = regs;
+
+    leave();
+    return regs;
+}
+
+volatile struct dma *host_dma1(void)
+{
+    return host_periph(&host_regs.dma);
+}
+
+void host_relax(void)
+{
+    enter();
+    deliver();
+    advance(min(next_event(), sim.now + IDLE_SKIP));
+    leave();
+}
+
+/* The CPU is spinning on memory if it has not entered the model since the
+ * previous tick. Run until an IRQ handler has had a chance to release it. */
+static void tick(void)
+{
+    uint64_t to = sim.now + TICK_SKIP;
+    unsigned int irqs = sim.irqs;
+
+    if (sim.depth || (sim.entries != sim.tick_entries)) {
+        sim.tick_entries = sim.entries;
+        return;
+    }
+
+    enter();
+    deliver();
+    while ((sim.irqs == irqs) && (sim.now < to))
+        advance(min(next_event(), to));
+    leave();
+    sim.tick_entries = sim.entries;
+}
+
+
+/*
+ * CPU: exceptions and IRQ masking.
+ */
+
+int host_in_exception(void)
+{
+    return cpu.nr_active != 0;
+}
+
+void host_irq_global(int enable)
+{
+    cpu.primask = !enable;
+    if (enable) {
+        enter();
+        deliver();
+        leave();
+    }
+}
+
+uint8_t host_irq_save(uint8_t newpri)
+{
+    uint8_t oldpri = cpu.basepri;
+    newpri <<= 4;
+    if (!oldpri || (oldpri > newpri))
+        cpu.basepri = newpri;
+    return oldpri;
+}
+
+void host_irq_restore(uint8_t oldpri)
+{
+    cpu.basepri = oldpri;
+    enter();
+    deliver();
+    leave();
+}
+
+
+/*
+ * Stand-ins for target-only code (stm32f10x.c, vectors.S, the linker
+ * script).
+ */
+
+/* DATA and BSS are set up by the host loader: their linker symbols are
+ * defined empty (see Makefile). The stacks exist only for their canaries. */
+uint32_t _thread_stacktop[1], _thread_stackbottom[1];
+uint32_t _irq_stacktop[1], _irq_stackbottom[1];
+
+/* The target's thread stack: its 64kB RAM, less DATA, BSS and the IRQ
+ * stack. Host frames stand in for the target's, from stm32_init()'s down. */
+#define THREAD_STACK_BYTES (56*1024)
+static unsigned long thread_stack_top;
+
+unsigned int thread_stack_free(void)
+{
+    unsigned long used = thread_stack_top
+        - (unsigned long)__builtin_frame_address(0);
+    return (used < THREAD_STACK_BYTES) ? THREAD_STACK_BYTES - used : 0;
+}
+
+void stm32_init(void)
+{
+    /* All pins floating inputs, as at reset. */
+    unsigned int i;
+
+    thread_stack_top = (unsigned long)__builtin_frame_address(0);
+
+    for (i = 0; i < ARRAY_SIZE(gpio_r); i++) {
+        volatile struct gpio *g = host_periph(gpio_r[i]);
+        g->crl = g->crh = 0x44444444u;
+    }
+}
+
+void delay_ticks(unsigned int ticks)
+{
+    enter();
+    deliver();
+    advance(sim.now + sysclk_stk(ticks));
+    leave();
+}
+
+void delay_ns(unsigned int ns)
+{
+    delay_ticks((ns * STK_MHZ) / 1000u);
+}
+
+void delay_us(unsigned int us)
+{
+    delay_ticks(us * STK_MHZ);
+}
+
+void delay_ms(unsigned int ms)
+{
+    delay_ticks(ms * 1000u * STK_MHZ);
+}
+
+/* As the target's, but through the model accessor on each call: callers may
+ * configure many pins of the same port through one pointer. */
+void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode)
+{
+    volatile struct gpio *g = host_periph(gpio);
+
+    gpio_write_pin(g, pin, mode >> 4);
+    mode &= 0xfu;
+    if (pin >= 8) {
+        pin -= 8;
+        g->crh = (g->crh & ~(0xfu<<(pin<<2))) | (mode<<(pin<<2));
+    } else {
+        g->crl = (g->crl & ~(0xfu<<(pin<<2))) | (mode<<(pin<<2));
+    }
+}
+
+
+/*
+ * Run control.
+ */
+
+static void __attribute__((noreturn)) finish(const char *why)
+{
+    uint64_t host = host_ns() - sim.host_start;
+    uint32_t v_ms = sim.now / sysclk_ms(1), h_ms = host / 1000000u;
+
+    printk("\n*** TESTBED: %s: %u.%03us virtual, %u.%03us host "
+           "(x%u), %u WARN(s)\n", why, v_ms / 1000, v_ms % 1000,
+           h_ms / 1000, h_ms % 1000, v_ms / max_t(uint32_t, h_ms, 1),
+           host_warn_count());
+    exit((host_warn_count() || strcmp(why, "done")) ? 1 : 0);
+}
+
+/* Stop as round @sim.rounds begins. */
+void host_console(const char *s)
+{
+    const char *p;
+
+    for (p = s; *p != '\0'; p++)
+        if (!strncmp(p, "*** ROUND ", 10)
+            && (strtol(p + 10, NULL, 10) >= sim.rounds))
+            finish("done");
+}
+
+/* Options: -r <rounds> (default 1), -t <virtual seconds> (default 600),
+ * -d <image directory> (default "images"). */
+static void __attribute__((constructor)) sim_init(int argc, char **argv)
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && (i+1 < argc)) {
+            sim.rounds = strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-t") && (i+1 < argc)) {
+            sim.limit = sysclk_ms(1000ull) * strtol(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-d") && (i+1 < argc)) {
+            drive_init(argv[++i]);
+        } else {
+            printk("Usage: %s [-r rounds] [-t virtual-seconds] "
+                   "[-d image-dir]\n", argv[0]);
+            exit(2);
+        }
+    }
+
+    sim.host_start = host_ns();
+    bus_inputs();
+    host_ticker(TICK_US, tick);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
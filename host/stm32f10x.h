@@ -0,0 +1,125 @@
+/*
+ * stm32f10x.h
+ *
+ * Host build: core and peripheral registers. Register blocks live in
+ * ordinary memory (host_regs). The DMA controller is reached through
+ * host_dma1(), which first brings the floppy-data DMA model up to date.
+ * Every other modelled peripheral is reached through host_periph(), which
+ * lets the simulator (sim.c) bring the register block up to date first.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* C pointer types */
+#define STK volatile struct stk * const
+#define SCB volatile struct scb * const
+#define NVIC volatile struct nvic * const
+#define RCC volatile struct rcc * const
+#define GPIO volatile struct gpio * const
+#define AFIO volatile struct afio * const
+#define EXTI volatile struct exti * const
+#define DMA volatile struct dma * const
+#define TIM volatile struct tim * const
+#define USART volatile struct usart * const
+
+extern volatile struct host_regs {
+    struct stk stk;
+    struct scb scb;
+    struct nvic nvic;
+    struct rcc rcc;
+    struct gpio gpioa, gpiob, gpioc;
+    struct afio afio;
+    struct exti exti;
+    struct dma dma;
+    struct tim tim1, tim2, tim3, tim4;
+    struct usart usart1;
+} host_regs;
+
+volatile struct dma *host_dma1(void);
+volatile void *host_periph(volatile void *regs);
+#define HOST_PERIPH(x) ((typeof(&host_regs.x))host_periph(&host_regs.x))
+
+/* C-accessible registers. */
+#define stk    HOST_PERIPH(stk)
+#define scb    (&host_regs.scb)
+#define nvic   HOST_PERIPH(nvic)
+#define rcc    (&host_regs.rcc)
+#define gpioa  HOST_PERIPH(gpioa)
+#define gpiob  HOST_PERIPH(gpiob)
+#define gpioc  HOST_PERIPH(gpioc)
+#define afio   (&host_regs.afio)
+#define exti   HOST_PERIPH(exti)
+#define dma1   (host_dma1())
+#define tim1   HOST_PERIPH(tim1)
+#define tim2   HOST_PERIPH(tim2)
+#define tim3   HOST_PERIPH(tim3)
+#define tim4   HOST_PERIPH(tim4)
+#define usart1 (&host_regs.usart1)
+
+/* System */
+void stm32_init(void);
+void system_reset(void);
+/* Bytes of thread stack free beneath the caller's frame. */
+unsigned int thread_stack_free(void);
+
+/* Clocks */
+#define SYSCLK_MHZ 72
+#define SYSCLK     (SYSCLK_MHZ * 1000000)
+#define sysclk_ns(x) (((x) * SYSCLK_MHZ) / 1000)
+#define sysclk_us(x) ((x) * SYSCLK_MHZ)
+#define sysclk_ms(x) ((x) * SYSCLK_MHZ * 1000)
+#define sysclk_stk(x) ((x) * (SYSCLK_MHZ / STK_MHZ))
+
+/* SysTick Timer */
+#define STK_MHZ    (SYSCLK_MHZ / 8)
+void delay_ticks(unsigned int ticks);
+void delay_ns(unsigned int ns);
+void delay_us(unsigned int us);
+void delay_ms(unsigned int ms);
+
+typedef uint32_t stk_time_t;
+#define stk_now() (stk->val)
+#define stk_diff(x,y) (((x)-(y)) & STK_MASK) /* d = y - x */
+#define stk_add(x,d)  (((x)-(d)) & STK_MASK) /* y = x + d */
+#define stk_sub(x,d)  (((x)+(d)) & STK_MASK) /* y = x - d */
+#define stk_timesince(x) stk_diff(x,stk_now())
+
+#define stk_us(x) ((x) * STK_MHZ)
+#define stk_ms(x) stk_us((x) * 1000)
+#define stk_sysclk(x) ((x) / (SYSCLK_MHZ / STK_MHZ))
+
+/* NVIC: ISER is the enable state and ISPR the pending state. There is no
+ * separate ICER or ICPR. */
+#define IRQx_enable(x) do {                     \
+    barrier();                                  \
+    nvic->iser[(x)>>5] |= 1u<<((x)&31);         \
+} while (0)
+#define IRQx_disable(x) do {                    \
+    nvic->iser[(x)>>5] &= ~(1u<<((x)&31));      \
+    cpu_sync();                                 \
+} while (0)
+#define IRQx_is_enabled(x) ((nvic->iser[(x)>>5]>>((x)&31))&1)
+#define IRQx_set_pending(x) (nvic->ispr[(x)>>5] |= 1u<<((x)&31))
+#define IRQx_clear_pending(x) (nvic->ispr[(x)>>5] &= ~(1u<<((x)&31)))
+#define IRQx_is_pending(x) ((nvic->ispr[(x)>>5]>>((x)&31))&1)
+#define IRQx_set_prio(x,y) (nvic->ipr[x] = (y) << 4)
+#define IRQx_get_prio(x) (nvic->ipr[x] >> 4)
+
+/* GPIO */
+void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode);
+#define gpio_write_pin(gpio, pin, level) \
+    ((gpio)->bsrr = ((level) ? 0x1u : 0x10000u) << (pin))
+#define gpio_write_pins(gpio, mask, level) \
+    ((gpio)->bsrr = (uint32_t)(mask) << ((level) ? 0 : 16))
+#define gpio_read_pin(gpio, pin) (((gpio)->idr >> (pin)) & 1)
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
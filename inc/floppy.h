@@ -15,30 +15,98 @@
  * READ PATH
  */
 
+/* A sync mark, matched when (window & mask) == value, where the window holds
+ * the most recent 32 bitcells and ends on a flux reversal. The final
+ * @nr_bits of the window become the start of the read data. */
+struct sync_pattern {
+    uint32_t mask, value;
+    uint8_t nr_bits;
+};
+
+/* A1A1 (IBM MFM, and Amiga 4489 4489); C2C2 (IBM MFM IAM). */
+extern const struct sync_pattern sync_mfm_a1, sync_mfm_c2;
+/* Clock C7 (FM IDAM/DAM, any data byte); clock D7 (FM IAM). */
+extern const struct sync_pattern sync_fm_c7, sync_fm_d7;
+
 struct read {
     /** INPUTS **/
     /* Bitcell input buffer. Must be 32-bit aligned. */
     void *p;
     /* Number of words (16-bitcells) to read. Must be multiple of two. */
     unsigned int nr_words;
-    /* SYNC_*: If non-zero, delay read until indicated FM/MFM sync mark. */
-    enum { SYNC_none=0, SYNC_fm, SYNC_mfm } sync;
+    /* SYNC_*: If non-zero, delay read until indicated FM/MFM sync mark.
+     * SYNC_pattern waits for any of the @nr_sync_pats marks at @sync_pats. */
+    enum { SYNC_none=0, SYNC_fm, SYNC_mfm, SYNC_pattern } sync;
+    const struct sync_pattern *sync_pats;
+    unsigned int nr_sync_pats;
+    /* DECODE_*: Flux-to-bitcell decoder. The table decoder emits a whole
+     * run of bitcells per flux, with output identical to the loop. The PLL
+     * decoder tracks drift in the bitcell period and phase. DECODE_raw does
+     * not decode: each flux interval (SYSCLK ticks) is stored as a base-128
+     * varint, low 7 bits first, with bit 7 set on all but the final byte.
+     * The varint's low 3 bits are the interval's nearest whole number of
+     * cells, k (1-7), and the rest the residual, interval - k*ticks_per_cell,
+     * zigzag encoded (0,-1,1,-2,... as 0,1,2,3,...). k=0 escapes any other
+     * interval, stored whole above the 3 bits.
+     * The read is done when @p may not have room for another interval. */
+    enum { DECODE_loop=0, DECODE_table, DECODE_pll, DECODE_raw } decode;
 
     /** OUTPUTS **/
     /* Time at which the read started. */
     time_t start;
+    /* SYNC_pattern: Index of the sync mark that was found. */
+    unsigned int sync_hit;
     /* Time at which the read ended. */
     time_t end;
+    /* DECODE_pll: Final tracked bitcell period, and peak absolute phase
+     * error. Both in SYSCLK ticks * 16. */
+    int32_t pll_period;
+    uint32_t pll_peak_err;
+    /* DECODE_raw: Flux intervals stored, and bytes of @p they occupy. */
+    unsigned int raw_flux, raw_bytes;
 
     /** PRIVATE **/
     /* Tail of bitcell stream. */
     uint32_t bc_window;
     /* Progress through output buffer (in bitcells). */
     uint32_t bc_prod;
+    /* Fixed-point reciprocal of ticks_per_cell, for sync-mark hunting. */
+    uint32_t cell_recip;
+    /* DECODE_pll: Offset from the current clock edge (SYSCLK ticks * 16). */
+    int32_t pll_phase;
+    /* Flux histogram, or NULL. */
+    struct flux_hist *hist;
 };
 
 void floppy_read_prep(struct read *rd);
 void floppy_read(struct read *rd);
+/* As floppy_read(), but returns as soon as the read is under way. The flux
+ * is then decoded in the DMA half/full-transfer IRQ, and @done (if not
+ * NULL) is called from that IRQ on completion. rd->end is when completion
+ * was noticed: up to half a DMA ring after the final flux. */
+void floppy_read_async(struct read *rd, void (*done)(struct read *));
+bool_t floppy_read_async_done(void);
+void floppy_read_async_wait(void);
+/* Decode a DMA ring's worth of flux with the timer stopped, or hunt through
+ * it for rd->sync. Returns SYSCLK cycles spent in the decoder; *p_nr_flux
+ * is the number of flux processed. */
+uint32_t floppy_read_bench(struct read *rd, unsigned int *p_nr_flux);
+
+/*
+ * FLUX HISTOGRAM
+ */
+
+/* Flux intervals seen by the read path. Bin i counts intervals in
+ * [i, i+1) << shift, where 1 << shift is the largest power of two no more
+ * than ticks_per_cell/8. The final bin also counts all longer intervals. */
+struct flux_hist {
+    uint16_t shift;
+    uint32_t bin[64];
+};
+
+/* Reads prepared from now on add their flux to @hist (NULL for none). The
+ * histogram is cleared, and binned for the current ticks_per_cell. */
+void floppy_set_flux_hist(struct flux_hist *hist);
 
 /*
  * WRITE PATH
@@ -52,18 +120,93 @@ struct write {
     unsigned int nr_words;
     /* Terminate write early at Xth index hole. 0 does not terminate early. */
     int terminate_at_index;
+    /* Optional bitcell generator. If set, @p is a buffer of @gen_words
+     * (a multiple of two) which @gen refills with the next @nr words of the
+     * write, just in time, as the flux ring is refilled. */
+    void (*gen)(struct write *wr, void *p, unsigned int nr);
+    unsigned int gen_words;
 
     /** PRIVATE **/
     /* Accumulated ticks (SYSCLK*16) since previous flux reversal. */
     uint32_t ticks_since_flux;
     /* Progress through input buffer (in bitcells). */
     uint32_t bc_cons;
+    /* Bitcells held in @p: [bc_base, bc_gen). */
+    uint32_t bc_base, bc_gen;
+    /* Precompensation: a flux reversal is emitted only once the interval
+     * after it is known. pc_pend is the ideal interval (SYSCLK*16) ending at
+     * that reversal, or 0 if none; pc_class its precomp class; pc_shift the
+     * shift applied to the reversal before it. */
+    uint32_t pc_pend;
+    uint16_t pc_class;
+    int16_t pc_shift;
 };
 
 void floppy_write_prep(struct write *wr);
 void floppy_write(struct write *wr);
 /* floppy_write_prep()+floppy_write() with minimal delay. */
 void floppy_write_now(struct write *wr);
+/* Convert a whole write to flux, 32 flux per refill, without writing it.
+ * Returns SYSCLK cycles spent; *p_nr_flux is the number of flux produced. */
+uint32_t floppy_write_bench(struct write *wr, unsigned int *p_nr_flux);
+
+/*
+ * WRITE PRECOMPENSATION
+ */
+
+/* Each flux reversal written is shifted according to the intervals either
+ * side of it, each classed as 2, 3, or 4+ bitcells. */
+struct precomp_band {
+    /* First cylinder of the band, which extends to the next band. */
+    uint8_t cyl;
+    /* Shift in ns, late if positive, indexed [before][after]. */
+    int16_t ns[3][3];
+};
+
+/* Bands are in ascending cylinder order. No bands disables precomp. */
+void floppy_set_precomp(const struct precomp_band *band, unsigned int nr);
+
+/*
+ * WRITE JITTER
+ */
+
+/* Each flux reversal written is displaced by up to +/- @ns. The sequence is
+ * the same for every write with the same settings. */
+struct jitter {
+    enum { JITTER_none=0, JITTER_uniform, JITTER_gaussian, JITTER_wow } mode;
+    /* Peak displacement. */
+    uint16_t ns;
+    /* JITTER_uniform, JITTER_gaussian: PRNG seed. */
+    uint32_t seed;
+    /* JITTER_wow: period of a triangle wave along the track. */
+    uint32_t period_us;
+};
+
+/* NULL disables jitter. */
+void floppy_set_jitter(const struct jitter *jitter);
+
+/*
+ * WRITE DATA RATE
+ */
+
+/* Written bitcells are @ppm parts per million longer than the drive's
+ * ticks_per_cell (shorter, if negative). Reads are unaffected. */
+void floppy_set_write_skew(int ppm);
+
+/*
+ * DMA RING HEALTH
+ */
+
+/* Accumulated across reads and writes, until cleared by the caller. */
+extern struct dma_stats {
+    /* RDATA: times the DMA producer lapped the flux decoder. */
+    unsigned int rdata_overruns;
+    /* WDATA: writes in which the timer ran beyond the queued flux. */
+    unsigned int wdata_underruns;
+    /* Peak ring entries (of 1024) awaiting the CPU when it got to them:
+     * RDATA flux yet to be decoded; WDATA flux already sent to disk. */
+    uint16_t rdata_hwm, wdata_hwm;
+} dma_stats;
 
 /*  
  * ASYNCHRONOUS (INTERRUPT-DRIVEN) FLOPPY SIGNALS
@@ -89,27 +232,69 @@ struct idam {
 struct ibm_scan_info {
     struct idam idam;
     unsigned int ticks_past_index;
+    /* Bytes from the IDAM's sync mark to its DAM's, or 0 if there is no
+     * DAM with good CRC. */
+    unsigned int dam_offset;
+};
+
+/* Rotational latency of the most recent sector search. A scan leaves a map
+ * of the track behind, and searches use it to sleep until their IDAM is
+ * about to pass the head. */
+extern struct ibm_search_stats {
+    /* Time asleep, rather than hunting sync marks. */
+    time_t slept;
+    /* Time with a read armed, hunting for the IDAM. */
+    time_t hunted;
+} ibm_search_stats;
+
+/* A sector returned by a whole-track read. The caller's buffer needs room
+ * for the data of every sector, plus one raw (double-size) sector. */
+struct ibm_sector {
+    struct idam idam;
+    unsigned int ticks_past_index;
+    /* Sector data, within the caller's buffer, or NULL if it did not fit. */
+    void *data;
+    /* Both the IDAM and the DAM were found with good CRC. */
+    bool_t crc_ok;
 };
 
 unsigned int ibm_mfm_scan(
     struct ibm_scan_info *info, unsigned int max, unsigned int *p_gap3);
 void ibm_mfm_read_sector(void *buf, const struct idam *idam);
+/* As ibm_mfm_read_sector(), but quietly: returns whether the sector read
+ * back intact, rather than WARNing. */
+bool_t ibm_mfm_try_read_sector(void *buf, const struct idam *idam);
+unsigned int ibm_mfm_read_track(
+    void *buf, unsigned int bytes, struct ibm_sector *sec, unsigned int max);
 void ibm_mfm_write_sector(
     const void *buf, const struct idam *idam, unsigned int gap3);
+void ibm_mfm_write_sectors(
+    const void *buf, const struct idam *idam, unsigned int nr,
+    unsigned int gap3);
 void ibm_mfm_write_track(
     const struct idam *idam, unsigned int nr, unsigned int gap3);
 
 unsigned int ibm_fm_scan(
     struct ibm_scan_info *info, unsigned int max, unsigned int *p_gap3);
 void ibm_fm_read_sector(void *buf, const struct idam *idam);
+bool_t ibm_fm_try_read_sector(void *buf, const struct idam *idam);
+unsigned int ibm_fm_read_track(
+    void *buf, unsigned int bytes, struct ibm_sector *sec, unsigned int max);
 void ibm_fm_write_sector(
     const void *buf, const struct idam *idam, unsigned int gap3);
+void ibm_fm_write_sectors(
+    const void *buf, const struct idam *idam, unsigned int nr,
+    unsigned int gap3);
 
 /*
  * AMIGA TRACK FORMAT
  */
 
 void amiga_track_read(void *buf, unsigned int track, unsigned int nsec);
+/* As amiga_track_read(), but quietly, and decoding the track by @decode:
+ * returns whether the track read back intact, rather than WARNing. */
+bool_t amiga_track_try_read(
+    void *buf, unsigned int track, unsigned int nsec, unsigned int decode);
 void amiga_track_write(const void *buf, unsigned int track, unsigned int nsec);
 
 /*
@@ -117,7 +302,7 @@ void amiga_track_write(const void *buf, unsigned int track, unsigned int nsec);
  */
 
 struct drive {
-    uint8_t cyl;
+    uint8_t cyl, head;
     /* Expected SYSCLK ticks per bitcell. */
     unsigned int ticks_per_cell;
 };
@@ -129,7 +314,17 @@ static inline uint16_t bintomfm(uint8_t x) { return mfmtab[x]; }
 void bin_to_mfm(void *p, unsigned int nr);
 uint8_t mfmtobin(uint16_t x);
 void mfm_to_bin(void *p, unsigned int nr);
+/* As mfm_to_bin(), by the bit-serial decoder it replaced. For benchmarks. */
+void mfm_to_bin_rrx(void *p, unsigned int nr);
 void mfm_check(const void *p, unsigned int nr);
+/* mfm_check(), mfm_to_bin() and crc16_ccitt() in one call, a block at a
+ * time (see mfm.c). Decodes @nr words from @in to @out, which may alias @in
+ * at or below it. Returns the CRC of the decoded bytes continued from @crc;
+ * *@bad is the number of words that are not valid MFM following the word
+ * before (starting from in[-1]). */
+uint16_t mfm_to_bin_crc(
+    void *out, const void *in, unsigned int nr, uint16_t crc,
+    unsigned int *bad);
 
 /* FM conversion. */
 #define FM_SYNC_CLK 0xc7
@@ -137,6 +332,8 @@ uint16_t fm_sync(uint8_t dat, uint8_t clk);
 void bin_to_fm(void *p, unsigned int nr);
 #define fm_to_bin(p, n) (mfm_to_bin((p), (n)))
 void fm_check(const void *p, unsigned int nr);
+/* As fm_check(), but quietly returns the number of bad words. */
+unsigned int fm_nr_bad(const void *p, unsigned int nr);
 
 /* External API. */
 void floppy_init(void);
@@ -69,6 +69,8 @@ extern uint32_t vector_table[];
 /* System */
 void stm32_init(void);
 void system_reset(void);
+/* Bytes of thread stack free beneath the caller's frame. */
+unsigned int thread_stack_free(void);
 
 /* Clocks */
 #define SYSCLK_MHZ 72
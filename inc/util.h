@@ -107,9 +107,16 @@ int vprintk(const char *format, va_list ap)
     __attribute__ ((format (printf, 1, 0)));
 int printk(const char *format, ...)
     __attribute__ ((format (printf, 1, 2)));
+/* Binary output: bytes are sent as is, waiting for room in the ring. */
+void console_write(const void *p, unsigned int nr);
 
 /* CRC-CCITT */
 uint16_t crc16_ccitt(const void *buf, size_t len, uint16_t crc);
+/* The CRC of A then B, given @crc_a over A (from any initial value) and
+ * @crc_b over B (from zero). */
+uint16_t crc16_combine(uint16_t crc_a, uint16_t crc_b, size_t len_b);
+/* As crc16_ccitt() over @len copies of @byte, in time log(@len). */
+uint16_t crc16_fill(uint8_t byte, size_t len, uint16_t crc);
 
 /* Display: 3-digit 7-segment display */
 void led_7seg_init(void);
@@ -133,6 +140,7 @@ void EXC_unused(void);
 /* IRQ priorities, 0 (highest) to 15 (lowest). */
 #define RESET_IRQ_PRI         0
 #define FLOPPY_IRQ_INDEX_PRI  1
+#define FLOPPY_IRQ_RDATA_PRI  2
 #define TIMER_IRQ_PRI         4
 #define FLOPPY_IRQ_DSKCHG_PRI 5
 #define CONSOLE_IRQ_PRI      15
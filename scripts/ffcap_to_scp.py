@@ -0,0 +1,135 @@
+# ffcap_to_scp.py
+#
+# Extract raw flux captures from a saved TestBed console log, and write them
+# to a SuperCard Pro (SCP) image. Each capture starts shortly after an index
+# pulse and becomes a single (possibly partial) revolution of its track.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys,struct,argparse
+
+# struct flux_frame, in src/main.c
+FRAME_MAGIC = b"FFCP"
+FRAME_HDR = "<4sBBHIIIII"
+FRAME_HDR_LEN = struct.calcsize(FRAME_HDR)
+
+SCP_HZ = 40000000 # 25ns resolution
+SCP_NR_TRACKS = 168
+
+def crc16_ccitt(dat, crc=0xffff):
+  for x in dat:
+    crc ^= x << 8
+    for i in range(8):
+      crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+      crc &= 0xffff
+  return crc
+
+# DECODE_raw, in inc/floppy.h: each varint is k (whole cells, 1-7) in its
+# low 3 bits, then the zigzagged residual from k cells. k=0 escapes a raw
+# interval.
+def decode_flux(dat, nr, cell):
+  flux, x, shift = [], 0, 0
+  for b in dat:
+    x |= (b & 0x7f) << shift
+    shift += 7
+    if not b & 0x80:
+      k, v = x & 7, x >> 3
+      flux.append(k*cell + ((v >> 1) ^ -(v & 1)) if k else v)
+      x, shift = 0, 0
+  assert len(flux) == nr, "Flux count mismatch"
+  return flux
+
+def find_frames(log):
+  frames, pos = [], 0
+  while True:
+    pos = log.find(FRAME_MAGIC, pos)
+    if pos < 0:
+      return frames
+    hdr = log[pos:pos+FRAME_HDR_LEN]
+    if len(hdr) < FRAME_HDR_LEN:
+      return frames
+    (_, cyl, head, cell, hz, index_offset, index_period,
+     nr_flux, nr_bytes) = struct.unpack(FRAME_HDR, hdr)
+    end = pos + FRAME_HDR_LEN + nr_bytes + 2
+    if end > len(log) or crc16_ccitt(log[pos:end]) != 0:
+      # Not a frame, or a corrupt one: resync after the magic.
+      print("Skipping bad frame at offset %u" % pos)
+      pos += 1
+      continue
+    flux = decode_flux(log[pos+FRAME_HDR_LEN:end-2], nr_flux, cell)
+    frames.append(dict(cyl=cyl, head=head, cell=cell, hz=hz,
+                       index_offset=index_offset,
+                       index_period=index_period, flux=flux))
+    pos = end
+
+# Flux intervals at @hz, to SCP sample values at 25ns. Rounding error is
+# carried, so that reversals do not drift.
+def to_scp(flux, hz):
+  out, t, prev = [], 0, 0
+  for x in flux:
+    t += x
+    now = (t * SCP_HZ + hz//2) // hz
+    v = now - prev
+    prev = now
+    while v >= 0x10000:
+      out.append(0)
+      v -= 0x10000
+    out.append(max(v, 1))
+  return out
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("infile", help="console log (binary)")
+  parser.add_argument("outfile", help="output SCP filename")
+  args = parser.parse_args(argv[1:])
+
+  with open(args.infile, "rb") as f:
+    frames = find_frames(f.read())
+  assert frames, "No flux captures found"
+
+  tracks = dict()
+  for fr in frames:
+    trk = fr['cyl']*2 + fr['head']
+    # Capture starts on a reversal, timed from the index pulse. It may run
+    # on past the next index: keep just the one revolution.
+    flux, tot = [fr['index_offset']], fr['index_offset']
+    for x in fr['flux']:
+      if fr['index_period'] and tot >= fr['index_period']:
+        break
+      flux.append(x)
+      tot += x
+    scp = to_scp(flux, fr['hz'])
+    tot = sum(flux)
+    print("Track %u (cyl %u head %u): %u flux, %.2f of a revolution, "
+          "cell %.3f us" % (trk, fr['cyl'], fr['head'], len(flux),
+                            tot / max(fr['index_period'], 1),
+                            fr['cell'] * 1e6 / fr['hz']))
+    if trk in tracks:
+      print(" ... replaces an earlier capture of this track")
+    tracks[trk] = (scp, (tot * SCP_HZ + fr['hz']//2) // fr['hz'])
+
+  # Header, and track offsets, then each track: TRK header, revolution
+  # (index time, flux count, data offset), then big-endian flux samples.
+  body = bytearray(struct.pack("<%uI" % SCP_NR_TRACKS, *[0]*SCP_NR_TRACKS))
+  offsets = [0] * SCP_NR_TRACKS
+  for trk in sorted(tracks):
+    scp, duration = tracks[trk]
+    offsets[trk] = 0x10 + len(body)
+    body += struct.pack("<3sB3I", b"TRK", trk, duration, len(scp), 16)
+    body += struct.pack(">%uH" % len(scp), *scp)
+  body[0:SCP_NR_TRACKS*4] = struct.pack("<%uI" % SCP_NR_TRACKS, *offsets)
+  first, last = min(tracks), max(tracks)
+  hdr = struct.pack("<3s9B", b"SCP", 0x22, 0x80, 1, first, last,
+                    0x01, # flags: index-aligned
+                    0, # 16-bit flux samples
+                    0, # both heads
+                    0) # 25ns resolution
+  with open(args.outfile, "wb") as f:
+    f.write(hdr + struct.pack("<I", sum(body) & 0xffffffff) + body)
+
+if __name__ == "__main__":
+  main(sys.argv)
@@ -40,7 +40,21 @@ static uint32_t get_long(uint32_t *p)
     return be32toh(((p[0] & 0x55555555) << 1) | (p[1] & 0x55555555));
 }
 
-void amiga_track_read(void *buf, unsigned int track, unsigned int nsec)
+/* Count a failed check of the track read, and WARN of it unless quiet. */
+#define amiga_check(p) do {                                 \
+    if ((p)) {                                              \
+        nr_bad++;                                           \
+        if (!quiet)                                         \
+            __warn(#p, __FILE__, __LINE__);                 \
+    }                                                       \
+} while (0)
+
+/* Read track @track of @nsec sectors to @buf, decoding the track itself by
+ * @decode. Returns whether it read back intact and, unless @quiet, WARNs of
+ * each way in which it did not. */
+static bool_t _amiga_track_read(
+    void *buf, unsigned int track, unsigned int nsec, unsigned int decode,
+    bool_t quiet)
 {
     const static unsigned int sec_bytes = 544;
     unsigned int track_bytes = sec_bytes * nsec - 2;
@@ -48,32 +62,40 @@ void amiga_track_read(void *buf, unsigned int track, unsigned int nsec)
     uint32_t *q, *p = bc_buf_alloc(track_bytes);
     uint32_t info, csum;
     uint8_t format, trk, sec, togo;
+    unsigned int nr_bad = 0;
     int i, j;
 
     rd.p = p;
     rd.nr_words = 6;
     rd.sync = SYNC_mfm;
+    rd.decode = DECODE_table;
 
     /* Scan for the last sector before track gap. Then read track all 
      * in one go (no track gap). */
     index.count = 0;
     do {
-        WARN_ON(index.count >= 2);
+        /* Give up once a whole revolution has passed without it. */
+        if (index.count >= 2) {
+            amiga_check(index.count >= 2);
+            return FALSE;
+        }
         floppy_read_prep(&rd);
         floppy_read(&rd);
         info = get_long(p+1);
     } while ((uint8_t)info != 1);
 
     rd.nr_words = track_bytes;
+    rd.decode = decode;
     floppy_read_prep(&rd);
     floppy_read(&rd);
 
     /* Check MFM validity. */
     for (i = 0; i < nsec; i++) {
-        WARN_ON(p[i*272] != htobe32(0x44894489));
+        amiga_check(p[i*272] != htobe32(0x44894489));
         p[i*272] = htobe32(0x44a944a9);
     }
-    mfm_check(p, track_bytes);
+    if (!quiet)
+        mfm_check(p, track_bytes);
 
     for (i = 0; i < nsec; i++) {
 
@@ -83,18 +105,18 @@ void amiga_track_read(void *buf, unsigned int track, unsigned int nsec)
         trk = info >> 16;
         sec = info >> 8;
         togo = info;
-        WARN_ON(format != 0xff);
-        WARN_ON(trk != track);
-        WARN_ON(sec >= nsec);
-        WARN_ON(togo != (nsec-i));
+        amiga_check(format != 0xff);
+        amiga_check(trk != track);
+        amiga_check(sec >= nsec);
+        amiga_check(togo != (nsec-i));
 
         /* Header checksum. */
         csum = amigados_mfm_checksum(p+1, 10);
-        WARN_ON(csum != get_long(p+11));
+        amiga_check(csum != get_long(p+11));
 
         /* Data checksum. */
         csum = amigados_mfm_checksum(p+15, 256);
-        WARN_ON(csum != get_long(p+13));
+        amiga_check(csum != get_long(p+13));
 
         /* Decode the data. */
         p += 15;
@@ -103,94 +125,135 @@ void amiga_track_read(void *buf, unsigned int track, unsigned int nsec)
             *p = ((*p & 0x55555555) << 1) | (*q & 0x55555555);
             p++; q++;
         }
-        memcpy((uint8_t *)buf + sec*512, p - 512/4, 512);
+        if (sec < nsec)
+            memcpy((uint8_t *)buf + sec*512, p - 512/4, 512);
 
         /* Skip the inter-sector gap. */
         p = q + 1;
 
     }
+
+    return !nr_bad;
 }
 
-void amiga_track_write(const void *buf, unsigned int track, unsigned int nsec)
+void amiga_track_read(void *buf, unsigned int track, unsigned int nsec)
 {
-    unsigned int track_bytes = (110000 / 32) * 2;
-    uint32_t csum, info, *q, *p, *end, pr = 0;
-    const uint32_t *b;
-    unsigned int i, sec;
+    (void)_amiga_track_read(buf, track, nsec, DECODE_table, FALSE);
+}
+
+bool_t amiga_track_try_read(
+    void *buf, unsigned int track, unsigned int nsec, unsigned int decode)
+{
+    return _amiga_track_read(buf, track, nsec, decode, TRUE);
+}
+
+/* Just-in-time generator of the track written by amiga_track_write(). */
+struct amiga_track_gen {
     struct write wr;
+    const uint32_t *b;
+    unsigned int track, nsec;
+    /* Current long of the track, and the previous raw long emitted. */
+    unsigned int pos;
+    uint32_t pr;
+};
 
-    if (nsec != 11) {
-        /* Amiga HD track */
-        ASSERT(nsec == 22);
-        track_bytes *= 2;
-    }
+/* Longs in the post-index gap (1024 bitcells), and in each sector. */
+#define AMIGA_GAP_LONGS 32
+#define AMIGA_SEC_LONGS (16 + 2*512/4)
+
+/* Next long of the track, as MFM data bits, or raw if @raw is set. */
+static uint32_t amiga_track_long(struct amiga_track_gen *g, bool_t *raw)
+{
+    unsigned int sec, off, pos = g->pos++;
+    const uint32_t *b;
+    uint32_t info, csum;
 
-    p = q = bc_buf_alloc(track_bytes);
-    end = p + track_bytes/2;
-    b = buf;
-
-#define emit_raw(r) ({                          \
-    uint32_t _r = (r);                          \
-    *q = htobe32(_r & ~(pr << 31));             \
-    pr = _r;                                    \
-    q++; })
-#define emit_long(l) ({                         \
-    uint32_t _l = (l), __l = _l;                \
-    _l &= 0x55555555u; /* data bits */          \
-    _l |= (~((__l>>2)|__l) & 0x55555555u) << 1; \
-    emit_raw(_l); })
-
-    /* Post-index gap (1024 bitcells). */
-    for (i = 0; i < 32; i++)
-        emit_long(0);
-
-    for (sec = 0; sec < nsec; sec++) {
-
-        /* Sector header */
-
-        /* sector gap */
-        emit_long(0);
-        /* sync */
-        emit_raw(0x44894489);
-        /* info word */
-        info = (0xff << 24) | (track << 16) | (sec << 8) | (nsec - sec);
-        emit_long(even(info));
-        emit_long(odd(info));
-        /* label */
-        for (i = 0; i < 8; i++)
-            emit_long(0);
-        /* header checksum */
+    *raw = FALSE;
+    if (pos < AMIGA_GAP_LONGS)
+        return 0;
+    pos -= AMIGA_GAP_LONGS;
+    sec = pos / AMIGA_SEC_LONGS;
+    off = pos % AMIGA_SEC_LONGS;
+    if (sec >= g->nsec)
+        return 0; /* pre-index gap */
+    b = g->b + sec * 512/4;
+    info = (0xff << 24) | (g->track << 16) | (sec << 8) | (g->nsec - sec);
+
+    switch (off) {
+    case 1: /* sync */
+        *raw = TRUE;
+        return 0x44894489;
+    case 2: /* info word */
+        return even(info);
+    case 3:
+        return odd(info);
+    case 13: /* header checksum */
         csum = info ^ (info >> 1);
-        emit_long(0);
-        emit_long(odd(csum));
-        /* data checksum */
+        return odd(csum);
+    case 15: /* data checksum */
         csum = amigados_dat_checksum(b, 512);
-        emit_long(0);
-        emit_long(odd(csum));
+        return odd(csum);
+    }
 
-        /* Sector data */
+    /* Sector gap, label, and the checksums' high longs are all zero. */
+    if (off < 16)
+        return 0;
 
-        for (i = 0; i < 512/4; i++)
-            emit_long(even(be32toh(b[i])));
-        for (i = 0; i < 512/4; i++)
-            emit_long(odd(be32toh(b[i])));
+    /* Sector data */
+    off -= 16;
+    return (off < 512/4) ? even(be32toh(b[off])) : odd(be32toh(b[off-512/4]));
+}
+
+static void amiga_track_gen(struct write *wr, void *p, unsigned int nr)
+{
+    struct amiga_track_gen *g = container_of(wr, struct amiga_track_gen, wr);
+    uint32_t *q = p, l, r;
+    bool_t raw;
 
-        b += 512/4;
+    for (nr /= 2; nr != 0; nr--) {
+        l = amiga_track_long(g, &raw);
+        if (raw) {
+            r = l;
+        } else {
+            r = l & 0x55555555u; /* data bits */
+            r |= (~((l>>2)|l) & 0x55555555u) << 1;
+        }
+        *q++ = htobe32(r & ~(g->pr << 31));
+        g->pr = r;
+    }
+}
+
+void amiga_track_write(const void *buf, unsigned int track, unsigned int nsec)
+{
+    unsigned int track_bytes = (110000 / 32) * 2;
+    uint32_t bc[32];
+    struct amiga_track_gen g;
+
+    /* Fewer than 11 sectors make a short DD track, with a longer gap. */
+    if (nsec > 11) {
+        /* Amiga HD track */
+        ASSERT(nsec == 22);
+        track_bytes *= 2;
     }
 
-    /* Pre-index gap */
-    while (q < end)
-        emit_long(0);
+    /* The track is generated as it is written. */
+    g.b = buf;
+    g.track = track;
+    g.nsec = nsec;
+    g.pos = 0;
+    g.pr = 0;
+    g.wr.p = bc;
+    g.wr.nr_words = track_bytes;
+    g.wr.terminate_at_index = 1;
+    g.wr.gen = amiga_track_gen;
+    g.wr.gen_words = ARRAY_SIZE(bc) * 2;
 
     /* Do the write, index-to-index. */
-    wr.p = p;
-    wr.nr_words = track_bytes;
-    wr.terminate_at_index = 1;
-    floppy_write_prep(&wr);
+    floppy_write_prep(&g.wr);
     index.count = 0;
     while (index.count == 0)
         continue;
-    floppy_write(&wr);
+    floppy_write(&g.wr);
 }
 
 /*
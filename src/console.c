@@ -109,6 +109,24 @@ int printk(const char *format, ...)
     return n;
 }
 
+void console_write(const void *p, unsigned int nr)
+{
+    const char *q = p;
+    unsigned int n;
+
+    while (nr != 0) {
+        IRQ_global_disable();
+        n = min_t(unsigned int, nr, sizeof(ring) - 1 - (prod - cons));
+        nr -= n;
+        while (n--)
+            ring[MASK(prod++)] = *q++;
+        kick_tx();
+        IRQ_global_enable();
+        if (nr != 0)
+            cpu_relax();
+    }
+}
+
 void console_sync(void)
 {
     if (sync_console)
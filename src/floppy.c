@@ -64,6 +64,9 @@ void floppy_init(void)
         IRQx_enable(e->irq);
     }
 
+    /* RDATA DMA IRQ is unmasked only during asynchronous reads. */
+    IRQx_set_prio(dma_rdata_irq, FLOPPY_IRQ_RDATA_PRI);
+
     /* Find cylinder 0 on unit 0. */
     set_sel0(O_TRUE);
     delay_us(10);
@@ -138,6 +141,7 @@ void floppy_seek(unsigned int cyl, unsigned int side)
 
     /* Select requested disk side. */
     set_side(side ? O_TRUE : O_FALSE);
+    drv->head = side;
 
     /* Special handling for cylinder 0. */
     if (cyl == 0) {
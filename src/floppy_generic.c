@@ -22,22 +22,141 @@ static struct dma_ring {
     uint16_t buf[1024];
 } dma_r, dma_w;
 
+struct dma_stats dma_stats;
+
 
 /*
  * READ PATH
  */
 
+/* Producer index as of our previous look at the RDATA ring. */
+static uint16_t rdata_prod_seen;
+
+/* Find out where the DMA engine's producer index has got to, and check that
+ * it has not lapped us. The DMA flags each pass of the ring's half-way and
+ * wrap points: a flag for a point the producer has not visibly passed since
+ * our last look means it has been all the way round. */
+static uint16_t rdata_prod(void)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma_r.buf) - 1;
+    uint32_t flags, passed = 0;
+    uint16_t prod, seen = rdata_prod_seen, moved, occ;
+
+    prod = ARRAY_SIZE(dma_r.buf) - dma_rdata.cndtr;
+    flags = dma1->isr & (DMA_ISR_HTIF(dma_rdata_ch) |
+                         DMA_ISR_TCIF(dma_rdata_ch));
+    /* Points passed after the flags were sampled are flagged next time, as
+     * only the flags sampled are cleared. IFCR's clear bits sit at the
+     * positions of the ISR flags they clear. */
+    moved = (ARRAY_SIZE(dma_r.buf) - dma_rdata.cndtr - seen) & buf_mask;
+    if (((ARRAY_SIZE(dma_r.buf)/2 - seen - 1) & buf_mask) < moved)
+        passed |= DMA_ISR_HTIF(dma_rdata_ch);
+    if (((0 - seen - 1) & buf_mask) < moved)
+        passed |= DMA_ISR_TCIF(dma_rdata_ch);
+    if (flags) {
+        dma1->ifcr = flags;
+        if (unlikely(flags & ~passed))
+            dma_stats.rdata_overruns++;
+    }
+    rdata_prod_seen = prod;
+
+    occ = (prod - dma_r.cons) & buf_mask;
+    dma_stats.rdata_hwm = max(dma_stats.rdata_hwm, occ);
+
+    return prod;
+}
+
+/* The first long flux seen by an asynchronous read. printk() needs more
+ * than the IRQ stack, so it is reported later, from thread context. */
+static struct {
+    uint32_t bc_prod;
+    uint16_t cons, next, prev, cell;
+    bool_t seen;
+} long_flux;
+
+static void long_flux_report(void)
+{
+    if (!long_flux.seen)
+        return;
+    printk("Long flux @ dma=%u bc=%u: %u-%u=%u / %u\n",
+           long_flux.cons, long_flux.bc_prod, long_flux.next, long_flux.prev,
+           (uint16_t)(long_flux.next - long_flux.prev), long_flux.cell);
+    WARN_ON(TRUE);
+    long_flux.seen = FALSE;
+}
+
+static void noinline rdata_long_flux(
+    uint16_t cons, uint32_t bc_prod, uint16_t next, uint16_t prev,
+    uint16_t cell)
+{
+    if (long_flux.seen)
+        return;
+    long_flux.cons = cons;
+    long_flux.bc_prod = bc_prod;
+    long_flux.next = next;
+    long_flux.prev = prev;
+    long_flux.cell = cell;
+    long_flux.seen = TRUE;
+    if (!in_exception())
+        long_flux_report();
+}
+
+/* When the flux sample @prev, preceding ring slot @cons, was captured. The
+ * flux is dated by its place in the ring rather than by when it is decoded,
+ * which for an asynchronous read can be half a ring later. The 16-bit
+ * capture timer can wrap within that, so intervals are summed in 32 bits. */
+static time_t rdata_flux_time(uint16_t cons, uint16_t prev)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma_r.buf) - 1;
+    uint16_t prod, next;
+    uint32_t ticks = 0;
+    time_t now;
+
+    prod = (ARRAY_SIZE(dma_r.buf) - dma_rdata.cndtr) & buf_mask;
+    now = time_now();
+    for (; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma_r.buf[cons];
+        ticks += (uint16_t)(next - prev);
+        prev = next;
+    }
+    ticks += (uint16_t)(tim_rdata->cnt - prev);
+
+    return now - sysclk_time(ticks);
+}
+
+static struct flux_hist *flux_hist;
+
+void floppy_set_flux_hist(struct flux_hist *hist)
+{
+    flux_hist = hist;
+    if (hist == NULL)
+        return;
+    memset(hist->bin, 0, sizeof(hist->bin));
+    hist->shift = 31 - __builtin_clz(cur_drive->ticks_per_cell) - 3;
+}
+
+/* The window is matched only on a flux reversal, so always ends in a 1. Marks
+ * ending in 0s are shifted right to end on their final 1. The FM clock marks
+ * are similarly shifted by the final data bit, which is unknown. */
+const struct sync_pattern sync_mfm_a1 = { 0xffffffff, 0x44894489, 32 };
+const struct sync_pattern sync_mfm_c2 = { 0x3fffffff, 0x14891489, 30 };
+const struct sync_pattern sync_fm_c7 = { 0xffffd555, 0x55555015, 31 };
+const struct sync_pattern sync_fm_d7 = { 0xffffd555, 0x55555115, 31 };
+
 static bool_t rdata_wait_sync(struct read *rd)
 {
     const uint16_t buf_mask = ARRAY_SIZE(dma_r.buf) - 1;
     uint16_t cons, prod, prev = dma_r.prev_sample, curr, next;
-    uint16_t cell = cur_drive->ticks_per_cell;
+    uint16_t cell = cur_drive->ticks_per_cell, bias = cell - (cell >> 1);
     uint32_t bc_dat = rd->bc_window, bc_prod = rd->bc_prod;
-    unsigned int sync = rd->sync, sync_found = 0, nr;
+    uint32_t cell_recip = rd->cell_recip;
+    unsigned int sync = rd->sync, sync_found = 0, nr, i;
+    const struct sync_pattern *pat = rd->sync_pats;
     uint32_t *bc_buf = rd->p;
+    struct flux_hist *hist = rd->hist;
 
     /* Find out where the DMA engine's producer index has got to. */
-    prod = ARRAY_SIZE(dma_r.buf) - dma_rdata.cndtr;
+    prod = rdata_prod();
 
     /* Process the flux timings into the raw bitcell buffer. */
     cons = dma_r.cons;
@@ -47,15 +166,17 @@ static bool_t rdata_wait_sync(struct read *rd)
         cons = (cons+1) & buf_mask;
         curr = next - prev;
 #ifndef QUICKDISK /* This happens in ibm_mfm_{scan,search} for example. */
-        if (unlikely(curr > (6*cell))) {
-            printk("Long flux @ dma=%u bc=%u: %u-%u=%u / %u\n",
-                   cons, bc_prod, next, prev, curr, cell);
-            WARN_ON(TRUE);
-        }
+        if (unlikely(curr > (6*cell)))
+            rdata_long_flux(cons, bc_prod, next, prev, cell);
 #endif
         prev = next;
+        if (unlikely(hist != NULL))
+            hist->bin[min_t(unsigned int, curr >> hist->shift, 63)]++;
 
-        nr = (curr - (cell>>1)) / cell + 1;
+        /* nr = (curr - (cell>>1)) / cell + 1, with a multiply-high in place
+         * of the divide. Intervals under half a cell still count as one. */
+        nr = ((uint64_t)(uint32_t)(curr + bias) * cell_recip) >> 32;
+        nr += !nr;
         bc_dat = (bc_dat << nr) | 1;
         bc_prod += nr;
 
@@ -66,11 +187,21 @@ static bool_t rdata_wait_sync(struct read *rd)
                 sync_found = 31;
                 break;
             }
-        } else { /* sync == SYNC_mfm */
+        } else if (likely(sync == SYNC_mfm)) {
             if (unlikely(bc_dat == 0x44894489)) {
                 sync_found = 32;
                 break;
             }
+        } else { /* sync == SYNC_pattern */
+            for (i = 0; i < rd->nr_sync_pats; i++) {
+                if (unlikely((bc_dat & pat[i].mask) == pat[i].value)) {
+                    sync_found = pat[i].nr_bits;
+                    rd->sync_hit = i;
+                    break;
+                }
+            }
+            if (sync_found)
+                break;
         }
 
     }
@@ -82,7 +213,7 @@ static bool_t rdata_wait_sync(struct read *rd)
     dma_r.prev_sample = prev;
 
     if (unlikely(sync_found != 0)) {
-        time_t now = time_now();
+        time_t now = rdata_flux_time(cons, prev);
         cell = ((now - rd->start) << 4) / bc_prod;
         rd->start = now - ((sync_found * cell) >> 4);
         rd->bc_prod = sync_found;
@@ -102,20 +233,20 @@ static bool_t rdata_flux_to_bc(struct read *rd)
     uint32_t bc_dat = rd->bc_window, bc_prod = rd->bc_prod;
     uint32_t bc_max = rd->nr_words * 16;
     uint32_t *bc_buf = rd->p;
+    struct flux_hist *hist = rd->hist;
 
     /* Find out where the DMA engine's producer index has got to. */
-    prod = ARRAY_SIZE(dma_r.buf) - dma_rdata.cndtr;
+    prod = rdata_prod();
 
     /* Process the flux timings into the raw bitcell buffer. */
     for (cons = dma_r.cons; cons != prod; cons = (cons+1) & buf_mask) {
         next = dma_r.buf[cons];
         curr = next - prev;
-        if (curr > (6*cell)) {
-            printk("Long flux @ dma=%u bc=%u: %u-%u=%u / %u\n",
-                   cons, bc_prod, next, prev, curr, cell);
-            WARN_ON(TRUE);
-        }
+        if (curr > (6*cell))
+            rdata_long_flux(cons, bc_prod, next, prev, cell);
         prev = next;
+        if (unlikely(hist != NULL))
+            hist->bin[min_t(unsigned int, curr >> hist->shift, 63)]++;
         while (curr > window) {
             curr -= cell;
             bc_dat <<= 1;
@@ -141,17 +272,262 @@ static bool_t rdata_flux_to_bc(struct read *rd)
     return FALSE;
 }
 
+/* Flux-to-bitcell lookup table, indexed by flux interval >> shift. Each
+ * bucket spans at most one bitcell period, so it holds the bitcell count at
+ * its low end, plus the interval above which the count is one more. */
+static struct rdata_tab {
+    uint16_t shift, lim;
+    struct {
+        uint16_t thresh;
+        uint16_t nr;
+    } ent[16];
+} rdata_tab;
+
+static void rdata_tab_init(void)
+{
+    struct rdata_tab *tab = &rdata_tab;
+    uint16_t cell = cur_drive->ticks_per_cell;
+    uint16_t window = cell + (cell >> 1);
+    unsigned int i, lo, nr;
+
+    tab->shift = 31 - __builtin_clz(cell);
+    tab->lim = ARRAY_SIZE(tab->ent) << tab->shift;
+
+    /* Match rdata_flux_to_bc(): one bitcell up to @window, then one more
+     * for each whole or partial @cell beyond it. */
+    for (i = 0; i < ARRAY_SIZE(tab->ent); i++) {
+        lo = i << tab->shift;
+        nr = (lo > window) ? (lo - window + cell - 1) / cell + 1 : 1;
+        tab->ent[i].nr = nr;
+        tab->ent[i].thresh = window + (nr - 1) * cell;
+    }
+}
+
+/* Bit-exact equivalent of rdata_flux_to_bc(), emitting each flux interval's
+ * whole run of bitcells at once. */
+static bool_t rdata_flux_to_bc_table(struct read *rd)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma_r.buf) - 1;
+    const struct rdata_tab *tab = &rdata_tab;
+    uint16_t cons, prod, prev = dma_r.prev_sample, curr, next;
+    uint16_t cell = cur_drive->ticks_per_cell;
+    uint32_t bc_dat = rd->bc_window, bc_prod = rd->bc_prod;
+    uint32_t bc_max = rd->nr_words * 16;
+    uint32_t *bc_buf = rd->p;
+    struct flux_hist *hist = rd->hist;
+    unsigned int i, nr, room;
+
+    /* Find out where the DMA engine's producer index has got to. */
+    prod = rdata_prod();
+
+    /* Process the flux timings into the raw bitcell buffer. */
+    for (cons = dma_r.cons; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma_r.buf[cons];
+        curr = next - prev;
+        if (curr > (6*cell))
+            rdata_long_flux(cons, bc_prod, next, prev, cell);
+        prev = next;
+        if (unlikely(hist != NULL))
+            hist->bin[min_t(unsigned int, curr >> hist->shift, 63)]++;
+        /* Beyond the table: emit leading zeroes until back in range. */
+        while (unlikely(curr >= tab->lim)) {
+            curr -= cell;
+            bc_dat <<= 1;
+            if (!(++bc_prod&31)) {
+                bc_buf[(bc_prod-1) / 32] = htobe32(bc_dat);
+                if (bc_prod == bc_max)
+                    return TRUE;
+            }
+        }
+        i = curr >> tab->shift;
+        nr = tab->ent[i].nr + (curr > tab->ent[i].thresh);
+        room = 32 - (bc_prod & 31);
+        if (unlikely(nr >= room)) {
+            /* This run completes the current word. */
+            bc_buf[bc_prod / 32] = htobe32((bc_dat << room) | (nr == room));
+            if ((bc_prod + room) == bc_max)
+                return TRUE;
+        }
+        bc_dat = (bc_dat << nr) | 1;
+        bc_prod += nr;
+    }
+
+    /* Save our progress for next time. */
+    rd->bc_window = bc_dat;
+    rd->bc_prod = bc_prod;
+    dma_r.cons = cons;
+    dma_r.prev_sample = prev;
+    return FALSE;
+}
+
+/* PLL data separator. The bitcell clock is tracked in SYSCLK ticks * 16.
+ * Each flux reversal is assigned to the nearest clock edge; its offset from
+ * that edge (the phase error) then nudges both the clock period and, more
+ * strongly, the phase of the next edge. The period is confined to within
+ * 1/8 of nominal so that a noisy stretch cannot run the clock away. */
+static bool_t rdata_flux_to_bc_pll(struct read *rd)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma_r.buf) - 1;
+    uint16_t cons, prod, prev = dma_r.prev_sample, curr, next;
+    uint16_t cell = cur_drive->ticks_per_cell;
+    int32_t period = rd->pll_period, phase = rd->pll_phase, err;
+    int32_t period_min = (cell << 4) - (cell << 1);
+    int32_t period_max = (cell << 4) + (cell << 1);
+    uint32_t peak_err = rd->pll_peak_err, abs_err;
+    uint32_t bc_dat = rd->bc_window, bc_prod = rd->bc_prod;
+    uint32_t bc_max = rd->nr_words * 16;
+    uint32_t *bc_buf = rd->p;
+    struct flux_hist *hist = rd->hist;
+    unsigned int nr, room;
+    bool_t done = FALSE;
+
+    /* Find out where the DMA engine's producer index has got to. */
+    prod = rdata_prod();
+
+    /* Process the flux timings into the raw bitcell buffer. */
+    for (cons = dma_r.cons; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma_r.buf[cons];
+        curr = next - prev;
+        if (curr > (6*cell))
+            rdata_long_flux(cons, bc_prod, next, prev, cell);
+        prev = next;
+        if (unlikely(hist != NULL))
+            hist->bin[min_t(unsigned int, curr >> hist->shift, 63)]++;
+
+        /* Count clock edges up to the one nearest this flux. A reversal
+         * within half a period of the previous edge is noise: skip it. */
+        phase += curr << 4;
+        for (nr = 0; phase >= (period >> 1); nr++)
+            phase -= period;
+        if (unlikely(nr == 0))
+            continue;
+
+        /* Phase error is the flux's offset from its clock edge. Only
+         * short runs steer the period: long ones give a noisy estimate. */
+        err = phase;
+        abs_err = (err < 0) ? -err : err;
+        peak_err = max(peak_err, abs_err);
+        if (nr <= 4) {
+            period += err / 16;
+            period = max_t(int32_t, period_min,
+                           min_t(int32_t, period_max, period));
+        }
+        phase = (err * 3) / 8;
+
+        /* Emit nr-1 zeroes then a one. Overlong runs fill in a bit at a 
+         * time until what remains fits in a single word. */
+        while (unlikely(nr > 16)) {
+            nr--;
+            bc_dat <<= 1;
+            if (!(++bc_prod&31)) {
+                bc_buf[(bc_prod-1) / 32] = htobe32(bc_dat);
+                if (bc_prod == bc_max) {
+                    done = TRUE;
+                    goto out;
+                }
+            }
+        }
+        room = 32 - (bc_prod & 31);
+        if (unlikely(nr >= room)) {
+            /* This run completes the current word. */
+            bc_buf[bc_prod / 32] = htobe32((bc_dat << room) | (nr == room));
+            if ((bc_prod + room) == bc_max) {
+                done = TRUE;
+                goto out;
+            }
+        }
+        bc_dat = (bc_dat << nr) | 1;
+        bc_prod += nr;
+    }
+
+    /* Save our progress for next time. */
+    rd->bc_window = bc_dat;
+    rd->bc_prod = bc_prod;
+    dma_r.cons = cons;
+    dma_r.prev_sample = prev;
+out:
+    rd->pll_period = period;
+    rd->pll_phase = phase;
+    rd->pll_peak_err = peak_err;
+    return done;
+}
+
+/* Store flux intervals undecoded, three bytes at most apiece. Typical flux
+ * is within a few ticks of a whole number of cells, and takes one byte. */
+static bool_t rdata_flux_to_raw(struct read *rd)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma_r.buf) - 1;
+    uint16_t cons, prod, prev = dma_r.prev_sample, curr, next;
+    uint16_t cell = cur_drive->ticks_per_cell, bias = cell >> 1;
+    uint32_t cell_recip = rd->cell_recip, v, k;
+    uint8_t *p = (uint8_t *)rd->p + rd->raw_bytes;
+    uint8_t *end = (uint8_t *)rd->p + rd->nr_words * 2 - 3;
+    struct flux_hist *hist = rd->hist;
+    unsigned int nr = 0;
+    int32_t r;
+
+    /* Find out where the DMA engine's producer index has got to. */
+    prod = rdata_prod();
+
+    for (cons = dma_r.cons; (cons != prod) && (p <= end);
+         cons = (cons+1) & buf_mask) {
+        next = dma_r.buf[cons];
+        curr = next - prev;
+        prev = next;
+        if (unlikely(hist != NULL))
+            hist->bin[min_t(unsigned int, curr >> hist->shift, 63)]++;
+        /* Nearest whole number of cells, and the (zigzagged) residual. */
+        k = ((uint64_t)(uint32_t)(curr + bias) * cell_recip) >> 32;
+        if (likely((k - 1) < 7)) {
+            r = (int32_t)curr - (int32_t)(k * cell);
+            v = ((((uint32_t)r << 1) ^ (uint32_t)(r >> 31)) << 3) | k;
+        } else {
+            v = (uint32_t)curr << 3;
+        }
+        while (v >= 0x80) {
+            *p++ = v | 0x80;
+            v >>= 7;
+        }
+        *p++ = v;
+        nr++;
+    }
+
+    /* Save our progress for next time. */
+    rd->raw_flux += nr;
+    rd->raw_bytes = p - (uint8_t *)rd->p;
+    dma_r.cons = cons;
+    dma_r.prev_sample = prev;
+    return p > end;
+}
+
 void floppy_read_prep(struct read *rd)
 {
     /* Check buffer alignment. */
-    ASSERT(((uint32_t)rd->p & 3) == 0);
+    ASSERT(((unsigned long)rd->p & 3) == 0);
     ASSERT((rd->nr_words & 1) == 0);
 
     /* ~0 avoids sync match within fewer than 32 bits of scan start. */
     rd->bc_window = ~0;
     rd->bc_prod = 0;
+    rd->sync_hit = 0;
 
-    /* Start DMA. */
+    /* 2^32 / cell, rounded up: exact quotients for all 16-bit intervals.
+     * Computed as (2^32-1)/cell + 1 to keep to a 32-bit divide. */
+    rd->cell_recip = 0xffffffffu / cur_drive->ticks_per_cell + 1;
+
+    if (rd->decode == DECODE_table)
+        rdata_tab_init();
+
+    /* PLL starts on the nominal clock, in phase with the first flux. */
+    rd->pll_period = cur_drive->ticks_per_cell << 4;
+    rd->pll_phase = 0;
+    rd->pll_peak_err = 0;
+
+    rd->raw_flux = rd->raw_bytes = 0;
+    rd->hist = flux_hist;
+
+    /* Start DMA. Half/full-transfer events are always flagged, but raise
+     * an IRQ only while an asynchronous read has the IRQ unmasked. */
     dma_rdata.cndtr = ARRAY_SIZE(dma_r.buf);
     dma_rdata.ccr = (DMA_CCR_PL_HIGH |
                      DMA_CCR_MSIZE_16BIT |
@@ -159,14 +535,32 @@ void floppy_read_prep(struct read *rd)
                      DMA_CCR_MINC |
                      DMA_CCR_CIRC |
                      DMA_CCR_DIR_P2M |
+                     DMA_CCR_HTIE |
+                     DMA_CCR_TCIE |
                      DMA_CCR_EN);
 
     /* DMA soft state. */
     dma_r.cons = 0;
     dma_r.prev_sample = tim_rdata->cnt;
+    rdata_prod_seen = 0;
+    dma1->ifcr = DMA_IFCR_CGIF(dma_rdata_ch);
 }
 
-void floppy_read(struct read *rd)
+static bool_t (*rdata_decoder(struct read *rd))(struct read *)
+{
+    switch (rd->decode) {
+    case DECODE_table:
+        return rdata_flux_to_bc_table;
+    case DECODE_pll:
+        return rdata_flux_to_bc_pll;
+    case DECODE_raw:
+        return rdata_flux_to_raw;
+    default:
+        return rdata_flux_to_bc;
+    }
+}
+
+static void rdata_start(void)
 {
     /* Wait for RDATA active. */
     exti->pr = m(pin_rdata);
@@ -180,6 +574,24 @@ void floppy_read(struct read *rd)
     tim_rdata->ccer = TIM_CCER_CC1E | TIM_CCER_CC1P; /* negative pulses */
 #endif
     tim_rdata->cr1 = TIM_CR1_CEN;
+}
+
+static void rdata_stop(void)
+{
+    /* Turn off timer. */
+    tim_rdata->ccer = 0;
+    tim_rdata->cr1 = 0;
+    tim_rdata->sr = 0; /* dummy, drains any pending DMA */
+
+    /* Turn off DMA. */
+    dma_rdata.ccr = 0;
+}
+
+void floppy_read(struct read *rd)
+{
+    bool_t (*flux_to_bc)(struct read *) = rdata_decoder(rd);
+
+    rdata_start();
 
     rd->start = time_now();
 
@@ -188,18 +600,126 @@ void floppy_read(struct read *rd)
             continue;
     }
 
-    while (!rdata_flux_to_bc(rd))
+    while (!(*flux_to_bc)(rd))
         continue;
 
-    rd->end = time_now();
+    rd->end = rdata_flux_time(dma_r.cons, dma_r.prev_sample);
 
-    /* Turn off timer. */
+    rdata_stop();
+}
+
+/* Asynchronous read in progress. */
+static struct {
+    struct read *volatile rd;
+    void (*done)(struct read *);
+    bool_t (*flux_to_bc)(struct read *);
+    bool_t wait_sync;
+} rdata_async;
+
+void floppy_read_async(struct read *rd, void (*done)(struct read *))
+{
+    ASSERT(rdata_async.rd == NULL);
+
+    rdata_async.done = done;
+    rdata_async.flux_to_bc = rdata_decoder(rd);
+    rdata_async.wait_sync = (rd->sync != SYNC_none);
+    rdata_async.rd = rd;
+
+    /* Discard events flagged before now, then unmask the IRQ. */
+    dma1->ifcr = DMA_IFCR_CGIF(dma_rdata_ch);
+    IRQx_clear_pending(dma_rdata_irq);
+    IRQx_enable(dma_rdata_irq);
+
+    rdata_start();
+
+    rd->start = time_now();
+}
+
+bool_t floppy_read_async_done(void)
+{
+    if (rdata_async.rd != NULL)
+        return FALSE;
+    long_flux_report();
+    return TRUE;
+}
+
+void floppy_read_async_wait(void)
+{
+    while (rdata_async.rd != NULL)
+        cpu_relax();
+    long_flux_report();
+}
+
+uint32_t floppy_read_bench(struct read *rd, unsigned int *p_nr_flux)
+{
+    bool_t (*flux_to_bc)(struct read *) = rdata_decoder(rd);
+    time_t t;
+    bool_t done;
+
+    if (rd->sync != SYNC_none)
+        flux_to_bc = rdata_wait_sync;
+
+    floppy_read_prep(rd);
+    rdata_start();
+
+    /* Let the DMA ring (nearly) fill, then freeze it by stopping the timer. 
+     * The margin allows for flux arriving before the timer is stopped. */
+    while (dma_rdata.cndtr > 64)
+        continue;
     tim_rdata->ccer = 0;
     tim_rdata->cr1 = 0;
-    tim_rdata->sr = 0; /* dummy, drains any pending DMA */
 
-    /* Turn off DMA. */
-    dma_rdata.ccr = 0;
+    /* Decode the whole ring in one go. */
+    IRQ_global_disable();
+    t = time_now();
+    done = (*flux_to_bc)(rd);
+    t = time_diff(t, time_now());
+    IRQ_global_enable();
+
+    /* The bitcell buffer must have room for the whole ring. A sync hunt may
+     * stop early, but still records how far it got. */
+    WARN_ON(done && (rd->sync == SYNC_none));
+    *p_nr_flux = dma_r.cons;
+
+    rdata_stop();
+
+    return sysclk_time(t);
+}
+
+/* DMA half/full transfer: drain the flux ring on behalf of an asynchronous 
+ * read. At least half a ring of flux is always waiting, so the only cost
+ * relative to a polled read is that completion is noticed late. Times are
+ * taken from the DMA position, and nothing here may printk(): the IRQ stack
+ * is only 512 bytes. */
+static void IRQ_rdata_dma(void)
+{
+    struct read *rd = rdata_async.rd;
+    void (*done)(struct read *);
+
+    /* The decoder acknowledges the DMA flags when it checks for overrun. */
+    if (rd == NULL) {
+        dma1->ifcr = DMA_IFCR_CGIF(dma_rdata_ch);
+        return;
+    }
+
+    if (rdata_async.wait_sync) {
+        if (!rdata_wait_sync(rd))
+            return;
+        rdata_async.wait_sync = FALSE;
+    }
+
+    if (!(*rdata_async.flux_to_bc)(rd))
+        return;
+
+    rd->end = rdata_flux_time(dma_r.cons, dma_r.prev_sample);
+
+    IRQx_disable(dma_rdata_irq);
+    rdata_stop();
+
+    done = rdata_async.done;
+    rdata_async.rd = NULL;
+    if (done != NULL)
+        (*done)(rd);
 }
 
 
@@ -207,34 +727,62 @@ void floppy_read(struct read *rd)
  * WRITE PATH
  */
 
+/* The generator has been consumed: have it refill its buffer. */
+static void wdata_gen(struct write *wr)
+{
+    unsigned int nr = min(wr->gen_words, wr->nr_words - wr->bc_gen / 16);
+
+    (*wr->gen)(wr, (void *)wr->p, nr);
+    wr->bc_base = wr->bc_gen;
+    wr->bc_gen += nr * 16;
+}
+
+/* Data-rate skew of writes, in parts per million of bitcell length, and the
+ * resulting bitcell length (SYSCLK*16) for the current write. */
+static int wdata_skew;
+static uint32_t wdata_cell;
+
+void floppy_set_write_skew(int ppm)
+{
+    /* Keeps cell*16*ppm within 32 bits for cells up to 4us. */
+    ASSERT((ppm >= -400000) && (ppm <= 400000));
+    wdata_skew = ppm;
+}
+
 static uint16_t _wdata_bc_to_flux(
     struct write *wr, uint16_t *tbuf, uint16_t nr)
 {
-    uint32_t ticks_per_cell = cur_drive->ticks_per_cell << 4;
+    uint32_t ticks_per_cell = wdata_cell;
     uint32_t ticks = wr->ticks_since_flux;
-    uint32_t x, y = 32, todo = nr;
+    uint32_t x, y = 32, n, todo = nr;
     const uint32_t *bc_b = wr->p;
     uint32_t bc_c = wr->bc_cons, bc_p = wr->nr_words * 16;
 
     if (todo == 0)
         return 0;
 
-    /* Convert pre-generated bitcells into flux timings. */
+    /* Convert pre-generated bitcells into flux timings. Each flux interval
+     * is found in one step: the run of cells up to and including the next
+     * 1 in the word. */
     while (bc_c != bc_p) {
+        if (unlikely(bc_c == wr->bc_gen))
+            wdata_gen(wr);
         y = bc_c % 32;
-        x = be32toh(bc_b[bc_c / 32]) << y;
+        x = be32toh(bc_b[(bc_c - wr->bc_base) / 32]) << y;
         bc_c += 32 - y;
-        while (y < 32) {
-            y++;
-            ticks += ticks_per_cell;
-            if ((int32_t)x < 0) {
-                *tbuf++ = (ticks >> 4) - 1;
-                ticks &= 15;
-                if (!--todo)
-                    goto out;
-            }
-            x <<= 1;
+        while (x != 0) {
+            n = __builtin_clz(x) + 1;
+            y += n;
+            ticks += n * ticks_per_cell;
+            *tbuf++ = (ticks >> 4) - 1;
+            ticks &= 15;
+            x = (x << (n - 1)) << 1; /* n may be 32 */
+            if (!--todo)
+                goto out;
         }
+        /* Trailing zeroes carry into the next word. */
+        ticks += (32 - y) * ticks_per_cell;
+        y = 32;
     }
 
     ASSERT(y == 32);
@@ -246,6 +794,205 @@ out:
     return nr - todo;
 }
 
+/* Does the current write shift its flux reversals (precomp or jitter)? */
+static bool_t wdata_shaped;
+
+static struct {
+    const struct precomp_band *band;
+    unsigned int nr;
+} precomp;
+
+/* Shifts (SYSCLK*16) for the current write, or NULL for no precomp. */
+static int16_t precomp_tab[3][3];
+static const int16_t (*precomp_active)[3];
+
+void floppy_set_precomp(const struct precomp_band *band, unsigned int nr)
+{
+    precomp.band = band;
+    precomp.nr = nr;
+}
+
+/* Precomp class of an interval of @ticks, a whole number of bitcells:
+ * 2 (or fewer), 3, or 4+ bitcells. */
+static inline unsigned int precomp_class(uint32_t ticks, uint32_t per_cell)
+{
+    return (ticks <= 2*per_cell) ? 0 : (ticks <= 3*per_cell) ? 1 : 2;
+}
+
+static void precomp_prep(void)
+{
+    const struct precomp_band *band = NULL;
+    unsigned int i, j;
+
+    for (i = 0; i < precomp.nr; i++)
+        if (precomp.band[i].cyl <= cur_drive->cyl)
+            band = &precomp.band[i];
+
+    precomp_active = NULL;
+    if (band == NULL)
+        return;
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++)
+            precomp_tab[i][j] = (band->ns[i][j] * (SYSCLK_MHZ * 16)) / 1000;
+    precomp_active = precomp_tab;
+}
+
+static struct {
+    struct jitter cfg;
+    /* Wow phase advance per SYSCLK*16, where 2^32 is one whole period. */
+    uint32_t step;
+    /* For the current write: PRNG state, peak shift (SYSCLK*16), and wow
+     * phase. */
+    uint32_t seed;
+    int32_t amp;
+    uint32_t phase;
+} jitter;
+
+void floppy_set_jitter(const struct jitter *cfg)
+{
+    uint32_t period;
+
+    if (cfg == NULL) {
+        jitter.cfg.mode = JITTER_none;
+        return;
+    }
+
+    jitter.cfg = *cfg;
+    period = max_t(uint32_t, cfg->period_us, 1) * (SYSCLK_MHZ * 16);
+    jitter.step = 0xffffffffu / period + 1;
+}
+
+static void jitter_prep(void)
+{
+    /* Capped at 3/4 cell. Adjacent shifts, plus precomp, may still differ by
+     * more than an interval: intervals are clamped as they are emitted. */
+    jitter.amp = min_t(int32_t, (jitter.cfg.ns * (SYSCLK_MHZ * 16)) / 1000,
+                       wdata_cell * 3 / 4);
+    jitter.seed = jitter.cfg.seed ?: 1;
+    jitter.phase = 0;
+}
+
+static uint32_t jitter_rand(void)
+{
+    jitter.seed ^= jitter.seed << 13;
+    jitter.seed ^= jitter.seed >> 17;
+    jitter.seed ^= jitter.seed << 5;
+    return jitter.seed;
+}
+
+/* Jitter (SYSCLK*16) of a reversal, which ends an interval of @ticks. */
+static int32_t jitter_shift(uint32_t ticks)
+{
+    uint32_t range = 2 * jitter.amp + 1, u;
+    int32_t x;
+    int i;
+
+    switch (jitter.cfg.mode) {
+    case JITTER_none:
+        break;
+    case JITTER_uniform:
+        return (int32_t)(jitter_rand() % range) - jitter.amp;
+    case JITTER_gaussian:
+        /* Irwin-Hall: the mean of four uniforms is near enough normal. */
+        for (i = x = 0; i < 4; i++)
+            x += jitter_rand() % range;
+        return x / 4 - jitter.amp;
+    case JITTER_wow:
+        /* Triangle wave, in time along the track. The phase wraps with
+         * the period, and folds at half way to a ramp in [0,2^31). */
+        jitter.phase += ticks * jitter.step;
+        u = (int32_t)jitter.phase < 0 ? ~jitter.phase : jitter.phase;
+        return (int32_t)(((u >> 15) * range) >> 16) - jitter.amp;
+    }
+
+    return 0;
+}
+
+/* Shift (SYSCLK*16) of a reversal: precomp by the classes of the intervals
+ * before and after it, plus jitter. @ticks is the interval ending at it. */
+static int32_t wdata_shift(
+    unsigned int before, unsigned int after, uint32_t ticks)
+{
+    int32_t shift = jitter_shift(ticks);
+    if (precomp_active)
+        shift += precomp_active[before][after];
+    return shift;
+}
+
+/* As _wdata_bc_to_flux(), with each reversal shifted by precomp and jitter.
+ * Precomp depends on the interval after a reversal, so each reversal is
+ * emitted only when the next is found, or at the end of the write. No
+ * interval is emitted shorter than half a cell: a reversal shifted too far
+ * back is placed there instead, and the next interval follows from it. */
+static uint16_t _wdata_bc_to_flux_shaped(
+    struct write *wr, uint16_t *tbuf, uint16_t nr)
+{
+    uint32_t ticks_per_cell = wdata_cell;
+    uint32_t ticks = wr->ticks_since_flux, pend = wr->pc_pend, e;
+    uint32_t x, y = 32, n, todo = nr;
+    int32_t e_min = ticks_per_cell / 2;
+    unsigned int pclass = wr->pc_class;
+    int32_t shift, prev_shift = wr->pc_shift;
+    const uint32_t *bc_b = wr->p;
+    uint32_t bc_c = wr->bc_cons, bc_p = wr->nr_words * 16;
+
+    if (todo == 0)
+        return 0;
+
+    while (bc_c != bc_p) {
+        if (unlikely(bc_c == wr->bc_gen))
+            wdata_gen(wr);
+        y = bc_c % 32;
+        x = be32toh(bc_b[(bc_c - wr->bc_base) / 32]) << y;
+        bc_c += 32 - y;
+        while (x != 0) {
+            n = __builtin_clz(x) + 1;
+            y += n;
+            ticks += n * ticks_per_cell;
+            x = (x << (n - 1)) << 1; /* n may be 32 */
+            e = 0;
+            if (pend != 0) {
+                shift = wdata_shift(
+                    pclass, precomp_class(ticks, ticks_per_cell), pend);
+                e = pend + shift - prev_shift;
+                if ((int32_t)e < e_min) {
+                    e = e_min;
+                    shift = e - pend + prev_shift;
+                }
+                *tbuf++ = (e >> 4) - 1;
+                prev_shift = shift;
+                todo--;
+            }
+            pend = ticks + (e & 15);
+            pclass = precomp_class(ticks, ticks_per_cell);
+            ticks = 0;
+            if (!todo)
+                goto out;
+        }
+        ticks += (32 - y) * ticks_per_cell;
+        y = 32;
+    }
+
+    /* End of the write: the final reversal is unshifted. */
+    if (pend != 0) {
+        e = max_t(int32_t, pend - prev_shift, e_min);
+        *tbuf++ = (e >> 4) - 1;
+        ticks += e & 15;
+        pend = prev_shift = 0;
+        todo--;
+    }
+
+out:
+    wr->bc_cons = bc_c - (32 - y);
+    wr->ticks_since_flux = ticks;
+    wr->pc_pend = pend;
+    wr->pc_class = pclass;
+    wr->pc_shift = prev_shift;
+
+    return nr - todo;
+}
+
 static void wdata_bc_to_flux(struct write *wr, bool_t latency_sensitive)
 {
     const uint16_t buf_mask = ARRAY_SIZE(dma_w.buf) - 1;
@@ -264,18 +1011,44 @@ static void wdata_bc_to_flux(struct write *wr, bool_t latency_sensitive)
 
     /* Now attempt to fill the contiguous stretch with flux data calculated 
      * from buffered bitcell data. */
-    dma_w.prod += _wdata_bc_to_flux(wr, &dma_w.buf[dma_w.prod], nr);
+    dma_w.prod += (wdata_shaped ? _wdata_bc_to_flux_shaped
+                   : _wdata_bc_to_flux)(wr, &dma_w.buf[dma_w.prod], nr);
     dma_w.prod &= buf_mask;
 }
 
+/* Soft state at the start of a write. */
+static void wdata_reset(struct write *wr)
+{
+    int skew;
+
+    wr->ticks_since_flux = 0;
+    wr->bc_cons = 0;
+    wr->bc_base = 0;
+    if (wr->gen) {
+        ASSERT((wr->gen_words & 1) == 0);
+        wr->bc_gen = 0;
+    } else {
+        wr->bc_gen = wr->nr_words * 16;
+    }
+    wr->pc_pend = 0;
+    wr->pc_class = 0;
+    wr->pc_shift = 0;
+    /* cell * (10^6 + skew) / 10^6, rounded down, in 32-bit arithmetic. */
+    wdata_cell = cur_drive->ticks_per_cell << 4;
+    skew = (int)wdata_cell * wdata_skew;
+    wdata_cell += (skew >= 0) ? skew / 1000000 : -((999999 - skew) / 1000000);
+    jitter_prep();
+    precomp_prep();
+    wdata_shaped = (precomp_active || (jitter.cfg.mode != JITTER_none));
+}
+
 static void _floppy_write_prep(struct write *wr, bool_t latency_sensitive)
 {
     /* Check buffer alignment. */
-    ASSERT(((uint32_t)wr->p & 3) == 0);
+    ASSERT(((unsigned long)wr->p & 3) == 0);
     ASSERT((wr->nr_words & 1) == 0);
 
-    wr->ticks_since_flux = 0;
-    wr->bc_cons = 0;
+    wdata_reset(wr);
 
     /* Initialise DMA ring indexes (consumer index is implicit). */
     dma_wdata.cndtr = ARRAY_SIZE(dma_w.buf);
@@ -305,11 +1078,62 @@ void floppy_write_now(struct write *wr)
     floppy_write(wr);
 }
 
+uint32_t floppy_write_bench(struct write *wr, unsigned int *p_nr_flux)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma_w.buf) - 1;
+    unsigned int nr_flux = 0;
+    uint16_t nr;
+    time_t t;
+
+    /* As _floppy_write_prep(), but the DMA channel is left disabled. */
+    wdata_reset(wr);
+    dma_w.prod = 0;
+
+    /* Refill the ring, 32 flux at a time as a latency-sensitive refill
+     * would, until the bitcells are all consumed. */
+    IRQ_global_disable();
+    t = time_now();
+    do {
+        nr = (wdata_shaped ? _wdata_bc_to_flux_shaped
+              : _wdata_bc_to_flux)(wr, &dma_w.buf[dma_w.prod], 32);
+        dma_w.prod = (dma_w.prod + nr) & buf_mask;
+        nr_flux += nr;
+    } while (nr == 32);
+    t = time_diff(t, time_now());
+    IRQ_global_enable();
+
+    *p_nr_flux = nr_flux;
+    return sysclk_time(t);
+}
+
+/* Before a refill: has the WDATA ring run dry? The timer has consumed flux
+ * for as long as it has been running, and must not have got beyond the flux
+ * we have queued for it. Also record how much of the ring it had drained. */
+static bool_t wdata_underrun(struct write *wr, time_t start)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma_w.buf) - 1;
+    uint32_t ticks_per_cell = wdata_cell;
+    uint32_t elapsed, queued;
+    uint16_t dmacons, drained;
+
+    elapsed = sysclk_time(time_diff(start, time_now()));
+    dmacons = ARRAY_SIZE(dma_w.buf) - dma_wdata.cndtr;
+    drained = ARRAY_SIZE(dma_w.buf) - ((dma_w.prod - dmacons) & buf_mask);
+    dma_stats.wdata_hwm = max(dma_stats.wdata_hwm, drained);
+
+    /* Flux queued so far, in SYSCLK ticks. Allow for time_now() rounding. */
+    queued = (wr->bc_cons * ticks_per_cell - wr->ticks_since_flux
+              - wr->pc_pend + wr->pc_shift) >> 4;
+    return elapsed > (queued + sysclk_stk(2));
+}
+
 void floppy_write(struct write *wr)
 {
     uint32_t bc_max = wr->nr_words * 16;
     uint16_t dmacons, todo, prev_todo;
     unsigned int stop_index;
+    bool_t underrun = FALSE;
+    time_t start;
     if (wr->terminate_at_index)
         stop_index = index.count + wr->terminate_at_index;
     else
@@ -319,13 +1143,19 @@ void floppy_write(struct write *wr)
     tim_wdata->egr = TIM_EGR_UG;
     tim_wdata->sr = 0; /* dummy write, gives h/w time to process EGR.UG=1 */
     tim_wdata->cr1 = TIM_CR1_CEN;
+    start = time_now();
 
     /* Enable output. */
     gpio_configure_pin(gpio_data, pin_wdata, AFO_bus);
     assert_wgate();
 
-    /* Emit flux into the DMA ring until all bitcells are consumed. */
-    while (wr->bc_cons != bc_max) {
+    /* Emit flux into the DMA ring until all bitcells are consumed, and any
+     * reversal held back for precompensation is emitted. */
+    while ((wr->bc_cons != bc_max) || wr->pc_pend) {
+        if (unlikely(wdata_underrun(wr, start)) && !underrun) {
+            dma_stats.wdata_underruns++;
+            underrun = TRUE;
+        }
         wdata_bc_to_flux(wr, TRUE);
         /* Early termination on index pulse? */
         if (index.count == stop_index)
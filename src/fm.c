@@ -28,6 +28,18 @@ void bin_to_fm(void *p, unsigned int nr)
     }
 }
 
+unsigned int fm_nr_bad(const void *p, unsigned int nr)
+{
+    const uint16_t *in = (const uint16_t *)p;
+    unsigned int i, nr_bad = 0;
+    uint16_t b;
+    for (i = 0; i < nr; i++) {
+        b = be16toh(in[i]);
+        nr_bad += (b != (mfmtab[mfmtobin(b)] | 0xaaaa));
+    }
+    return nr_bad;
+}
+
 void fm_check(const void *p, unsigned int nr)
 {
     const uint16_t *in = (const uint16_t *)p;
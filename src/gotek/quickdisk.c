@@ -31,12 +31,16 @@
 #define tim_rdata   (tim1)
 #define dma_rdata   (dma1->ch2)
 #define dma_rdata_ch 2
+#define dma_rdata_irq 12
 
 #define pin_wdata   7
 #define tim_wdata   (tim3)
 #define dma_wdata   (dma1->ch3)
 #define dma_wdata_ch 3
 
+/* DMA1 channel 2: RDATA flux ring half/full. */
+void IRQ_12(void) __attribute__((alias("IRQ_rdata_dma")));
+
 /* EXTI IRQs. */
 void IRQ_10(void) __attribute__((alias("IRQ_READY_changed"))); /* EXTI4 */
 static const struct exti_irq exti_irqs[] = {
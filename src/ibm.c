@@ -11,6 +11,8 @@
 
 static const uint8_t mfm_gap_sync = 12;
 static const uint8_t mfm_gap2 = 22;
+/* Data byte written to each sector by a format. */
+static const uint8_t mfm_format_fill = 0xe2;
 static const uint8_t mfm_idam_mark[4] = { 0xa1, 0xa1, 0xa1, 0xfe };
 
 static const uint8_t fm_gap_sync = 6;
@@ -18,38 +20,452 @@ static const uint8_t fm_gap2 = 11;
 
 #define round_div(x,y) (((x)+((y)/2)) / (y))
 
+/* CRC16-CCITT states, from 0xffff, after a field's sync and address mark:
+ * A1 A1 A1 and the mark in MFM (@mark_off == 3), the mark alone in FM. */
+static uint16_t mark_crc(unsigned int mark_off, uint8_t mark)
+{
+    static const struct {
+        uint8_t mark;
+        uint16_t mfm, fm;
+    } marks[] = {
+        { 0xfe, 0xb230, 0xef21 }, /* IDAM */
+        { 0xfb, 0xe295, 0xbf84 }, /* DAM */
+        { 0xf8, 0xd2f6, 0x8fe7 }  /* Deleted DAM */
+    };
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(marks); i++)
+        if (marks[i].mark == mark)
+            return (mark_off == 3) ? marks[i].mfm : marks[i].fm;
+    return crc16_ccitt(&mark, 1, (mark_off == 3) ? 0xcdb4 : 0xffff);
+}
+
+/* CRC of a field as captured from its sync mark: @nr bytes, with the
+ * address mark at @mark_off. Only the bytes beyond the mark are CRCed. */
+static uint16_t field_crc(
+    const uint8_t *p, unsigned int mark_off, unsigned int nr)
+{
+    return crc16_ccitt(p + mark_off + 1, nr - mark_off - 1,
+                       mark_crc(mark_off, p[mark_off]));
+}
+
+struct ibm_search_stats ibm_search_stats;
+
+/* Map of the IDAMs on the current track, from its most recent scan. */
+static struct {
+    const struct drive *drive;
+    uint8_t cyl, head;
+    unsigned int ticks_per_cell;
+    time_t period;
+    unsigned int nr;
+    struct ibm_scan_info info[64];
+} map;
+
+static void map_update(
+    const struct ibm_scan_info *info, unsigned int nr, time_t period)
+{
+    map.drive = cur_drive;
+    map.cyl = cur_drive->cyl;
+    map.head = cur_drive->head;
+    map.ticks_per_cell = cur_drive->ticks_per_cell;
+    map.period = period;
+    map.nr = (period == ~0u) ? 0
+        : min_t(unsigned int, nr, ARRAY_SIZE(map.info));
+    memcpy(map.info, info, map.nr * sizeof(*info));
+}
+
+/* Time until the IDAM of @idam next passes the head, or -1 if the map does
+ * not say. */
+static int32_t map_due(const struct idam *idam, time_t now)
+{
+    unsigned int i;
+    time_t t;
+
+    if ((map.drive != cur_drive)
+        || (map.cyl != cur_drive->cyl)
+        || (map.head != cur_drive->head)
+        || (map.ticks_per_cell != cur_drive->ticks_per_cell))
+        return -1;
+    for (i = 0; i < map.nr; i++)
+        if (!memcmp(&map.info[i].idam, idam, sizeof(*idam)))
+            break;
+    if (i == map.nr)
+        return -1;
+
+    /* Find the next passage, from the latest index. */
+    t = index.timestamp + map.info[i].ticks_past_index;
+    while (time_diff(now, t) < 0)
+        t += map.period;
+    return time_diff(now, t);
+}
+
+/* Sleep until the IDAM of @idam is about to pass the head, if the map says
+ * where it is. A search then finds it with the first or second sync mark. */
+static void map_sleep(const struct idam *idam)
+{
+    int32_t due = map_due(idam, time_now());
+
+    /* Arm the read 64 bytes early: within GAP3, and ahead of any drift in
+     * rotational speed. */
+    due -= time_sysclk(64 * 16 * cur_drive->ticks_per_cell);
+    ibm_search_stats.slept = max_t(int32_t, due, 0);
+    if (due > 0)
+        delay_ticks(due);
+}
+
+/* Of the @nr sectors not yet @done, which is due under the head soonest?
+ * Without a map, take them in the order given. */
+static unsigned int map_next(
+    const struct idam *idam, const bool_t *done, unsigned int nr)
+{
+    unsigned int i, next = nr;
+    int32_t due, next_due = 0x7fffffff;
+    time_t now = time_now();
+
+    for (i = 0; i < nr; i++) {
+        if (done[i])
+            continue;
+        if (next == nr)
+            next = i;
+        due = map_due(&idam[i], now);
+        if ((due >= 0) && (due < next_due)) {
+            next = i;
+            next_due = due;
+        }
+    }
+
+    return next;
+}
+
+/* 16 bitcells of a captured bitcell stream, starting at bitcell @pos. */
+static uint16_t bc_word(const uint16_t *bc, uint32_t pos)
+{
+    uint32_t x = (be16toh(bc[pos/16]) << 16) | be16toh(bc[pos/16+1]);
+    return x >> (16 - (pos & 15));
+}
+
+/* Decode @nr bytes of a captured stream, starting at bitcell @pos. */
+static void bc_to_bin(uint8_t *p, const uint16_t *bc, uint32_t pos,
+                      unsigned int nr)
+{
+    while (nr--) {
+        *p++ = mfmtobin(bc_word(bc, pos));
+        pos += 16;
+    }
+}
+
+/* Find the next @sync mark that starts within [@pos,@lim) of the stream.
+ * Returns the bitcell at which the mark starts, or ~0u if none. */
+static uint32_t bc_find_sync(
+    const uint16_t *bc, uint32_t pos, uint32_t lim,
+    const struct sync_pattern *sync)
+{
+    uint32_t w = 0, e = pos;
+
+    /* Window ends at bitcell e, and the mark starts nr_bits before. */
+    lim += sync->nr_bits - 1;
+    while (e < lim) {
+        w = (w << 1) | ((be16toh(bc[e/16]) >> (15 - (e & 15))) & 1);
+        e++;
+        if (((e - pos) >= sync->nr_bits)
+            && ((w & sync->mask) == sync->value))
+            return e - sync->nr_bits;
+    }
+
+    return ~0u;
+}
+
+/* Find every IDAM that starts within the first @lim bitcells of a captured
+ * stream of @nr_bc bitcells, and the DAM which follows each. @mark_off is
+ * the mark byte's offset from the start of the sync mark: the CRC covers
+ * the sync bytes in MFM (A1A1A1) but not in FM (a 00 preamble byte).
+ * ticks_past_index is returned as a bitcell offset into the stream.
+ * If @resume is non-NULL the scan stops at the first IDAM whose sector the
+ * stream cuts short, and *@resume is where a further capture should pick up;
+ * otherwise, or if no capture could hold the sector, it has no DAM. */
+static unsigned int ibm_scan_bc(
+    const uint16_t *bc, uint32_t nr_bc, uint32_t lim,
+    const struct sync_pattern *sync, unsigned int mark_off,
+    struct ibm_scan_info *info, unsigned int max, uint32_t *resume)
+{
+    uint8_t p[32];
+    uint32_t pos = 0, dam, end;
+    unsigned int i = 0, j, n, len;
+    uint16_t crc;
+
+    /* Sync windows must not run off the end of the stream. */
+    if (nr_bc < 32) {
+        if (resume)
+            *resume = 0;
+        return 0;
+    }
+    lim = min(lim, nr_bc - 32);
+
+    while ((pos = bc_find_sync(bc, pos, lim, sync)) != ~0u) {
+
+        /* IDAM: [sync] FE C H R N CRC CRC. */
+        end = pos + (mark_off + 7) * 16;
+        if (end > nr_bc) {
+            if (resume)
+                goto truncated;
+            break;
+        }
+        bc_to_bin(p, bc, pos, mark_off + 7);
+        if ((p[mark_off] != 0xfe) || field_crc(p, mark_off, mark_off + 7)) {
+            /* Not an IDAM: resume the search beyond this sync mark. */
+            pos += mark_off * 16;
+            continue;
+        }
+
+        /* DAM: [sync] FB/F8 DATA CRC CRC, within a GAP2 or so. */
+        len = mark_off + 1 + (128 << (p[mark_off+4] & 7)) + 2;
+        dam = bc_find_sync(bc, end, min(end + 64*16, nr_bc - 32), sync);
+        if (resume && ((dam == ~0u) ? (end + 64*16 > nr_bc - 32)
+                       : ((dam + len * 16 > nr_bc)
+                          && ((dam - pos) + len * 16 <= nr_bc))))
+            goto truncated;
+
+        if (i < max) {
+            memcpy(&info[i].idam, &p[mark_off+1], 4);
+            info[i].ticks_past_index = pos;
+            info[i].dam_offset = 0;
+        }
+
+        if ((dam != ~0u) && ((dam + len * 16) <= nr_bc)) {
+            bc_to_bin(p, bc, dam, mark_off + 1);
+            if ((p[mark_off] == 0xfb) || (p[mark_off] == 0xf8)) {
+                crc = mark_crc(mark_off, p[mark_off]);
+                for (j = mark_off + 1; j < len; j += n) {
+                    n = min_t(unsigned int, len - j, sizeof(p));
+                    bc_to_bin(p, bc, dam + j * 16, n);
+                    crc = crc16_ccitt(p, n, crc);
+                }
+                if ((crc == 0) && (i < max))
+                    info[i].dam_offset = (dam - pos) / 16;
+            }
+        }
+
+        i++;
+        pos = end;
+    }
+
+    if (resume)
+        *resume = lim;
+    return i;
+
+truncated:
+    *resume = pos;
+    return i;
+}
+
+/* Capture one revolution, index to index, then scan it for IDAMs. At ED a
+ * revolution is 50kB of bitcells, so the capture is cut to the thread stack
+ * free; a capture which then, or for a long revolution, ends short of the
+ * next index is continued on a following revolution. Each further pass
+ * starts a little before the first sector the last one cut short, and
+ * IDAMs seen by both passes are merged. */
+static unsigned int ibm_scan_track(
+    struct ibm_scan_info *info, unsigned int max,
+    const struct sync_pattern *sync, unsigned int mark_off)
+{
+    struct read rd;
+    unsigned int i, j, nr = 0, base, nr_words, free;
+    uint32_t cell = cur_drive->ticks_per_cell, lim, resume;
+    time_t index_timestamp, index_period = ~0u, start, from = 0, next;
+    const time_t margin = time_ms(2);
+    int32_t d;
+    uint16_t *bc;
+    bool_t final;
+
+    /* One revolution at 300rpm, plus a little for rotational speed error,
+     * plus slack for bc_word() reading beyond the final word. Leave 2kB of
+     * stack for the calls below. */
+    free = thread_stack_free();
+    ASSERT(free >= 4096);
+    nr_words = (time_ms(202) / time_sysclk(16 * cell) + 1) & ~1;
+    nr_words = min_t(unsigned int, nr_words, (free - 2048) / 2 - 2) & ~1;
+    bc = bc_buf_alloc(nr_words + 2);
+    bc[nr_words] = bc[nr_words+1] = 0;
+
+    for (;;) {
+
+        rd.p = bc;
+        rd.nr_words = nr_words;
+        rd.sync = SYNC_none;
+        rd.decode = DECODE_table;
+        floppy_read_prep(&rd);
+
+        index.count = 0;
+        while (index.count == 0)
+            continue;
+        index_timestamp = index.timestamp;
+        while (time_since(index_timestamp) < (int32_t)from)
+            continue;
+        floppy_read(&rd);
+        start = rd.start - index_timestamp;
+
+        /* Marks beyond the next index belong to the next revolution. */
+        lim = nr_words * 16;
+        final = (index.count >= 2);
+        if (final) {
+            index_period = index.timestamp - index_timestamp;
+            lim = min_t(uint32_t, lim,
+                        sysclk_time(index_period - start) / cell);
+        }
+
+        base = min(nr, max);
+        nr = base + ibm_scan_bc(bc, nr_words * 16, lim, sync, mark_off,
+                                info + base, max - base,
+                                final ? NULL : &resume);
+
+        for (i = base; i < min(nr, max); i++)
+            info[i].ticks_past_index = start
+                + time_sysclk(info[i].ticks_past_index * cell);
+
+        /* The passes overlap by a margin: merge IDAMs seen twice. */
+        for (i = base; i < min(nr, max); ) {
+            for (j = 0; j < base; j++) {
+                d = time_diff(info[j].ticks_past_index,
+                              info[i].ticks_past_index);
+                if (!memcmp(&info[j].idam, &info[i].idam, sizeof(info[j].idam))
+                    && (d > -2*(int32_t)margin) && (d < 2*(int32_t)margin))
+                    break;
+            }
+            if (j == base) {
+                i++;
+                continue;
+            }
+            if (!info[j].dam_offset)
+                info[j].dam_offset = info[i].dam_offset;
+            memmove(&info[i], &info[i+1],
+                    (min(nr, max) - i - 1) * sizeof(*info));
+            nr--;
+        }
+
+        if (final || (nr >= max))
+            break;
+
+        /* Always progress. */
+        next = start + time_sysclk(resume * cell) - margin;
+        from = (time_diff(from, next) > 0) ? next : from + margin;
+    }
+
+    map_update(info, min(nr, max), index_period);
+
+    return nr;
+}
+
+/* Read every sector of a track, in the order the sectors pass the head,
+ * until the first IDAM seen comes round again. Each DAM is captured raw into
+ * the free tail of @buf, and decoded in place. */
+static unsigned int ibm_read_track(
+    uint8_t *buf, unsigned int bytes, struct ibm_sector *sec,
+    unsigned int max, unsigned int sync, unsigned int mark_off)
+{
+    const unsigned int id_bytes = mark_off + 7;
+    const bool_t fm = (sync == SYNC_fm);
+    uint8_t *p = bc_buf_alloc(id_bytes), *q;
+    unsigned int i = 0, sz, dam_bytes, used = 0, fm_bad, mfm_bad;
+    uint16_t crc;
+    struct ibm_sector *s;
+    struct idam first;
+    struct read rd;
+
+    rd.decode = DECODE_table;
+    index.count = 0;
+
+    while (i < max) {
+
+        /* Next IDAM, whichever it is. */
+        rd.p = p;
+        rd.nr_words = id_bytes;
+        rd.sync = sync;
+        floppy_read_prep(&rd);
+        floppy_read(&rd);
+        if (index.count >= 3)
+            break;
+        /* FM clock violations past the mark: the CRC alone may miss them. */
+        if (fm && fm_nr_bad((uint16_t *)p + mark_off + 1,
+                            id_bytes - mark_off - 1))
+            continue;
+        mfm_to_bin(p, id_bytes);
+        if ((p[mark_off] != 0xfe) || field_crc(p, mark_off, id_bytes))
+            continue;
+        if (i == 0)
+            memcpy(&first, p+mark_off+1, 4);
+        else if (!memcmp(&first, p+mark_off+1, 4))
+            break;
+
+        s = &sec[i++];
+        memcpy(&s->idam, p+mark_off+1, 4);
+        s->ticks_past_index = rd.start - index.timestamp;
+        s->data = NULL;
+        s->crc_ok = FALSE;
+
+        /* Its DAM follows within GAP2. */
+        sz = 128 << (s->idam.n & 7);
+        dam_bytes = mark_off + 1 + sz + 2;
+        if ((used + dam_bytes*2) > bytes)
+            continue;
+        rd.p = q = buf + used;
+        rd.nr_words = dam_bytes;
+        floppy_read_prep(&rd);
+        floppy_read(&rd);
+        fm_bad = fm ? fm_nr_bad((uint16_t *)q + mark_off + 1, sz + 2) : 0;
+        mfm_to_bin(q, mark_off + 1);
+        s->crc_ok = ((q[mark_off] == 0xfb) || (q[mark_off] == 0xf8));
+        /* Data and CRC decode straight to the start of the buffer. Bad
+         * bitcells fail the sector, whatever the CRC says. */
+        crc = mfm_to_bin_crc(q, (uint16_t *)q + mark_off + 1, sz + 2,
+                             mark_crc(mark_off, q[mark_off]), &mfm_bad);
+        if (crc || (fm ? fm_bad : mfm_bad))
+            s->crc_ok = FALSE;
+        s->data = q;
+        used += sz;
+    }
+
+    return i;
+}
+
 unsigned int ibm_mfm_scan(
     struct ibm_scan_info *info, unsigned int max, unsigned int *p_gap3)
 {
+    unsigned int i;
+
+#ifdef QUICKDISK
+    /* A Quick Disk "revolution" is seconds long: find IDAMs one by one. */
     struct read rd;
     uint8_t *p = bc_buf_alloc(10);
-    unsigned int i = 0;
     time_t index_timestamp;
 
     rd.p = p;
     rd.nr_words = 10;
     rd.sync = SYNC_mfm;
+    rd.decode = DECODE_table;
 
     index.count = 0;
     while (index.count == 0)
         continue;
     index_timestamp = index.timestamp;
 
-    for (;;) {
+    for (i = 0; ; ) {
         floppy_read_prep(&rd);
         floppy_read(&rd);
         if (index.count != 1)
             break;
         mfm_to_bin(p, 10);
-        if (memcmp(p, mfm_idam_mark, 4)
-            || crc16_ccitt(p, 10, 0xffff))
+        if (memcmp(p, mfm_idam_mark, 4) || field_crc(p, 3, 10))
             continue;
         if (i < max) {
             memcpy(&info[i].idam, p+4, 4);
             info[i].ticks_past_index = rd.start - index_timestamp;
+            info[i].dam_offset = 0;
         }
         i++;
     }
+#else
+    i = ibm_scan_track(info, max, &sync_mfm_a1, 3);
+#endif
 
     if (p_gap3 && (i >= 2) && (max >= 2)) {
         int sec_bytes = round_div(
@@ -70,11 +486,15 @@ unsigned int ibm_mfm_scan(
 void ibm_mfm_search(struct read *rd, const struct idam *idam)
 {
     uint8_t *p = bc_buf_alloc(10);
+    time_t t;
 
     rd->p = p;
     rd->nr_words = 10;
     rd->sync = SYNC_mfm;
+    rd->decode = DECODE_table;
 
+    map_sleep(idam);
+    t = time_now();
     index.count = 0;
 
     do {
@@ -84,56 +504,87 @@ void ibm_mfm_search(struct read *rd, const struct idam *idam)
         mfm_to_bin(p, 10);
     } while (memcmp(p, mfm_idam_mark, 4)
              || memcmp(p+4, idam, 4)
-             || crc16_ccitt(p, 10, 0xffff));
+             || field_crc(p, 3, 10));
+
+    ibm_search_stats.hunted = time_since(t);
 }
 
-void ibm_mfm_read_sector(void *buf, const struct idam *idam)
+/* Read sector @idam to @buf. Returns whether it read back intact and, unless
+ * @quiet, WARNs of each way in which it did not. */
+static bool_t _ibm_mfm_read_sector(
+    void *buf, const struct idam *idam, bool_t quiet)
 {
-    unsigned int dam_bytes = 4 + (128<<idam->n) + 2;
-    uint8_t *p = bc_buf_alloc(dam_bytes);
+    unsigned int sz = 128<<idam->n, dam_bytes = 4 + sz + 2;
+    uint16_t *p = bc_buf_alloc(dam_bytes), crc;
+    unsigned int bad, nr_bad;
+    uint8_t mark, tail[2];
     struct read rd;
+    bool_t sync_ok;
 
     ibm_mfm_search(&rd, idam);
 
     rd.p = p;
     rd.nr_words = dam_bytes;
     rd.sync = SYNC_mfm;
+    rd.decode = DECODE_table;
 
     floppy_read_prep(&rd);
     floppy_read(&rd);
-    mfm_check(p+6, dam_bytes-3);
-    mfm_to_bin(p, dam_bytes);
-    WARN_ON(memcmp(p, mfm_idam_mark, 3));
-    WARN_ON(p[3] != 0xfb);
-    WARN_ON(crc16_ccitt(p, dam_bytes, 0xffff));
+    mfm_to_bin(p, 3);
+    sync_ok = !memcmp(p, mfm_idam_mark, 3);
+    /* The mark, data and CRC are checked as MFM, decoded, and CRCed in a
+     * single pass. The CRC over them all, including the CRC, is zero. They
+     * decode out of place, leaving the MFM words intact to report. */
+    crc = mfm_to_bin_crc(&mark, p+3, 1, crc16_ccitt(p, 3, 0xffff), &bad);
+    nr_bad = bad;
+    crc = mfm_to_bin_crc(buf, p+4, sz, crc, &bad);
+    nr_bad += bad;
+    crc = mfm_to_bin_crc(tail, p+4+sz, 2, crc, &bad);
+    nr_bad += bad;
+
+    if (!quiet) {
+        WARN_ON(!sync_ok);
+        if (nr_bad)
+            mfm_check(p+3, dam_bytes-3);
+        WARN_ON(mark != 0xfb);
+        WARN_ON(crc);
+    }
 
-    memcpy(buf, p+4, 128<<idam->n);
+    return sync_ok && !nr_bad && (mark == 0xfb) && !crc;
 }
 
-void ibm_mfm_write_sector(
-    const void *buf, const struct idam *idam, unsigned int gap3)
+void ibm_mfm_read_sector(void *buf, const struct idam *idam)
 {
-    unsigned int dam_bytes;
-    uint8_t *q, *p;
-    uint16_t crc, *sync;
-    int32_t delta;
-    time_t deadline;
-    struct write wr;
-    struct read rd;
-    int i;
+    (void)_ibm_mfm_read_sector(buf, idam, FALSE);
+}
 
-    /* Calculate write length: must be an even number of bytes. */
-    dam_bytes = mfm_gap_sync + 4 + (128<<idam->n) + 2 + gap3;
-    if (dam_bytes & 1) {
-        /* We write multiples of 32 bitcells: pad the write with extra GAP3 
-         * to achieve this. */
-        dam_bytes++;
-        gap3++;
-    }
+bool_t ibm_mfm_try_read_sector(void *buf, const struct idam *idam)
+{
+    return _ibm_mfm_read_sector(buf, idam, TRUE);
+}
 
-    wr.p = p = bc_buf_alloc(dam_bytes);
-    wr.nr_words = dam_bytes;
-    wr.terminate_at_index = 0;
+unsigned int ibm_mfm_read_track(
+    void *buf, unsigned int bytes, struct ibm_sector *sec, unsigned int max)
+{
+    return ibm_read_track(buf, bytes, sec, max, SYNC_mfm, 3);
+}
+
+/* Length of a DAM write, in bytes. We write multiples of 32 bitcells: it
+ * is padded with extra GAP3 to achieve this. */
+static unsigned int mfm_dam_bytes(const struct idam *idam, unsigned int gap3)
+{
+    return (mfm_gap_sync + 4 + (128<<idam->n) + 2 + gap3 + 1) & ~1;
+}
+
+/* Generate the MFM bitcells of a DAM write of @dam_bytes. */
+static void mfm_mk_dam(
+    uint8_t *p, const void *buf, const struct idam *idam,
+    unsigned int dam_bytes)
+{
+    unsigned int gap3 = dam_bytes - (mfm_gap_sync + 4 + (128<<idam->n) + 2);
+    uint8_t *q;
+    uint16_t crc, *sync;
+    int i;
 
     /* Generate the sector data. */
     q = p;
@@ -149,7 +600,7 @@ void ibm_mfm_write_sector(
     memcpy(q, buf, 128 << idam->n);
     q += 128 << idam->n;
     /* CRC */
-    crc = crc16_ccitt(p+mfm_gap_sync, q-(p+mfm_gap_sync), 0xffff);
+    crc = crc16_ccitt(buf, 128 << idam->n, mark_crc(3, 0xfb));
     *q++ = crc >> 8;
     *q++ = crc;
     /* Post-data gap */
@@ -162,6 +613,23 @@ void ibm_mfm_write_sector(
     sync = (uint16_t *)&p[2*mfm_gap_sync];
     for (i = 0; i < 3; i++)
         *sync++ = htobe16(0x4489);
+}
+
+void ibm_mfm_write_sector(
+    const void *buf, const struct idam *idam, unsigned int gap3)
+{
+    unsigned int dam_bytes = mfm_dam_bytes(idam, gap3);
+    int32_t delta;
+    time_t deadline;
+    uint8_t *p = bc_buf_alloc(dam_bytes);
+    struct write wr;
+    struct read rd;
+
+    mfm_mk_dam(p, buf, idam, dam_bytes);
+    wr.p = p;
+    wr.nr_words = dam_bytes;
+    wr.terminate_at_index = 0;
+    wr.gen = NULL;
 
     /* Prepare the write. */
     floppy_write_prep(&wr);
@@ -179,14 +647,95 @@ void ibm_mfm_write_sector(
     floppy_write(&wr);
 }
 
+/* Just-in-time generator of the track written by ibm_mfm_write_track(). */
+struct mfm_track_gen {
+    struct write wr;
+    const struct idam *idam;
+    unsigned int nr, gap3;
+    /* Current sector (@nr once all are done), and byte offset within it. A
+     * negative offset is within the post-index gap. */
+    unsigned int sec;
+    int off;
+    uint16_t crc;
+    uint8_t prev;
+};
+
+/* Next byte of the track, and whether it is a sync mark. Each sector is a
+ * pre-sync gap, the IDAM (A1 A1 A1 FE C H R N, CRC), GAP2, another pre-sync
+ * gap, the DAM mark (A1 A1 A1 FB), then data, CRC and GAP3. */
+static uint8_t mfm_track_byte(struct mfm_track_gen *g, bool_t *sync)
+{
+    const struct idam *idam = &g->idam[g->sec];
+    const int idam_off = mfm_gap_sync, gap2_off = idam_off + 4 + 4 + 2;
+    const int dam_off = gap2_off + mfm_gap2 + mfm_gap_sync;
+    const int data_off = dam_off + 4;
+    int off = g->off++, sz;
+    uint8_t b;
+
+    *sync = FALSE;
+    if ((off < 0) || (g->sec >= g->nr))
+        return 0x4e;
+
+    sz = 128 << idam->n;
+    /* Each CRC is due as the field's last byte is emitted: the IDAM's over
+     * its four bytes, and the DAM's over a constant fill. */
+    if (off == gap2_off-2)
+        g->crc = crc16_ccitt(idam, 4, mark_crc(3, 0xfe));
+    else if (off == data_off+sz)
+        g->crc = crc16_fill(mfm_format_fill, sz, mark_crc(3, 0xfb));
+
+    if ((off < idam_off)
+        || ((off >= dam_off-mfm_gap_sync) && (off < dam_off))) {
+        b = 0x00;
+    } else if ((off < idam_off+3)
+               || ((off >= dam_off) && (off < dam_off+3))) {
+        b = 0xa1;
+        *sync = TRUE;
+    } else if (off == idam_off+3) {
+        b = 0xfe;
+    } else if (off < gap2_off-2) {
+        b = ((const uint8_t *)idam)[off-(idam_off+4)];
+    } else if ((off < gap2_off)
+               || ((off >= data_off+sz) && (off < data_off+sz+2))) {
+        b = (off & 1) ? g->crc : g->crc >> 8;
+    } else if (off < dam_off-mfm_gap_sync) {
+        b = 0x4e;
+    } else if (off == dam_off+3) {
+        b = 0xfb;
+    } else if (off < data_off+sz) {
+        b = mfm_format_fill;
+    } else {
+        b = 0x4e;
+    }
+
+    if (g->off == data_off + sz + 2 + g->gap3) {
+        g->sec++;
+        g->off = 0;
+    }
+
+    return b;
+}
+
+static void mfm_track_gen(struct write *wr, void *p, unsigned int nr)
+{
+    struct mfm_track_gen *g = container_of(wr, struct mfm_track_gen, wr);
+    uint16_t *q = p;
+    bool_t sync;
+    uint8_t b;
+
+    while (nr--) {
+        b = mfm_track_byte(g, &sync);
+        *q++ = htobe16(sync ? 0x4489 : mfmtab[b] & ~(g->prev << 15));
+        g->prev = b;
+    }
+}
+
 void ibm_mfm_write_track(
     const struct idam *idam, unsigned int nr, unsigned int gap3)
 {
     unsigned int idam_bytes, dam_bytes, track_bytes;
-    unsigned int sync_off[nr*2];
-    uint8_t *q, *p, *s;
-    uint16_t crc, *sync;
-    struct write wr;
+    uint32_t buf[32];
+    struct mfm_track_gen g;
     int i;
 
     idam_bytes = mfm_gap_sync + 8 + 2 + mfm_gap2;
@@ -208,108 +757,33 @@ void ibm_mfm_write_track(
         track_bytes++;
     }
 
-    wr.p = p = bc_buf_alloc(track_bytes);
-    wr.nr_words = track_bytes;
-    wr.terminate_at_index = 1;
-
-    /* Generate the sector data. */
-    q = p;
-    /* Post-index gap */
-    memset(q, 0x4e, 64);
-    q += 64;
-    for (i = 0; i < nr; i++) {
-        /* Pre-sync gap */
-        memset(q, 0x00, mfm_gap_sync);
-        q += mfm_gap_sync;
-        /* Sync + IDAM */
-        sync_off[i*2] = q-p; s = q;
-        memcpy(q, mfm_idam_mark, 4);
-        q += 4;
-        /* IDAM */
-        memcpy(q, &idam[i], 4);
-        q += 4;
-        /* CRC */
-        crc = crc16_ccitt(s, q-s, 0xffff);
-        *q++ = crc >> 8;
-        *q++ = crc;
-        /* GAP2 */
-        memset(q, 0x4e, mfm_gap2);
-        q += mfm_gap2;
-
-        /* Pre-sync gap */
-        memset(q, 0x00, mfm_gap_sync);
-        q += mfm_gap_sync;
-        /* Sync */
-        sync_off[i*2+1] = q-p; s = q;
-        memcpy(q, mfm_idam_mark, 3);
-        q += 3;
-        /* DAM */
-        *q++ = 0xfb;
-        /* Data */
-        memset(q, 0xe2, 128 << idam[i].n);
-        q += 128 << idam[i].n;
-        /* CRC */
-        crc = crc16_ccitt(s, q-s, 0xffff);
-        *q++ = crc >> 8;
-        *q++ = crc;
-        /* Post-data gap */
-        memset(q, 0x4e, gap3);
-        q += gap3;
-    }
-    /* Pre-index gap */
-    memset(q, 0x4e, 64);
-    q += 64;
-
-    /* Convert to MFM and fix the sync words. */
-    bin_to_mfm(p, track_bytes);
-    mfm_check(p+2, track_bytes-1);
-    for (i = 0; i < nr*2; i++) {
-        sync = (uint16_t *)&p[2*sync_off[i]];
-        *sync++ = htobe16(0x4489);
-        *sync++ = htobe16(0x4489);
-        *sync++ = htobe16(0x4489);
-    }
+    /* The track is generated as it is written: post-index gap, sectors,
+     * then pre-index gap. */
+    g.idam = idam;
+    g.nr = nr;
+    g.gap3 = gap3;
+    g.sec = 0;
+    g.off = -64;
+    g.prev = 0x4e;
+    g.wr.p = buf;
+    g.wr.nr_words = track_bytes;
+    g.wr.terminate_at_index = 1;
+    g.wr.gen = mfm_track_gen;
+    g.wr.gen_words = ARRAY_SIZE(buf) * 2;
 
-    /* Do the write, index-to-index. */
-    floppy_write_prep(&wr);
+    /* Do the write, index-to-index. The old sector map no longer applies. */
+    map.nr = 0;
+    floppy_write_prep(&g.wr);
     index.count = 0;
     while (index.count == 0)
         continue;
-    floppy_write(&wr);
+    floppy_write(&g.wr);
 }
 
 unsigned int ibm_fm_scan(
     struct ibm_scan_info *info, unsigned int max, unsigned int *p_gap3)
 {
-    struct read rd;
-    uint8_t *p = bc_buf_alloc(8);
-    unsigned int i = 0;
-    time_t index_timestamp;
-
-    rd.p = p;
-    rd.nr_words = 8;
-    rd.sync = SYNC_fm;
-
-    index.count = 0;
-    while (index.count == 0)
-        continue;
-    index_timestamp = index.timestamp;
-
-    for (;;) {
-        floppy_read_prep(&rd);
-        floppy_read(&rd);
-        if (index.count != 1)
-            break;
-        mfm_to_bin(p, 8);
-        if ((p[1] != 0xfe)
-            || crc16_ccitt(p+1, 7, 0xffff))
-            continue;
-        if (i < max) {
-            memcpy(&info[i].idam, p+2, 4);
-            info[i].ticks_past_index = rd.start - index_timestamp;
-        }
-        i++;
-    }
+    unsigned int i = ibm_scan_track(info, max, &sync_fm_c7, 1);
 
     if (p_gap3 && (i >= 2) && (max >= 2)) {
         int sec_bytes = round_div(
@@ -328,11 +802,15 @@ unsigned int ibm_fm_scan(
 void ibm_fm_search(struct read *rd, const struct idam *idam)
 {
     uint8_t *p = bc_buf_alloc(8);
+    time_t t;
 
     rd->p = p;
     rd->nr_words = 8;
     rd->sync = SYNC_fm;
+    rd->decode = DECODE_table;
 
+    map_sleep(idam);
+    t = time_now();
     index.count = 0;
 
     do {
@@ -342,54 +820,73 @@ void ibm_fm_search(struct read *rd, const struct idam *idam)
         fm_to_bin(p, 8);
     } while ((p[1] != 0xfe)
              || memcmp(p+2, idam, 4)
-             || crc16_ccitt(p+1, 7, 0xffff));
+             || field_crc(p, 1, 8));
+
+    ibm_search_stats.hunted = time_since(t);
 }
 
-void ibm_fm_read_sector(void *buf, const struct idam *idam)
+/* As _ibm_mfm_read_sector(). */
+static bool_t _ibm_fm_read_sector(
+    void *buf, const struct idam *idam, bool_t quiet)
 {
     unsigned int dam_bytes = 2 + (128<<idam->n) + 2;
     uint8_t *p = bc_buf_alloc(dam_bytes);
     struct read rd;
+    bool_t mark_ok, crc_ok;
 
     ibm_fm_search(&rd, idam);
 
     rd.p = p;
     rd.nr_words = dam_bytes;
     rd.sync = SYNC_fm;
+    rd.decode = DECODE_table;
 
     floppy_read_prep(&rd);
     floppy_read(&rd);
-    fm_check(p+4, dam_bytes-2);
+    if (!quiet)
+        fm_check(p+4, dam_bytes-2);
     fm_to_bin(p, dam_bytes);
-    WARN_ON(p[1] != 0xfb);
-    WARN_ON(crc16_ccitt(p+1, dam_bytes-1, 0xffff));
+    mark_ok = (p[1] == 0xfb);
+    crc_ok = !field_crc(p, 1, dam_bytes);
+    if (!quiet) {
+        WARN_ON(!mark_ok);
+        WARN_ON(!crc_ok);
+    }
 
     memcpy(buf, p+2, 128<<idam->n);
+    return mark_ok && crc_ok;
 }
 
-void ibm_fm_write_sector(
-    const void *buf, const struct idam *idam, unsigned int gap3)
+void ibm_fm_read_sector(void *buf, const struct idam *idam)
 {
-    unsigned int dam_bytes;
-    uint8_t *q, *p;
-    uint16_t crc, *sync;
-    int32_t delta;
-    time_t deadline;
-    struct write wr;
-    struct read rd;
+    (void)_ibm_fm_read_sector(buf, idam, FALSE);
+}
 
-    /* Calculate write length: must be an even number of bytes. */
-    dam_bytes = fm_gap_sync + 1 + (128<<idam->n) + 2 + gap3;
-    if (dam_bytes & 1) {
-        /* We write multiples of 32 bitcells: pad the write with extra GAP3 
-         * to achieve this. */
-        dam_bytes++;
-        gap3++;
-    }
+bool_t ibm_fm_try_read_sector(void *buf, const struct idam *idam)
+{
+    return _ibm_fm_read_sector(buf, idam, TRUE);
+}
 
-    wr.p = p = bc_buf_alloc(dam_bytes);
-    wr.nr_words = dam_bytes;
-    wr.terminate_at_index = 0;
+unsigned int ibm_fm_read_track(
+    void *buf, unsigned int bytes, struct ibm_sector *sec, unsigned int max)
+{
+    return ibm_read_track(buf, bytes, sec, max, SYNC_fm, 1);
+}
+
+/* Length of a DAM write, in bytes, padded as for MFM. */
+static unsigned int fm_dam_bytes(const struct idam *idam, unsigned int gap3)
+{
+    return (fm_gap_sync + 1 + (128<<idam->n) + 2 + gap3 + 1) & ~1;
+}
+
+/* Generate the FM bitcells of a DAM write of @dam_bytes. */
+static void fm_mk_dam(
+    uint8_t *p, const void *buf, const struct idam *idam,
+    unsigned int dam_bytes)
+{
+    unsigned int gap3 = dam_bytes - (fm_gap_sync + 1 + (128<<idam->n) + 2);
+    uint8_t *q;
+    uint16_t crc, *sync;
 
     /* Generate the sector data. */
     q = p;
@@ -402,7 +899,7 @@ void ibm_fm_write_sector(
     memcpy(q, buf, 128 << idam->n);
     q += 128 << idam->n;
     /* CRC */
-    crc = crc16_ccitt(p+fm_gap_sync, q-(p+fm_gap_sync), 0xffff);
+    crc = crc16_ccitt(buf, 128 << idam->n, mark_crc(1, 0xfb));
     *q++ = crc >> 8;
     *q++ = crc;
     /* Post-data gap */
@@ -414,6 +911,23 @@ void ibm_fm_write_sector(
     fm_check(p, dam_bytes);
     sync = (uint16_t *)&p[2*fm_gap_sync];
     *sync = htobe16(fm_sync(0xfb, FM_SYNC_CLK));
+}
+
+void ibm_fm_write_sector(
+    const void *buf, const struct idam *idam, unsigned int gap3)
+{
+    unsigned int dam_bytes = fm_dam_bytes(idam, gap3);
+    int32_t delta;
+    time_t deadline;
+    uint8_t *p = bc_buf_alloc(dam_bytes);
+    struct write wr;
+    struct read rd;
+
+    fm_mk_dam(p, buf, idam, dam_bytes);
+    wr.p = p;
+    wr.nr_words = dam_bytes;
+    wr.terminate_at_index = 0;
+    wr.gen = NULL;
 
     /* Prepare the write. */
     floppy_write_prep(&wr);
@@ -431,6 +945,88 @@ void ibm_fm_write_sector(
     floppy_write(&wr);
 }
 
+/* Write @nr sectors, whose data is consecutive in @buf, in the order they
+ * pass the head. Each DAM is generated just before its IDAM is searched
+ * for, so it is ready to write as soon as the IDAM is found, and only one
+ * DAM's bitcells are held at a time. */
+static void ibm_write_sectors(
+    const void *buf, const struct idam *idam, unsigned int nr,
+    unsigned int gap3, bool_t fm)
+{
+    unsigned int ticks_per_cell = cur_drive->ticks_per_cell;
+    unsigned int i, n, bytes, max = 0;
+    const uint8_t *dat[nr];
+    bool_t done[nr];
+    int32_t delta;
+    time_t deadline;
+    uint8_t *p;
+    struct write wr;
+    struct read rd;
+
+    dat[0] = buf;
+    for (i = 0; i < nr; i++) {
+        if (i != 0)
+            dat[i] = dat[i-1] + (128 << idam[i-1].n);
+        bytes = fm ? fm_dam_bytes(&idam[i], gap3)
+            : mfm_dam_bytes(&idam[i], gap3);
+        max = max_t(unsigned int, max, bytes);
+        done[i] = FALSE;
+    }
+
+    /* One DAM's bitcells at a time, each generated ahead of its search.
+     * Leave 2kB of stack for the calls below. */
+    ASSERT(thread_stack_free() >= 2*max + 2048);
+    p = bc_buf_alloc(max);
+
+    for (n = 0; n < nr; n++) {
+        i = map_next(idam, done, nr);
+        done[i] = TRUE;
+
+        bytes = fm ? fm_dam_bytes(&idam[i], gap3)
+            : mfm_dam_bytes(&idam[i], gap3);
+        if (fm)
+            fm_mk_dam(p, dat[i], &idam[i], bytes);
+        else
+            mfm_mk_dam(p, dat[i], &idam[i], bytes);
+
+        wr.p = p;
+        wr.nr_words = bytes;
+        wr.terminate_at_index = 0;
+        wr.gen = NULL;
+        floppy_write_prep(&wr);
+
+        /* Find the sector, and wait for end of GAP2. */
+        if (fm) {
+            ibm_fm_search(&rd, &idam[i]);
+            deadline = rd.end + time_sysclk(fm_gap2 * 16 * ticks_per_cell);
+        } else {
+            ibm_mfm_search(&rd, &idam[i]);
+            deadline = rd.end + time_sysclk(mfm_gap2 * 16 * ticks_per_cell);
+        }
+        delta = time_diff(time_now(), deadline);
+        if (delta > 0)
+            delay_ticks(delta);
+
+        floppy_write(&wr);
+    }
+}
+
+void ibm_mfm_write_sectors(
+    const void *buf, const struct idam *idam, unsigned int nr,
+    unsigned int gap3)
+{
+    ASSERT(nr != 0);
+    ibm_write_sectors(buf, idam, nr, gap3, FALSE);
+}
+
+void ibm_fm_write_sectors(
+    const void *buf, const struct idam *idam, unsigned int nr,
+    unsigned int gap3)
+{
+    ASSERT(nr != 0);
+    ibm_write_sectors(buf, idam, nr, gap3, TRUE);
+}
+
 /*
  * Local variables:
  * mode: C
@@ -13,6 +13,12 @@
 #define HARD_SECTORS 0
 #endif
 
+/* Capture a revolution of raw flux, and dump it to the console, each round
+ * (make flux_dump=y). */
+#ifndef FLUX_DUMP
+#define FLUX_DUMP 0
+#endif
+
 int EXC_reset(void) __attribute__((alias("main")));
 
 static void canary_init(void)
@@ -33,6 +39,7 @@ static void noinline hfe_test(void)
     uint16_t *q = (uint16_t *)p;
     struct read rd;
     struct write wr;
+    unsigned int n;
     int i;
 
     printk("\nHFE TEST:\n");
@@ -49,6 +56,7 @@ static void noinline hfe_test(void)
     wr.p = p;
     wr.nr_words = tlen;
     wr.terminate_at_index = 0;
+    wr.gen = NULL;
     floppy_write_prep(&wr);
     index.count = 0;
     while (index.count == 0)
@@ -61,6 +69,7 @@ static void noinline hfe_test(void)
     for (i ; i < tlen; i++)
         q[i] = htobe16(0x4444);
     wr.terminate_at_index = 1;
+    wr.gen = NULL;
     floppy_write_prep(&wr);
     index.count = 0;
     while (index.count == 0)
@@ -71,6 +80,7 @@ static void noinline hfe_test(void)
     rd.p = p;
     rd.nr_words = tlen;
     rd.sync = SYNC_mfm;
+    rd.decode = DECODE_table;
     floppy_read_prep(&rd);
     index.count = 0;
     while (index.count == 0)
@@ -81,6 +91,28 @@ static void noinline hfe_test(void)
         if (be16toh(q[i]) != 0x4489)
             break;
     printk("We have %d 4489s\n", i);
+
+    /* Again through the PLL, reported alongside: it absorbs the drift in
+     * data rate which the read above exists to show. The read is
+     * asynchronous: count how much the main thread gets done. */
+    memset(p, 0, tlen*2);
+    rd.decode = DECODE_pll;
+    floppy_read_prep(&rd);
+    index.count = 0;
+    while (index.count == 0)
+        continue;
+    floppy_read_async(&rd, NULL);
+    for (n = 0; !floppy_read_async_done(); n++)
+        cpu_relax();
+    printk("Async read: %u idle loops in %ums\n",
+           n, time_diff(rd.start, rd.end) / time_ms(1));
+
+    for (i = 0; i < 8000; i++)
+        if (be16toh(q[i]) != 0x4489)
+            break;
+    printk("PLL: %d 4489s, period %u/16 (nominal %u), "
+           "peak phase error %u/16\n", i,
+           rd.pll_period, cur_drive->ticks_per_cell, rd.pll_peak_err);
 }
 
 static int32_t get_index_period(void)
@@ -176,6 +208,7 @@ static void noinline hfe_hard_sector_index_timing_test(void)
             wr.p = p;
             wr.nr_words = wlen;
             wr.terminate_at_index = i == 9 ? 2 : 1;
+            wr.gen = NULL;
             floppy_write_now(&wr);
             j = time_diff(s, index.timestamp);
             WARN_ON(time_us(19800) > j || j > time_us(20200));
@@ -211,11 +244,13 @@ static void noinline mfm_hard_sector_rw_sector(
     wr.p = bc;
     wr.nr_words = sz+10;
     wr.terminate_at_index = (sector == nsect-1) ? 2 : 1;
+    wr.gen = NULL;
     floppy_write_now(&wr);
 
     rd.p = bc;
     rd.nr_words = sz+2;
     rd.sync = SYNC_mfm;
+    rd.decode = DECODE_table;
     floppy_read_prep(&rd);
     WARN_ON(wait_for_hard_sector_trkstart(sector_duration, nsect));
     for (i = 0; i < sector; i++) get_index_period(); // TODO: add WARN
@@ -228,6 +263,7 @@ static void noinline mfm_hard_sector_rw_sector(
     rd.p = bc;
     rd.nr_words = sz+2;
     rd.sync = SYNC_mfm;
+    rd.decode = DECODE_table;
     floppy_read_prep(&rd);
     WARN_ON(wait_for_hard_sector_trkstart(sector_duration, nsect));
     for (i = 0; i < sector; i++) get_index_period(); // TODO: add WARN
@@ -280,6 +316,13 @@ static void noinline adf_test(unsigned int nsec)
     amiga_track_read(q, track, nsec);
     WARN_ON(memcmp(p, q, nsec*512));
 
+    /* The PLL, reported alongside the check above rather than instead of
+     * it: it would absorb the data-rate drift that check exists to catch. */
+    memset(q, 0, nsec*512);
+    printk("PLL read: %s\n",
+           (amiga_track_try_read(q, track, nsec, DECODE_pll)
+            && !memcmp(p, q, nsec*512)) ? "OK" : "Failed");
+
     printk("Amiga %s - OK\n", (nsec == 11) ? "DD" : "HD");
 }
 
@@ -330,13 +373,97 @@ fail:
     WARN_ON(TRUE);
 }
 
+/* Check a whole-track read against the expected IDAMs, and the data of
+ * sector @idam against @p. */
+static void check_ibm_track(
+    const struct idam *expected, unsigned int exp_nr,
+    const struct ibm_sector *sec, unsigned int nr,
+    const struct idam *idam, const uint8_t *p)
+{
+    unsigned int i, j;
+
+    WARN_ON(nr != exp_nr);
+    for (i = 0; i < nr; i++) {
+        for (j = 0; j < exp_nr; j++)
+            if (!memcmp(&expected[j], &sec[i].idam, sizeof(*idam)))
+                break;
+        WARN_ON(j == exp_nr);
+        WARN_ON(!sec[i].crc_ok || !sec[i].data);
+        if (!memcmp(idam, &sec[i].idam, sizeof(*idam)) && sec[i].data)
+            WARN_ON(memcmp(p, sec[i].data, 128 << idam->n));
+    }
+}
+
+static unsigned int isqrt(uint32_t x)
+{
+    unsigned int r = 0, b;
+    for (b = 1u << 15; b != 0; b >>= 1)
+        if ((r + b) * (r + b) <= x)
+            r += b;
+    return r;
+}
+
+/* Summarise a flux histogram. Each peak, at a whole number of bitcells, is
+ * given as mean +/- standard deviation, in bitcells, and its share of all
+ * flux. Outliers are more than a quarter bitcell from any peak. A bin counts
+ * as its lower edge, which is where ideal flux lands: at the standard rates
+ * a bitcell is a whole number of bins. */
+static void flux_hist_report(const struct flux_hist *hist)
+{
+    unsigned int cell = cur_drive->ticks_per_cell, w = 1u << hist->shift;
+    uint32_t n[9] = { 0 }, sq[9] = { 0 }, total = 0, outliers = hist->bin[63];
+    int32_t sum[9] = { 0 };
+    unsigned int i, k, base, mean, sd;
+    int d, m, var;
+
+    /* Bins are 1/8 to 1/16 of a bitcell, so each peak's flux is binned
+     * within a few bins of its nominal one. Sums are of the offset from
+     * that bin, which keeps them to 32 bits. */
+    for (i = 0; i < ARRAY_SIZE(hist->bin) - 1; i++) {
+        k = (i * w + cell / 2) / cell;
+        base = (k * cell) >> hist->shift;
+        d = (int)i - (int)base;
+        if ((k == 0) || (k >= ARRAY_SIZE(n))
+            || ((unsigned int)((d < 0) ? -d : d) * w > cell / 4)) {
+            outliers += hist->bin[i];
+            continue;
+        }
+        n[k] += hist->bin[i];
+        sum[k] += (int32_t)hist->bin[i] * d;
+        sq[k] += hist->bin[i] * d * d;
+    }
+    for (k = 0; k < ARRAY_SIZE(n); k++)
+        total += n[k];
+    total += outliers;
+
+    printk("Flux:");
+    for (k = 1; k < ARRAY_SIZE(n); k++) {
+        if (n[k] == 0)
+            continue;
+        /* Mean offset and variance in 1/16ths of a bin, rounded. */
+        m = (sum[k] * 16 + ((sum[k] < 0) ? -(int)n[k] : (int)n[k]) / 2)
+            / (int)n[k];
+        var = (sq[k] / n[k]) * 256
+            + ((sq[k] % n[k]) * 256 + n[k] / 2) / n[k] - m * m;
+        base = (k * cell) >> hist->shift;
+        mean = ((base * 16 + m) * w * 100 + cell * 8) / (cell * 16);
+        sd = (isqrt(max_t(int, var, 0)) * w * 100 + cell * 8) / (cell * 16);
+        printk(" %u.%02u+-%u.%02u (%u%%)", mean / 100, mean % 100,
+               sd / 100, sd % 100, (n[k] * 100) / total);
+    }
+    printk(" ;; outliers %u/%u\n", outliers, total);
+}
+
 static void noinline mfm_rw_sector(struct idam *idam, uint8_t base, uint8_t nr)
 {
     unsigned int sz = 128 << idam->n;
     struct ibm_scan_info info[64];
     struct idam expected[nr];
-    uint8_t *p = alloca(sz), *q = alloca(sz);
-    time_t index_timestamp;
+    struct ibm_sector sec[nr+1];
+    unsigned int qsz = (nr + 2) * sz + 16;
+    uint8_t *p = alloca(sz), *q;
+    struct flux_hist hist;
+    time_t index_timestamp, t;
     unsigned int index_period, orig_index_period, gap3, seen_nr;
     int i;
 
@@ -358,6 +485,9 @@ static void noinline mfm_rw_sector(struct idam *idam, uint8_t base, uint8_t nr)
     for (i = 0; i < sz; i++)
         p[i] = rand()>>8;
     ibm_mfm_write_sector(p, idam, gap3/2);
+    printk("Search: slept %u us, hunted %u us\n",
+           ibm_search_stats.slept / time_us(1),
+           ibm_search_stats.hunted / time_us(1));
 
     index_timestamp = index.timestamp;
     while (index_timestamp == index.timestamp)
@@ -366,6 +496,18 @@ static void noinline mfm_rw_sector(struct idam *idam, uint8_t base, uint8_t nr)
     printk("Index delayed by %d ms\n",
            (int)(index_period - orig_index_period) / (int)time_ms(1));
 
+    /* Allocated after the scan, so as not to stack beneath its capture. */
+    q = alloca(qsz);
+    floppy_set_flux_hist(&hist);
+    t = time_now();
+    seen_nr = ibm_mfm_read_track(q, qsz, sec, ARRAY_SIZE(sec));
+    t = time_now() - t;
+    floppy_set_flux_hist(NULL);
+    check_ibm_track(expected, nr, sec, seen_nr, idam, p);
+    printk("Track read: %u sectors in %u ms\n", seen_nr, t / time_ms(1));
+    flux_hist_report(&hist);
+
+    /* The sector just written, by itself, through the single-sector path. */
     ibm_mfm_read_sector(q, idam);
     WARN_ON(memcmp(p, q, sz));
     printk("MFM %u r/w sector - OK\n", sz);
@@ -376,8 +518,11 @@ static void noinline fm_rw_sector(struct idam *idam, uint8_t base, uint8_t nr)
     unsigned int sz = 128 << idam->n;
     struct ibm_scan_info info[64];
     struct idam expected[nr];
-    uint8_t *p = alloca(sz), *q = alloca(sz);
-    time_t index_timestamp;
+    struct ibm_sector sec[nr+1];
+    unsigned int qsz = (nr + 2) * sz + 16;
+    uint8_t *p = alloca(sz), *q;
+    struct flux_hist hist;
+    time_t index_timestamp, t;
     unsigned int index_period, orig_index_period, gap3, seen_nr;
     int i;
 
@@ -399,6 +544,9 @@ static void noinline fm_rw_sector(struct idam *idam, uint8_t base, uint8_t nr)
     for (i = 0; i < sz; i++)
         p[i] = rand()>>8;
     ibm_fm_write_sector(p, idam, gap3/2);
+    printk("Search: slept %u us, hunted %u us\n",
+           ibm_search_stats.slept / time_us(1),
+           ibm_search_stats.hunted / time_us(1));
 
     index_timestamp = index.timestamp;
     while (index_timestamp == index.timestamp)
@@ -407,11 +555,113 @@ static void noinline fm_rw_sector(struct idam *idam, uint8_t base, uint8_t nr)
     printk("Index delayed by %d ms\n",
            (int)(index_period - orig_index_period) / (int)time_ms(1));
 
+    /* Allocated after the scan, so as not to stack beneath its capture. */
+    q = alloca(qsz);
+    floppy_set_flux_hist(&hist);
+    t = time_now();
+    seen_nr = ibm_fm_read_track(q, qsz, sec, ARRAY_SIZE(sec));
+    t = time_now() - t;
+    floppy_set_flux_hist(NULL);
+    check_ibm_track(expected, nr, sec, seen_nr, idam, p);
+    printk("Track read: %u sectors in %u ms\n", seen_nr, t / time_ms(1));
+    flux_hist_report(&hist);
+
+    /* The sector just written, by itself, through the single-sector path. */
     ibm_fm_read_sector(q, idam);
     WARN_ON(memcmp(p, q, sz));
     printk("FM %u r/w sector - OK\n", sz);
 }
 
+/* Rewrite every sector of the track in one pass, then read it all back. */
+static void noinline ibm_rw_track(
+    struct idam *idam, uint8_t base, uint8_t nr, bool_t fm)
+{
+    unsigned int sz = 128 << idam->n, qsz = (nr + 2) * sz + 16;
+    struct ibm_scan_info info[64];
+    struct idam expected[nr];
+    struct ibm_sector sec[nr+1];
+    uint8_t *p = alloca(nr * sz), *q;
+    unsigned int gap3, seen_nr, i, j;
+    time_t t;
+
+    seen_nr = fm ? ibm_fm_scan(info, ARRAY_SIZE(info), &gap3)
+        : ibm_mfm_scan(info, ARRAY_SIZE(info), &gap3);
+
+    memcpy(&expected[0], idam, sizeof(*idam));
+    expected[0].r = base;
+    mk_ibm_idams(expected, nr, 1, 0, 0);
+    check_ibm_idams(expected, nr, info, seen_nr);
+
+    for (i = 0; i < nr * sz; i++)
+        p[i] = rand()>>8;
+    t = time_now();
+    if (fm)
+        ibm_fm_write_sectors(p, expected, nr, gap3/2);
+    else
+        ibm_mfm_write_sectors(p, expected, nr, gap3/2);
+    t = time_now() - t;
+    printk("Write: %u sectors in %u ms (%u kB/s)\n", nr, t / time_ms(1),
+           (nr * sz) / max_t(unsigned int, t / time_ms(1), 1));
+
+    q = alloca(qsz);
+    seen_nr = fm ? ibm_fm_read_track(q, qsz, sec, ARRAY_SIZE(sec))
+        : ibm_mfm_read_track(q, qsz, sec, ARRAY_SIZE(sec));
+    check_ibm_track(expected, nr, sec, seen_nr, &expected[0], p);
+    for (i = 0; i < seen_nr; i++) {
+        j = sec[i].idam.r - base;
+        if ((j < nr) && sec[i].data)
+            WARN_ON(memcmp(p + j*sz, sec[i].data, sz));
+    }
+    printk("%s %u r/w track - OK\n", fm ? "FM" : "MFM", sz);
+}
+
+/* Rewrite the track's sectors with ever more jitter of each kind, and report
+ * the smallest peak jitter at which a sector fails to read back. */
+static void noinline jitter_sweep(struct idam *idam, uint8_t base, uint8_t nr)
+{
+    static const char *modes[] = { "uniform", "gaussian", "wow" };
+    struct jitter jitter = { JITTER_none, 0, 0x1d872b41, 100 };
+    unsigned int sz = 128 << idam->n, qsz = (nr + 2) * sz + 16;
+    struct ibm_scan_info info[64];
+    struct idam expected[nr];
+    struct ibm_sector sec[nr+1];
+    uint8_t *p = alloca(nr * sz), *q = alloca(qsz);
+    unsigned int gap3, seen_nr, ok, i, j, m;
+
+    seen_nr = ibm_mfm_scan(info, ARRAY_SIZE(info), &gap3);
+    memcpy(&expected[0], idam, sizeof(*idam));
+    expected[0].r = base;
+    mk_ibm_idams(expected, nr, 1, 0, 0);
+    check_ibm_idams(expected, nr, info, seen_nr);
+
+    for (i = 0; i < nr * sz; i++)
+        p[i] = rand()>>8;
+
+    printk("Jitter limit:");
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        jitter.mode = JITTER_uniform + m;
+        for (jitter.ns = 100; jitter.ns <= 1000; jitter.ns += 100) {
+            floppy_set_jitter(&jitter);
+            ibm_mfm_write_sectors(p, expected, nr, gap3/2);
+            floppy_set_jitter(NULL);
+            seen_nr = ibm_mfm_read_track(q, qsz, sec, ARRAY_SIZE(sec));
+            for (i = ok = 0; i < seen_nr; i++) {
+                j = sec[i].idam.r - base;
+                if ((j < nr) && sec[i].crc_ok && sec[i].data
+                    && !memcmp(p + j*sz, sec[i].data, sz))
+                    ok++;
+            }
+            if (ok != nr)
+                break;
+        }
+        if (jitter.ns > 1000)
+            printk(" %s=none", modes[m]);
+        else
+            printk(" %s=%uns", modes[m], jitter.ns);
+    }
+    printk("\n");
+}
+
 static void noinline dsk_test(void)
 {
     struct idam idam_8k = { 2, 0, 3, 6 };
@@ -443,6 +693,150 @@ static void noinline dsk_test(void)
     ibm_mfm_write_track(&idam_512, 1, 84);
 }
 
+/* A raw flux capture, framed for extraction from the console stream: this
+ * header, @bytes of flux (as DECODE_raw), then the big-endian CRC16-CCITT
+ * of both. Little endian. See scripts/ffcap_to_scp.py. */
+struct flux_frame {
+    char magic[4]; /* "FFCP" */
+    uint8_t cyl, head;
+    uint16_t ticks_per_cell;
+    /* Flux interval clock (Hz). */
+    uint32_t sample_hz;
+    /* Index pulse to start of capture, and revolution period (clocks). */
+    uint32_t index_offset, index_period;
+    uint32_t nr_flux, bytes;
+};
+
+/* Capture from index, for as long as free RAM allows (more than a whole
+ * revolution at DD), and send it to the console. */
+static void noinline flux_dump(void)
+{
+    /* All the free stack, less a little for the read and console paths. */
+    unsigned int bytes = (thread_stack_free() - 1024) & ~3;
+    struct flux_frame f;
+    struct read rd;
+    time_t prev_index, start_index;
+    uint16_t crc;
+    uint8_t be[2];
+
+    rd.p = alloca(bytes);
+    rd.nr_words = bytes / 2;
+    rd.sync = SYNC_none;
+    rd.decode = DECODE_raw;
+
+    prev_index = index.timestamp;
+    while ((start_index = index.timestamp) == prev_index)
+        continue;
+    floppy_read_prep(&rd);
+    floppy_read(&rd);
+
+    memcpy(f.magic, "FFCP", 4);
+    f.cyl = cur_drive->cyl;
+    f.head = cur_drive->head;
+    f.ticks_per_cell = cur_drive->ticks_per_cell;
+    f.sample_hz = SYSCLK;
+    f.index_offset = sysclk_time(rd.start - start_index);
+    f.index_period = sysclk_time(start_index - prev_index);
+    f.nr_flux = rd.raw_flux;
+    f.bytes = rd.raw_bytes;
+    printk("Flux capture: %u flux in %u bytes, %u ms\n", f.nr_flux, f.bytes,
+           (rd.end - rd.start) / time_ms(1));
+
+    crc = crc16_ccitt(&f, sizeof(f), 0xffff);
+    crc = crc16_ccitt(rd.p, f.bytes, crc);
+    be[0] = crc >> 8;
+    be[1] = crc;
+    console_write(&f, sizeof(f));
+    console_write(rd.p, f.bytes);
+    console_write(be, 2);
+    printk("\n");
+}
+
+/* Report the flux decoders' cost at the current data rate. */
+static void noinline decode_bench(const char *name)
+{
+    static const char *decoders[] = { "loop", "table", "pll", "raw" };
+    struct dma_stats stats = dma_stats;
+    unsigned int i, nr_flux, cycles;
+    struct read rd;
+    time_t t;
+
+    /* Room for a ring of raw flux, at up to three bytes apiece. */
+    rd.p = bc_buf_alloc(2048);
+    rd.nr_words = 2048;
+    rd.sync = SYNC_none;
+
+    printk("%s decode:", name);
+    for (i = 0; i < ARRAY_SIZE(decoders); i++) {
+        rd.decode = i;
+        cycles = floppy_read_bench(&rd, &nr_flux);
+        cycles = (cycles * 100) / nr_flux;
+        printk(" %s=%u.%02u", decoders[i], cycles / 100, cycles % 100);
+    }
+
+    rd.sync = SYNC_mfm;
+    cycles = floppy_read_bench(&rd, &nr_flux);
+    cycles = (cycles * 100) / nr_flux;
+    printk(" sync=%u.%02u", cycles / 100, cycles % 100);
+
+    printk(" cycles/flux\n");
+
+    /* MFM-to-binary conversion, in place, of the ring's worth of words: by
+     * nibble table, and by the bit-serial decoder it replaced. */
+    printk("%s mfm_to_bin:", name);
+    for (i = 0; i < 2; i++) {
+        IRQ_global_disable();
+        t = time_now();
+        (i ? mfm_to_bin_rrx : mfm_to_bin)(rd.p, rd.nr_words);
+        t = time_diff(t, time_now());
+        IRQ_global_enable();
+        cycles = (sysclk_time(t) * 100) / rd.nr_words;
+        printk(" %s=%u.%02u", i ? "rrx" : "table", cycles / 100, cycles % 100);
+    }
+    printk(" cycles/word\n");
+
+    /* The bench fills the RDATA ring on purpose: keep it out of the
+     * round's ring statistics. */
+    dma_stats = stats;
+}
+
+/* Report the write refill's cost at each MFM data rate. This bounds how
+ * small a latency-sensitive refill may be. */
+static void noinline refill_bench(void)
+{
+    static const unsigned int kbps[] = { 250, 500, 1000 };
+    unsigned int i, nr_flux, cycles, cell = cur_drive->ticks_per_cell;
+    struct dma_stats stats = dma_stats;
+    uint8_t *p = bc_buf_alloc(1024);
+    struct write wr;
+
+    for (i = 0; i < 1024; i++)
+        p[i] = rand()>>8;
+    bin_to_mfm(p, 1024);
+
+    printk("Write refill:");
+    for (i = 0; i < ARRAY_SIZE(kbps); i++) {
+        cur_drive->ticks_per_cell = sysclk_us(500) / kbps[i];
+        wr.p = p;
+        wr.nr_words = 1024;
+        wr.terminate_at_index = 0;
+        wr.gen = NULL;
+        cycles = floppy_write_bench(&wr, &nr_flux);
+        cycles = (cycles * 100) / nr_flux;
+        printk(" %ukbps=%u.%02u", kbps[i], cycles / 100, cycles % 100);
+    }
+    printk(" cycles/flux\n");
+
+    cur_drive->ticks_per_cell = cell;
+    /* Keep the bench's refills out of the round's ring statistics. */
+    dma_stats = stats;
+}
+
+/* Controller-style precomp: a reversal with a near neighbour on one side
+ * and a far one on the other is written 125ns towards the near one. */
+static const struct precomp_band precomp_125ns[] = {
+    { 0, { { 0, -125, -125 }, { 125, 0, 0 }, { 125, 0, 0 } } } };
+
 static void noinline img_test(void)
 {
     struct idam idam = { 0, 0, 1, 2 };
@@ -458,12 +852,19 @@ static void noinline img_test(void)
     idam.n = 2;
     cur_drive->ticks_per_cell = sysclk_ns(500);
     mfm_rw_sector(&idam, 1, 36);
+    decode_bench("ED");
 
     da_select_image("720k");
     floppy_seek(0, 0);
     idam.n = 2;
     cur_drive->ticks_per_cell = sysclk_us(2);
     mfm_rw_sector(&idam, 1, 9);
+    if (FLUX_DUMP)
+        flux_dump();
+    jitter_sweep(&idam, 1, 9);
+    floppy_set_precomp(precomp_125ns, ARRAY_SIZE(precomp_125ns));
+    ibm_rw_track(&idam, 1, 9, FALSE);
+    floppy_set_precomp(NULL, 0);
 
     for (i = 0; i < ARRAY_SIZE(idams); i++) {
         idams[i].c = 2;
@@ -481,12 +882,163 @@ static void noinline img_test(void)
     idam.n = 1;
     cur_drive->ticks_per_cell = sysclk_us(4);
     fm_rw_sector(&idam, 0, 10);
+    ibm_rw_track(&idam, 0, 10, TRUE);
 
     da_select_image("8k.8k");
     floppy_seek(0, 0);
     idam.n = 6;
     cur_drive->ticks_per_cell = sysclk_us(1);
     mfm_rw_sector(&idam, 1, 1);
+    decode_bench("8k.8k");
+}
+
+/* A format whose tolerance of off-speed writes is measured: a sector is
+ * written with a data-rate skew and read back at the nominal rate. Amiga
+ * writes a one-sector track: a full track leaves too little slack before
+ * the index, and its overrun would be measured instead. */
+struct rate_fmt {
+    const char *name, *image;
+    enum { RATE_mfm, RATE_fm, RATE_amiga } type;
+    unsigned int ticks_per_cell;
+    /* The sector written. Amiga: cylinder, head, and track (as r). */
+    struct idam idam;
+};
+
+static const struct rate_fmt rate_fmts[] = {
+    { "MFM DD", "720k", RATE_mfm, sysclk_us(2), { 0, 0, 1, 2 } },
+    { "MFM HD", "8k.8k", RATE_mfm, sysclk_us(1), { 0, 0, 1, 6 } },
+    { "MFM ED", "2m88", RATE_mfm, sysclk_ns(500), { 0, 0, 1, 2 } },
+    { "FM SD", "200k", RATE_fm, sysclk_us(4), { 0, 0, 0, 1 } },
+    { "Amiga DD", "amiga_880", RATE_amiga, sysclk_us(2), { 2, 1, 5, 0 } },
+};
+
+/* GAP3 bytes written after an IBM sector's CRC: the fewest the drive takes
+ * the write with. A slow write then runs on into as little gap as possible. */
+#define RATE_GAP3 4
+
+/* Write fresh data at a skew of @ppm, and check that it reads back. Failing
+ * skews are probed on purpose, so the read back is quiet. */
+static bool_t noinline rate_rw(const struct rate_fmt *f, int ppm)
+{
+    unsigned int i, sz = (f->type == RATE_amiga) ? 512 : 128 << f->idam.n;
+    uint8_t *p = alloca(sz);
+    uint8_t *q = alloca((f->type == RATE_amiga) ? 11*512 : sz);
+    bool_t ok = FALSE;
+
+    for (i = 0; i < sz; i++)
+        p[i] = rand()>>8;
+
+    floppy_set_write_skew(ppm);
+    switch (f->type) {
+    case RATE_mfm:
+        ibm_mfm_write_sector(p, &f->idam, RATE_GAP3);
+        break;
+    case RATE_fm:
+        ibm_fm_write_sector(p, &f->idam, RATE_GAP3);
+        break;
+    case RATE_amiga:
+        amiga_track_write(p, f->idam.r, 1);
+        break;
+    }
+    floppy_set_write_skew(0);
+
+    switch (f->type) {
+    case RATE_mfm:
+        ok = ibm_mfm_try_read_sector(q, &f->idam);
+        break;
+    case RATE_fm:
+        ok = ibm_fm_try_read_sector(q, &f->idam);
+        break;
+    case RATE_amiga:
+        /* The drive reads back a whole track, rebuilt from its image. */
+        ok = amiga_track_try_read(q, f->idam.r, 11, DECODE_table);
+        break;
+    }
+
+    return ok && !memcmp(p, q, sz);
+}
+
+/* Largest slow skew at which the DAM write (pre-sync gap, mark, data, CRC
+ * and RATE_GAP3) still ends within the @gap3 bytes before the next IDAM.
+ * Beyond it the write would overrun that IDAM, and leave the track damaged
+ * for later tests. */
+static int rate_max_skew(const struct rate_fmt *f, unsigned int gap3)
+{
+    unsigned int w = (128 << f->idam.n) + RATE_GAP3;
+
+    if (f->type == RATE_amiga)
+        return 100000; /* a lone sector, on a track of its own */
+    if (gap3 <= RATE_GAP3)
+        return 0;
+    w += (f->type == RATE_mfm) ? 12+4+2 : 6+1+2;
+    return min_t(int, (((gap3 - RATE_GAP3) * 10000) / w) * 100, 100000);
+}
+
+/* Bisect, to within 0.1%, for the largest skew towards @lim which still
+ * reads back. */
+static int rate_limit(const struct rate_fmt *f, int lim)
+{
+    int good = 0, bad = lim, mid;
+
+    if (rate_rw(f, lim))
+        return lim;
+    while ((bad - good > 1000) || (good - bad > 1000)) {
+        mid = (good + bad) / 2;
+        if (rate_rw(f, mid))
+            good = mid;
+        else
+            bad = mid;
+    }
+    return good;
+}
+
+static void rate_print(int ppm)
+{
+    unsigned int x = (ppm < 0) ? -ppm : ppm;
+    printk(" %c%u.%u%%", (ppm < 0) ? '-' : '+', x / 10000, (x / 1000) % 10);
+}
+
+/* Report the range of write data rates, within +/-10% of nominal, which
+ * each format reads back correctly. A slow limit marked "(gap)" is bounded
+ * by the gap after the sector, rather than by the read. */
+static void noinline rate_test(void)
+{
+    struct ibm_scan_info info[64];
+    const struct rate_fmt *f;
+    unsigned int i, gap3 = 0;
+    int hi;
+
+    printk("\nRATE TEST:\n");
+    floppy_select(0);
+
+    for (i = 0; i < ARRAY_SIZE(rate_fmts); i++) {
+        f = &rate_fmts[i];
+        da_select_image(f->image);
+        floppy_seek(f->idam.c, f->idam.h);
+        cur_drive->ticks_per_cell = f->ticks_per_cell;
+        if (f->type == RATE_mfm)
+            ibm_mfm_scan(info, ARRAY_SIZE(info), &gap3);
+        else if (f->type == RATE_fm)
+            ibm_fm_scan(info, ARRAY_SIZE(info), &gap3);
+        hi = rate_max_skew(f, gap3);
+        printk("%10s", f->name);
+        rate_print(rate_limit(f, -100000));
+        rate_print(rate_limit(f, hi));
+        printk("%s\n", (hi < 100000) ? " (gap)" : "");
+        /* Leave a good copy behind. */
+        WARN_ON(!rate_rw(f, 0));
+    }
+}
+
+/* Report, then reset, DMA ring health over the round. */
+static void dma_stats_report(void)
+{
+    printk("DMA: rdata overruns=%u hwm=%u/1024, "
+           "wdata underruns=%u hwm=%u/1024\n",
+           dma_stats.rdata_overruns, dma_stats.rdata_hwm,
+           dma_stats.wdata_underruns, dma_stats.wdata_hwm);
+    WARN_ON(dma_stats.rdata_overruns || dma_stats.wdata_underruns);
+    memset(&dma_stats, 0, sizeof(dma_stats));
 }
 
 int main(void)
@@ -520,6 +1072,7 @@ int main(void)
         if (HARD_SECTORS) {
             /* Requires different FF.CFG than other tests. */
             hfe_hard_sector_test();
+            dma_stats_report();
             canary_check();
             continue;
         }
@@ -529,6 +1082,9 @@ int main(void)
         adf_test(11);
         adf_test(22);
         img_test();
+        rate_test();
+        refill_bench();
+        dma_stats_report();
         canary_check();
     }
 
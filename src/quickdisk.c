@@ -48,6 +48,9 @@ void floppy_init(void)
         IRQx_enable(e->irq);
     }
 
+    /* RDATA DMA IRQ is unmasked only during asynchronous reads. */
+    IRQx_set_prio(dma_rdata_irq, FLOPPY_IRQ_RDATA_PRI);
+
     /* RDATA Timer setup: 
      * The counter runs from 0x0000-0xFFFF inclusive at full SYSCLK rate.
      *  
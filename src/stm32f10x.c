@@ -176,6 +176,12 @@ static void peripheral_init(void)
     gpio_init(gpioc);
 }
 
+unsigned int thread_stack_free(void)
+{
+    return (unsigned long)__builtin_frame_address(0)
+        - (unsigned long)&_thread_stackbottom[1];
+}
+
 void stm32_init(void)
 {
     exception_init();